@@ -9,47 +9,163 @@
  * 2. Create Abstract Syntax Tree (= AST) (parse.c)
  *    (Create nodes by syntax rules)
  *
- * 3. Generate assembly codes by consuming AST (codegen.c)
+ * 3. Optimize AST (optimize.c)
+ *    (Fold constants, Reuse common subexpressions, Remove dead code)
+ *
+ * 4. Generate assembly codes by consuming AST (codegen.c)
+ *    (Instructions are rewritten by peephole optimizer before printed (peephole.c))
+ *    With -fir, AST is lowered to SSA form three-address code (ir.c) first,
+ *    and assembly is generated from it after register allocation (regalloc.c).
+ *
+ * 5. With -c, instructions are encoded into ELF64 object file (object.c)
+ *    instead of printed as assembly.
+ *
+ * Each source is compiled with its own `Compiler` context (driver.c),
+ * so that many sources can be compiled concurrently.
  *
  */
 
+#include <time.h>
+#include <unistd.h>
+
 #include "0cc.h"
 
 void expect(int, int, int);
 void runtest();
+void runbench();
 
 /* main */
 
 int main(int argc, char **argv) {
-    tokens = new_vector();
-    nodes = new_vector();
-    vars = new_map();
-    condition_count = 0;
+    Options opts = {0};
+    StrVec *inputs = new_strvec();
+    StrVec *option_args = new_strvec(); // compile options to forward to server
+    char *output = NULL;
+    char *socket_path = default_socket_path();
+    int server = 0;
+    int client = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-test") == 0) {
+            runtest();
+
+            return 0;
+        }
+
+        if (strcmp(argv[i], "-bench") == 0) {
+            runbench();
+
+            return 0;
+        }
+
+        if (strcmp(argv[i], "-server") == 0) {
+            server = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-client") == 0) {
+            client = 1;
+            continue;
+        }
+
+        int first = i;
+        int parsed = parse_option(&opts, argc, argv, &i);
+
+        if (parsed == 1) {
+            for (int j = first; j <= i; j++) {
+                strvec_push(option_args, argv[j]);
+            }
+            continue;
+        }
+
+        if (parsed < 0) {
+            fprintf(stderr, "Missing argument after %s.\n", argv[i]);
+            return 1;
+        }
 
-    if (argc != 2) {
+        if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-socket") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "Missing argument after %s.\n", argv[i]);
+                return 1;
+            }
+
+            if (argv[i][1] == 'o') {
+                output = argv[++i];
+            } else {
+                socket_path = argv[++i];
+            }
+            continue;
+        }
+
+        strvec_push(inputs, argv[i]);
+    }
+
+    if (server) {
+        return run_server(socket_path, opts.jobs);
+    }
+
+    if (inputs->len == 0) {
         fprintf(stderr, "Wrong number of arguments.\n");
         return 1;
     }
 
-    if (strcmp(argv[1], "-test") == 0) {
-        runtest();
+    // Ask running server to compile, or compile in this process if there is no server
+
+    if (client && inputs->len == 1) {
+        int status = run_client(socket_path, option_args, inputs->data[0], output);
+
+        if (status >= 0) {
+            return status;
+        }
+    }
+
+    // Many source files are compiled concurrently (`foo.c` to `foo.s`)
+
+    if (inputs->len > 1) {
+        for (size_t i = 0; i < inputs->len; i++) {
+            if (!is_source_path(inputs->data[i])) {
+                fprintf(stderr, "Not a source file: %s\n", inputs->data[i]);
+                return 1;
+            }
+        }
+
+        if (output != NULL) {
+            fprintf(stderr, "-o can't be used with multiple source files.\n");
+            return 1;
+        }
+
+        return compile_files(&opts, inputs->data, inputs->len) == 0 ? 0 : 1;
+    }
+
+    // One source uses threads for code generation
 
-        return 0;
+    if (opts.jobs <= 0) {
+        opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
     }
 
-    // Tokenize input
+    // Load input (file name ending with `.c`, or source string itself)
 
-    tokenize(argv[1]);
+    char *input = inputs->data[0];
+    Source *source = is_source_path(input) ? new_source_file(input) : new_source_string("<command line>", input);
 
-    // Convert tokens to nodes
+    if (source == NULL) {
+        fprintf(stderr, "Can't read input file: %s\n", input);
+        return 1;
+    }
 
-    program();
+    Emitter *emitter = output ? new_file_emitter(output) : new_emitter(1);
 
-    // Generate Assembly
+    if (emitter == NULL) {
+        fprintf(stderr, "Can't open output file: %s\n", output);
+        return 1;
+    }
 
-    codegen(nodes);
+    int status = compile(&opts, source, emitter, stderr);
 
-    return 0;
+    emit_close(emitter);
+    close_source(source);
+
+    return status;
 }
 
 /* Test code */
@@ -66,32 +182,252 @@ void expect(int line, int expected, int actual) {
 
 void runtest() {
     // Vector test
-    Vector *vec = new_vector();
+    LongVec *vec = new_longvec();
 
     expect(__LINE__, 0, vec->len);
 
     for (long i = 0; i < 100; i++) {
-        vec_push(vec, (void *)i);
+        longvec_push(vec, i);
+
+        // Elements are in the struct until it's full
+        if (i == 7) {
+            expect(__LINE__, 1, vec->data == vec->inline_data);
+        }
     }
 
     expect(__LINE__, 100, vec->len);
-    expect(__LINE__, 0, (long)vec->data[0]);
-    expect(__LINE__, 50, (long)vec->data[50]);
-    expect(__LINE__, 99, (long)vec->data[99]);
+    expect(__LINE__, 0, vec->data == vec->inline_data);
+    expect(__LINE__, 0, vec->data[0]);
+    expect(__LINE__, 50, vec->data[50]);
+    expect(__LINE__, 99, vec->data[99]);
+
+    longvec_reserve(vec, 1000);
+    expect(__LINE__, 1000, vec->capacity);
+    expect(__LINE__, 99, vec->data[99]);
+
+    longvec_free(vec);
+
+    // Elements are stored by value
+    TokenVec tokens;
+    tokenvec_init(&tokens);
+
+    for (int i = 0; i < 10; i++) {
+        tokenvec_push(&tokens, (Token){.value = i, .offset = i * 2});
+    }
+
+    expect(__LINE__, 10, tokens.len);
+    expect(__LINE__, 9, tokens.data[9].value);
+    expect(__LINE__, 18, tokens.data[9].offset);
+
+    tokenvec_destroy(&tokens);
+    expect(__LINE__, 0, tokens.len);
+    expect(__LINE__, 1, tokens.data == tokens.inline_data);
+
+    // Symbol table test
+    SymbolTable *symbols = new_symbol_table();
+    char *foo = intern(symbols, "foo", 3);
+    char *bar = intern(symbols, "barbaz", 3);
+
+    expect(__LINE__, 1, foo == intern(symbols, "foo", 3));
+    expect(__LINE__, 1, foo == intern(symbols, "foobar", 3));
+    expect(__LINE__, 1, bar == intern(symbols, "bar", 3));
+    expect(__LINE__, 0, foo == bar);
+    expect(__LINE__, 0, strcmp(bar, "bar"));
 
     // Map test
     Map *map = new_map();
 
-    expect(__LINE__, 0, (long)map_get(map, "foo"));
+    expect(__LINE__, 0, map_get(map, foo));
+
+    map_push(map, foo, 2);
+    expect(__LINE__, 2, map_get(map, foo));
+
+    map_push(map, bar, 4);
+    expect(__LINE__, 4, map_get(map, bar));
+
+    map_push(map, foo, 6);
+    expect(__LINE__, 6, map_get(map, foo));
+
+    // Enough keys to grow the table
+    char buf[16];
+    for (long i = 0; i < 1000; i++) {
+        int len = snprintf(buf, sizeof(buf), "v%ld", i);
+        map_push(map, intern(symbols, buf, len), i);
+    }
+
+    expect(__LINE__, 500, map_get(map, intern(symbols, "v500", 4)));
+    expect(__LINE__, 999, map_get(map, intern(symbols, "v999", 4)));
+    expect(__LINE__, 6, map_get(map, foo));
+    expect(__LINE__, 0, map_get(map, intern(symbols, "v1000", 5)));
+
+    // Arena test
+    Arena *a = new_arena();
 
-    map_push(map, "foo", (void *)2);
-    expect(__LINE__, 2, (long)map_get(map, "foo"));
+    long *x = arena_alloc(a, sizeof(long), ARENA_IDENT);
+    long *y = arena_alloc(a, sizeof(long), ARENA_IDENT);
+    *x = 1;
+    *y = 2;
+    expect(__LINE__, 1, *x);
+    expect(__LINE__, 2, *y);
+    expect(__LINE__, 2, a->count[ARENA_IDENT]);
 
-    map_push(map, "bar", (void *)4);
-    expect(__LINE__, 4, (long)map_get(map, "bar"));
+    char *s = arena_strndup(a, "foobar", 3);
+    expect(__LINE__, 0, strcmp(s, "foo"));
+    expect(__LINE__, 3, a->count[ARENA_IDENT]);
 
-    map_push(map, "foo", (void *)6);
-    expect(__LINE__, 6, (long)map_get(map, "foo"));
+    // Bigger than one chunk
+    char *big = arena_alloc(a, 1024 * 1024, ARENA_IDENT);
+    big[1024 * 1024 - 1] = 1;
+    expect(__LINE__, 1, big[1024 * 1024 - 1]);
+    expect(__LINE__, 2, a->chunks);
+
+    arena_free(a);
+
+    // AST test
+    Ast *ast = new_ast();
+
+    NodeId one = ast_add(ast, (Node){.type = NODE_NUM, .value = 1});
+    NodeId two = ast_add(ast, (Node){.type = NODE_NUM, .value = 2});
+    NodeId sum = ast_add(ast, (Node){.type = '+', .lhs = one, .rhs = two});
+    expect(__LINE__, 1, one);
+    expect(__LINE__, 2, ast->nodes.data[ast->nodes.data[sum].rhs].value);
+    expect(__LINE__, 16, sizeof(Node));
+
+    // Enough nodes to grow the array
+    NodeIdVec *stmts = new_nodeidvec();
+    for (int i = 0; i < 1000; i++) {
+        nodeidvec_push(stmts, ast_add(ast, (Node){.type = NODE_NUM, .value = i}));
+    }
+
+    uint32_t first = ast_add_extra(ast, stmts->data, stmts->len);
+    expect(__LINE__, 1000, ast->extra.len);
+    expect(__LINE__, 999, ast->nodes.data[ast->extra.data[first + 999]].value);
+    expect(__LINE__, 1, ast->nodes.data[ast->nodes.data[sum].lhs].value);
+
+    ast_clear(ast);
+    expect(__LINE__, 1, ast->nodes.len);
+    expect(__LINE__, 0, ast->extra.len);
+
+    nodeidvec_free(stmts);
+    ast_free(ast);
+
+    // Keyword test (perfect hash must not confuse keywords with identifiers)
+    expect(__LINE__, 1, keyword_type("if", 2) != keyword_type("ifs", 3));
+    expect(__LINE__, 1, keyword_type("else", 4) != keyword_type("elsa", 4));
+    expect(__LINE__, 1, keyword_type("return", 6) != keyword_type("rexurn", 6));
+    expect(__LINE__, 1, keyword_type("if", 2) != keyword_type("else", 4));
+    expect(__LINE__, 1, keyword_type("if", 2) != keyword_type("return", 6));
+    expect(__LINE__, 1, keyword_type("else", 4) != keyword_type("return", 6));
+    expect(__LINE__, keyword_type("foo", 3), keyword_type("_", 1));
 
     printf("OK\n");
 }
+
+/* Benchmark code */
+
+static double now() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Return throughput (MB/s) of tokenizing `src`
+static double bench_lexer(Source *src, int scalar) {
+    Options opts = {.scalar_lexer = scalar};
+    Compiler *cc = new_compiler(&opts, src, NULL, stderr);
+    int runs = 10;
+    double best = 0;
+
+    for (int i = 0; i < runs; i++) {
+        reset_compiler(cc, &opts, src, NULL, stderr);
+
+        double start = now();
+        tokenize(cc, src);
+        double elapsed = now() - start;
+
+        if (best == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    free_compiler(cc);
+
+    return src->len / best / (1024 * 1024);
+}
+
+// Return time (ns) per vector of pushing `len` elements to `count` vectors
+static double bench_small_vectors(int count, int len) {
+    long sum = 0;
+    double start = now();
+
+    for (int i = 0; i < count; i++) {
+        LongVec vec;
+        longvec_init(&vec);
+
+        for (int j = 0; j < len; j++) {
+            longvec_push(&vec, i + j);
+        }
+        sum += vec.data[len - 1];
+
+        longvec_destroy(&vec);
+    }
+
+    double elapsed = now() - start;
+
+    // Keep the loop from being optimized out
+    if (sum == 42) {
+        printf("\n");
+    }
+
+    return elapsed / count * 1e9;
+}
+
+// Return throughput (M elements/s) of pushing & summing `len` tokens
+static double bench_token_vector(size_t len) {
+    TokenVec *tokens = new_tokenvec();
+    long sum = 0;
+    double start = now();
+
+    for (size_t i = 0; i < len; i++) {
+        tokenvec_push(tokens, (Token){.type = i & 0xff, .value = i});
+    }
+    for (size_t i = 0; i < tokens->len; i++) {
+        sum += tokens->data[i].value;
+    }
+
+    double elapsed = now() - start;
+
+    tokenvec_free(tokens);
+
+    if (sum == 42) {
+        printf("\n");
+    }
+
+    return len / elapsed / 1e6;
+}
+
+void runbench() {
+    // Source with long identifiers, numbers and indentation (about 16MB)
+    char *line = "    resultValue%d = (firstOperand + 1234567) * secondOperand%d - 42;\n";
+    size_t capacity = 16 * 1024 * 1024;
+    char *data = malloc(capacity + 256);
+    size_t len = 0;
+
+    for (int i = 0; len < capacity; i++) {
+        len += sprintf(data + len, line, i % 100, i % 10);
+    }
+
+    Source src = {"<bench>", data, len, 0};
+
+    printf("lexer (%zu bytes):\n", len);
+    printf("  scalar: %8.1f MB/s\n", bench_lexer(&src, 1));
+    printf("  simd:   %8.1f MB/s\n", bench_lexer(&src, 0));
+
+    free(data);
+
+    printf("vectors:\n");
+    printf("  3 elements (inline):  %8.1f ns/vector\n", bench_small_vectors(1000000, 3));
+    printf("  12 elements (heap):   %8.1f ns/vector\n", bench_small_vectors(1000000, 12));
+    printf("  tokens by value:      %8.1f M/s\n", bench_token_vector(10 * 1000 * 1000));
+}
@@ -1,4 +1,7 @@
 #include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,18 +9,205 @@
 
 /* Structs & Enums */
 
-// Vector
+// Typed vector of `type` (functions are generated by DEFINE_VECTOR in container.c)
+// The first `inline_len` elements are stored in the struct itself, so small vectors don't malloc.
+// `data` may point into the struct, so a vector must not be copied by value.
+#define VECTOR_TYPE(name, type, inline_len) \
+    typedef struct {                        \
+        type *data;                         \
+        size_t len;                         \
+        size_t capacity;                    \
+        type inline_data[inline_len];       \
+    } name
+
+#define VECTOR_PROTOTYPES(name, prefix, type) \
+    name *new_##prefix();                     \
+    void prefix##_init(name *);               \
+    void prefix##_reserve(name *, size_t);    \
+    void prefix##_push(name *, type);         \
+    void prefix##_destroy(name *);            \
+    void prefix##_free(name *)
+
+VECTOR_TYPE(Vector, void *, 8);
+VECTOR_TYPE(StrVec, char *, 8);
+VECTOR_TYPE(LongVec, long, 8);
+
+// Map (keys are interned strings, so keys are compared by pointer)
 typedef struct {
-    void **data;
-    int capacity;
+    StrVec keys;
+    LongVec vals;
+    size_t *index; // open addressing hash table of (position in keys + 1), 0 means empty
+    size_t capacity; // size of index (power of 2)
+} Map;
+
+// Arena allocation category (used for stats)
+enum {
+    ARENA_IDENT,
+    ARENA_NUM_CATEGORIES,
+};
+
+// Arena chunk (arena memory is a linked list of chunks)
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+// Arena (bump-pointer allocator which owns compile-lifetime objects)
+typedef struct {
+    ArenaChunk *head;
+    size_t bytes[ARENA_NUM_CATEGORIES]; // allocated bytes per category
+    size_t count[ARENA_NUM_CATEGORIES]; // allocated objects per category
+    size_t chunks; // number of allocated chunks
+    size_t reserved; // total bytes reserved by chunks
+    size_t peak_reserved; // high-water mark of `reserved`
+} Arena;
+
+// Arena position to release objects allocated after it
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+// Symbol table (interns identifiers so that each name has one canonical pointer)
+typedef struct {
+    char **keys;
+    unsigned int *hashes;
+    int capacity; // power of 2
     int len;
-} Vector;
+    Arena *arena; // owns names
+} SymbolTable;
+
+// Registers known by emitter
+enum {
+    REG_RAX,
+    REG_RDI,
+    REG_RDX,
+    REG_RBP,
+    REG_RSP,
+    REG_AL,
+    REG_RBX, // registers below are given to virtual registers by register allocator
+    REG_RCX,
+    REG_RSI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+};
 
-// Map
+// Instruction opcodes
+enum {
+    INST_NOP, // removed by peephole optimizer (not emitted)
+    INST_LABEL, // `.L<name><number>:` (operand is label)
+    INST_PUSH,
+    INST_POP,
+    INST_MOV,
+    INST_MOVZX,
+    INST_LEA,
+    INST_ADD,
+    INST_SUB,
+    INST_MUL,
+    INST_DIV,
+    INST_IMUL, // `imul x` (rdx:rax = rax * x) if `src` is none, `imul dst, src` otherwise
+    INST_CQO,
+    INST_IDIV,
+    INST_NEG,
+    INST_SHL,
+    INST_SHR,
+    INST_SAR,
+    INST_CMP,
+    INST_SETE,
+    INST_SETNE,
+    INST_SETL,
+    INST_SETLE,
+    INST_CMOVE,
+    INST_CMOVNE,
+    INST_CMOVL,
+    INST_CMOVLE,
+    INST_JE,
+    INST_JNE,
+    INST_JG,
+    INST_JGE,
+    INST_JMP,
+    INST_RET,
+};
+
+// Operand kinds
+enum {
+    OPND_NONE,
+    OPND_REG, // register `reg`
+    OPND_IMM, // immediate `value`
+    OPND_MEM, // memory `[reg + index * scale + value]`
+    OPND_LABEL, // label `.L<name><value>`
+    OPND_SYM, // symbolic operand `name` (e.g. `OFFSET .Lframe_size`)
+};
+
+// Instruction operand
 typedef struct {
-    Vector *keys;
-    Vector *vals;
-} Map;
+    int kind;
+    int reg;
+    long value;
+    char *name;
+    int index; // index register of memory operand (if `scale` is not 0)
+    int scale;
+} Operand;
+
+// Instruction (one-operand instructions use `dst`)
+typedef struct {
+    int op;
+    Operand dst;
+    Operand src;
+} Inst;
+
+VECTOR_TYPE(InstVec, Inst, 16);
+
+// Assembly output buffer
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+    int fd; // output file descriptor
+    InstVec *insts; // instructions kept to be encoded into object file (-c), NULL if printed
+} Emitter;
+
+// Rewrites of peephole optimizer (counted by pattern)
+enum {
+    PEEP_PUSH_POP, // `push r` ~ `pop r` -> (nothing)
+    PEEP_PUSH_POP_MOV, // `push r1` ~ `pop r2` -> `mov r2, r1`
+    PEEP_PUSH_POP_IMM, // `push imm` ~ `pop r` -> `mov r, imm`
+    PEEP_FRAME_LEA, // `mov r, rbp` `sub r, N` -> `lea r, [rbp-N]`
+    PEEP_FRAME_ADDR, // `lea r, [rbp-N]` ~ `[r]` -> `[rbp-N]`
+    PEEP_FRAME_REMAT, // `lea r, M` `push r` ~ `pop d` -> `lea d, M`
+    PEEP_IMM_OPERAND, // `mov r, imm` ~ `op x, r` -> `op x, imm`
+    PEEP_MOV_FORWARD, // `mov r, x` `mov d, r` -> `mov d, x`
+    PEEP_STORE_LOAD, // `mov [m], r` `mov d, [m]` -> `mov [m], r` `mov d, r`
+    PEEP_DEAD_CODE, // `mov r, x` -> (nothing) if `r` is not read
+    PEEP_NUM_RULES,
+};
+
+// Source code
+typedef struct {
+    char *name; // file name (or `<command line>`)
+    char *data; // source text (NOT '\0' terminated if mapped)
+    size_t len;
+    int mapped; // whether data is mapped by mmap(2)
+} Source;
+
+// Token
+typedef struct {
+    int type; // type of token
+    int value; // value of TK_NUM type token
+    char *name; // value of TK_IDENT type token (interned)
+    int offset; // position of token in source (to display error messages)
+    int len; // length of token in source
+} Token;
+
+VECTOR_TYPE(TokenVec, Token, 4);
 
 // Node type
 enum {
@@ -28,46 +218,306 @@ enum {
     NODE_NE,
     NODE_LE,
     NODE_LT,
-    NODE_IF, // `if` node (lhs has `if` condition assignment, rhs has NODE_IF_BODY node)
-    NODE_IF_BODY, // `if` body node (lhs has `if` statement, rhs has `else` statement)
-    NODE_BLOCK, // `{` `}` block node
+    NODE_IF, // `if` node (lhs is condition, `extra[rhs]` and `extra[rhs + 1]` are `if` and `else` statements)
+    NODE_BLOCK, // `{` `}` block node (statements are `extra[list.first]` ~ `extra[list.first + list.len - 1]`)
 };
 
-// Node (of Abstract Syntax Tree)
-typedef struct Node {
+// Index of node in `Ast` (0 means no node)
+typedef uint32_t NodeId;
+
+// Node (of Abstract Syntax Tree), `type` tells which member of payload is used
+typedef struct {
     int type; // Operator or NODE enum
-    struct Node *lhs;
-    struct Node *rhs;
-    int value; // value for NODE_NUM
-    char *name; // value for NODE_IDENT
-    Vector *stmts; // Vector which has statements in block node
+    int label; // label number for NODE_IF
+    union {
+        struct {
+            NodeId lhs;
+            NodeId rhs;
+        }; // operators, NODE_RETURN (lhs only) and NODE_IF
+        int value; // NODE_NUM
+        char *name; // NODE_IDENT
+        struct {
+            uint32_t first;
+            uint32_t len;
+        } list; // NODE_BLOCK
+    };
 } Node;
 
-/* Prototypes */
+VECTOR_TYPE(NodeVec, Node, 1);
+VECTOR_TYPE(NodeIdVec, NodeId, 8);
+
+// Node on explicit stack of tree walk (`state` tells what is done next), so that
+// long expressions don't exhaust C stack
+typedef struct {
+    NodeId id;
+    int state;
+    int arg; // argument of the walk for this node (e.g. register to evaluate it into)
+} Visit;
+
+VECTOR_TYPE(VisitVec, Visit, 16);
+
+// Abstract Syntax Tree (nodes refer to each other by index, so it can be serialized or relocated as is)
+typedef struct {
+    NodeVec nodes; // nodes.data[0] is unused
+    NodeIdVec extra; // statement lists of blocks and bodies of `if`
+} Ast;
+
+// IR opcodes
+enum {
+    IR_NOP, // removed instruction
+    IR_CONST, // dst = imm
+    IR_COPY, // dst = a (made when SSA is destructed)
+    IR_ADD, // dst = a + b
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_EQ,
+    IR_NE,
+    IR_LT,
+    IR_LE,
+    IR_LOAD, // dst = var (removed by SSA construction)
+    IR_STORE, // var = a (removed by SSA construction)
+    IR_PHI, // dst = phi(`ir->args[args]` ~, one per predecessor of block)
+    IR_BR, // goto a != 0 ? targets[0] : targets[1]
+    IR_JMP, // goto targets[0]
+    IR_RET, // return a
+};
+
+// IR instruction (three-address code on virtual registers, register 0 means none)
+typedef struct {
+    int op;
+    int dst;
+    int a;
+    int b;
+    long imm; // IR_CONST
+    char *var; // IR_LOAD, IR_STORE & IR_PHI (variable which phi merges)
+    uint32_t args; // IR_PHI
+    int targets[2]; // IR_BR & IR_JMP (block indices)
+} IrInst;
+
+VECTOR_TYPE(IntVec, int, 8);
+VECTOR_TYPE(IrInstVec, IrInst, 4);
+
+// Basic block (the last instruction is IR_BR, IR_JMP or IR_RET)
+typedef struct {
+    int id; // index in `ir->blocks`
+    IrInstVec insts;
+    IntVec preds; // predecessor blocks
+    int idom; // immediate dominator (entry block is its own)
+    IntVec frontier; // dominance frontier
+} IrBlock;
+
+// Location of virtual register given by register allocator
+typedef struct {
+    int reg; // REG_* (-1 if spilled)
+    int slot; // stack slot number, `[rbp - slot * 8]` (if spilled)
+} IrLoc;
+
+// IR of program (control flow graph of basic blocks, `blocks.data[0]` is entry)
+// Blocks are laid out in reverse postorder, so every edge goes forward.
+typedef struct {
+    Vector blocks; // IrBlock *
+    IntVec args; // arguments of phis
+    int reg_count; // virtual registers are 1 ~ reg_count
+    int undef; // register of constant 0 (value of variables read before assigned)
+    int ssa; // whether it's in SSA form
+
+    // Register allocation
+    IrLoc *locs; // location of each virtual register
+    int slot_count; // number of stack slots for spilled registers
+    int used_regs; // mask of allocated registers (1 << REG_*)
+} Ir;
+
+// Compile options
+typedef struct {
+    int streaming; // -stream
+    int show_stats; // -stats
+    int jobs; // -j (number of threads)
+    char *cache_dir; // -cache-dir
+    long cache_limit; // -cache-size (bytes)
+    int show_cache_stats; // -cache-stats
+    int scalar_lexer; // -fno-simd-lexer
+    int no_fold; // -fno-fold (constant folding)
+    int no_cse; // -fno-cse (common subexpression elimination)
+    int no_dce; // -fno-dce (dead code elimination)
+    int no_peephole; // -fno-peephole
+    int no_sethi_ullman; // -fno-sethi-ullman (evaluate every value through the stack)
+    int no_strength_reduce; // -fno-strength-reduce (multiply & divide by constant with `imul` & `idiv`)
+    int no_if_conversion; // -fno-if-conversion (branch instead of `cmov` for `if` ~ `else` assigning a variable)
+    int no_share_slots; // -fno-share-slots (give every variable its own stack slot)
+    int no_isel; // -fno-isel (load every operand into register instead of using memory & immediate operands)
+    int show_peephole_stats; // -peephole-stats
+    int use_ir; // -fir (generate code from SSA IR)
+    int dump_ir; // -dump-ir
+    int no_regalloc; // -fno-regalloc (keep every value of IR in stack slot)
+    int object; // -c (write ELF relocatable object instead of assembly)
+} Options;
+
+// Compiler context (all state of compiling one source)
+typedef struct {
+    Options *opts;
+    Source *source;
+    Emitter *emitter;
+    FILE *diag; // diagnostics output
 
-// Variables
-Vector *tokens;
-Vector *nodes;
-Map *vars;
-int condition_count;
+    // Tokenizer
+    TokenVec tokens;
+    int token_base; // position of `tokens.data[0]` (tokens before it are already released in streaming mode)
+    char *lex_start;
+    char *lex_p;
+    char *lex_end;
+
+    // Parser
+    int pos;
+    Ast *ast;
+    NodeId root; // NODE_BLOCK of top-level statements
+    Map *vars;
+    int condition_count; // number of labels for NODE_IF
+    NodeIdVec operands; // operand stack of expression parser
+    Vector operators; // operator stack of expression parser
+    NodeIdVec stmts; // statements of blocks being parsed
+    int stmt_depth; // nesting depth of statement being parsed
+    int temp_count; // number of temporary variables made by optimizer
+
+    // Code generator
+    long frame_size; // bytes of stack slots of variables (multiple of 16)
+    long peephole_counts[PEEP_NUM_RULES]; // rewrites by peephole optimizer
+
+    SymbolTable *symbols;
+
+    jmp_buf bail; // `error_at()` jumps here
+} Compiler;
+
+/* Prototypes */
 
 // Vector fucntions
-Vector *new_vector();
-void vec_push(Vector *, void *);
+VECTOR_PROTOTYPES(Vector, vec, void *);
+VECTOR_PROTOTYPES(StrVec, strvec, char *);
+VECTOR_PROTOTYPES(LongVec, longvec, long);
+VECTOR_PROTOTYPES(TokenVec, tokenvec, Token);
+VECTOR_PROTOTYPES(NodeVec, nodevec, Node);
+VECTOR_PROTOTYPES(NodeIdVec, nodeidvec, NodeId);
+VECTOR_PROTOTYPES(VisitVec, visitvec, Visit);
+VECTOR_PROTOTYPES(InstVec, instvec, Inst);
+VECTOR_PROTOTYPES(IntVec, intvec, int);
+VECTOR_PROTOTYPES(IrInstVec, irinstvec, IrInst);
 
 // Map fucntions
 Map *new_map();
-void map_push(Map *, char *, void *);
-void *map_get(Map *, char *);
+void map_push(Map *, char *, long);
+long map_get(Map *, char *);
+void map_clear(Map *);
+void map_free(Map *);
+
+// Symbol table functions
+SymbolTable *new_symbol_table();
+char *intern(SymbolTable *, char *, int);
+void symbol_table_clear(SymbolTable *);
+void symbol_table_free(SymbolTable *);
+
+// Arena functions
+Arena *new_arena();
+void *arena_alloc(Arena *, size_t, int);
+char *arena_strndup(Arena *, char *, size_t);
+ArenaMark arena_mark(Arena *);
+void arena_release(Arena *, ArenaMark);
+void arena_reset(Arena *);
+void arena_free(Arena *);
+void arena_dump_stats(Arena *, char *, FILE *);
+
+// AST functions
+Ast *new_ast();
+NodeId ast_add(Ast *, Node);
+uint32_t ast_add_extra(Ast *, NodeId *, uint32_t);
+void ast_clear(Ast *);
+void ast_free(Ast *);
+void ast_dump_stats(Ast *, FILE *);
+
+// Source functions
+Source *new_source_string(char *, char *);
+Source *new_source_file(char *);
+void close_source(Source *);
+int is_source_path(char *);
+
+// Driver functions
+int parse_option(Options *, int, char **, int *);
+Compiler *new_compiler(Options *, Source *, Emitter *, FILE *);
+void reset_compiler(Compiler *, Options *, Source *, Emitter *, FILE *);
+void free_compiler(Compiler *);
+int run_compiler(Compiler *);
+int compile(Options *, Source *, Emitter *, FILE *);
+int compile_file(Options *, char *, char *, FILE *);
+int compile_files(Options *, char **, int);
+
+// Cache functions
+uint64_t cache_key(Options *, Source *);
+int cache_lookup(Options *, uint64_t, Emitter *);
+void cache_store(Options *, uint64_t, Emitter *);
+void cache_dump_stats(FILE *);
+
+// Server functions
+char *default_socket_path();
+int run_server(char *, int);
+int run_client(char *, StrVec *, char *, char *);
 
 // Tokenize functions
-void tokenize(char *);
+void tokenize(Compiler *, Source *);
+void tokenize_start(Compiler *, Source *);
+int keyword_type(char *, int);
 
 // Parse fucntions
-void program();
+void program(Compiler *);
+void program_stream(Compiler *);
+void declare_var(Compiler *, char *);
+
+// Optimizer functions
+void optimize(Compiler *);
+NodeId optimize_stmt(Compiler *, NodeId);
+
+// IR functions
+Ir *build_ir(Compiler *);
+void construct_ssa(Ir *);
+void destruct_ssa(Ir *);
+void ir_dump(Ir *, FILE *);
+void ir_free(Ir *);
+
+// Register allocator functions
+void allocate_registers(Ir *, int);
+void allocate_slots(Compiler *, int);
 
 // Codegen fucntions
-void codegen(Vector *);
+void codegen(Compiler *);
+void codegen_ir(Compiler *, Ir *);
+void codegen_begin(Compiler *, int);
+void codegen_stmt(Compiler *, NodeId);
+void codegen_end(Compiler *, int);
+long align_frame(long);
+
+// Peephole optimizer functions
+void peephole(InstVec *, int, int, long *);
+void peephole_dump_stats(long *, FILE *);
+
+// Arithmetic lowering functions
+void lower_mul_imm(InstVec *, int, Operand, long);
+void lower_div_imm(InstVec *, int, Operand, long);
+
+// Emitter functions
+Emitter *new_emitter(int);
+Emitter *new_file_emitter(char *);
+Emitter *new_buffer_emitter();
+Emitter *new_inst_emitter();
+Emitter *new_chunk_emitter(Emitter *);
+void emit_append(Emitter *, Emitter *);
+void emit_flush(Emitter *);
+void emit_close(Emitter *);
+void emit_bytes(Emitter *, void *, size_t);
+void emit_line(Emitter *, char *);
+void emit_inst(Emitter *, Inst *);
+void emit_set(Emitter *, char *, long);
+
+// Object file functions
+void emit_object(Emitter *, InstVec *);
 
 // Utils
 noreturn void error(char*, char*);
+noreturn void error_at(Compiler *, int, char *);
@@ -0,0 +1,164 @@
+/*
+ * Arithmetic lowering
+ *
+ * Multiplication & division by constants are lowered to cheaper sequences
+ * than `imul` & `idiv` (strength reduction):
+ *
+ * - x * 2^k -> `shl`, x * 3, 5, 9 (times 2^k) -> `lea [x + x * 2]` (and `shl`)
+ * - x / 2^k -> bias negative x by 2^k - 1, then `sar` (rounds toward zero)
+ * - x / d   -> high half of x * magic number, then `sar` and round toward
+ *              zero (Hacker's Delight, 10-4)
+ *
+ * Division is signed and truncated like `idiv`, so results are the same
+ * as the general sequence (division by zero is left to `idiv`).
+ */
+
+#include "0cc.h"
+
+static Operand reg(int r) {
+    return (Operand){.kind = OPND_REG, .reg = r};
+}
+
+static Operand imm(long value) {
+    return (Operand){.kind = OPND_IMM, .value = value};
+}
+
+static void inst(InstVec *code, int op, Operand dst, Operand src) {
+    instvec_push(code, (Inst){op, dst, src});
+}
+
+static void inst1(InstVec *code, int op, Operand x) {
+    inst(code, op, x, (Operand){0});
+}
+
+static int is_same_reg(Operand *x, int r) {
+    return x->kind == OPND_REG && x->reg == r;
+}
+
+// log2 of `value` if it's a power of 2, -1 otherwise
+static int log2_exact(unsigned long value) {
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return -1;
+    }
+
+    return __builtin_ctzl(value);
+}
+
+// `dst = x * c` (`x` is register or memory, but not `rax` or `rdx`)
+void lower_mul_imm(InstVec *code, int dst, Operand x, long c) {
+    Operand r = reg(dst);
+    unsigned long abs_c = c < 0 ? -(unsigned long)c : (unsigned long)c;
+    int shift = __builtin_ctzl(abs_c | (1UL << 63));
+    unsigned long odd = abs_c >> shift;
+
+    if (c == 0) {
+        inst(code, INST_MOV, r, imm(0));
+        return;
+    }
+
+    if (!is_same_reg(&x, dst)) {
+        inst(code, INST_MOV, r, x);
+    }
+
+    if (odd != 1 && odd != 3 && odd != 5 && odd != 9) {
+        inst(code, INST_IMUL, r, imm(c));
+        return;
+    }
+
+    if (odd != 1) {
+        // `lea r, [r + r * (odd - 1)]`
+        Operand addr = {.kind = OPND_MEM, .reg = dst, .index = dst, .scale = odd - 1};
+        inst(code, INST_LEA, r, addr);
+    }
+
+    if (shift != 0) {
+        inst(code, INST_SHL, r, imm(shift));
+    }
+
+    if (c < 0) {
+        inst1(code, INST_NEG, r);
+    }
+}
+
+// Magic number & shift of signed division by `d` (d >= 2)
+static void signed_magic(unsigned long d, long *magic, int *shift) {
+    unsigned long two63 = 1UL << 63;
+    unsigned long anc = two63 - 1 - two63 % d; // absolute value of nc
+    unsigned long q1 = two63 / anc;
+    unsigned long r1 = two63 - q1 * anc;
+    unsigned long q2 = two63 / d;
+    unsigned long r2 = two63 - q2 * d;
+    unsigned long delta;
+    int p = 63;
+
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= d) {
+            q2++;
+            r2 -= d;
+        }
+        delta = d - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (long)(q2 + 1);
+    *shift = p - 64;
+}
+
+// `dst = x / d` (`x` is register or memory, but not `rax` or `rdx`, and `d` isn't 0)
+void lower_div_imm(InstVec *code, int dst, Operand x, long d) {
+    Operand r = reg(dst);
+    Operand rax = reg(REG_RAX);
+    Operand rdx = reg(REG_RDX);
+    unsigned long abs_d = d < 0 ? -(unsigned long)d : (unsigned long)d;
+    int k = log2_exact(abs_d);
+
+    if (abs_d == 1) {
+        if (!is_same_reg(&x, dst)) {
+            inst(code, INST_MOV, r, x);
+        }
+    } else if (k > 0) {
+        // (x + (x < 0 ? 2^k - 1 : 0)) >> k
+        inst(code, INST_MOV, rax, x);
+        if (k > 1) {
+            inst(code, INST_SAR, rax, imm(63));
+        }
+        inst(code, INST_SHR, rax, imm(64 - k));
+        inst(code, INST_ADD, rax, x);
+        inst(code, INST_SAR, rax, imm(k));
+        if (dst != REG_RAX) {
+            inst(code, INST_MOV, r, rax);
+        }
+    } else {
+        long magic;
+        int shift;
+        signed_magic(abs_d, &magic, &shift);
+
+        // High half of x * magic (magic is taken as negative if its top bit is set)
+        inst(code, INST_MOV, rax, imm(magic));
+        inst1(code, INST_IMUL, x);
+        if (magic < 0) {
+            inst(code, INST_ADD, rdx, x);
+        }
+        if (shift != 0) {
+            inst(code, INST_SAR, rdx, imm(shift));
+        }
+
+        // Add 1 if negative (round toward zero)
+        inst(code, INST_MOV, rax, rdx);
+        inst(code, INST_SHR, rax, imm(63));
+        inst(code, INST_ADD, rdx, rax);
+        inst(code, INST_MOV, r, rdx);
+    }
+
+    if (d < 0) {
+        inst1(code, INST_NEG, r);
+    }
+}
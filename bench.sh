@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# Compare generated code with different options
+# (size, memory operands & time to run the program many times)
+
+runs=200
+
+# Straight-line code with branches (about 100k statements)
+gen_mixed() {
+  awk 'BEGIN {
+  print "a = 1; b = 2; c = 3; d = 4;"
+  for (i = 0; i < 20000; i++) {
+    print "a = a + b * c - d; b = (a - c) / 3 + d;"
+    print "if (a < b) c = c + a - 1; else c = b - c + " i % 7 ";"
+    print "d = d + (a == b) + c * 2 - a;"
+  }
+  print "a + b + c + d;"
+}' > tmp-bench.c
+}
+
+# Multiplication & division by constants (small enough to stay in cache)
+gen_div() {
+  awk 'BEGIN {
+  print "a = 1000000; b = 7; c = 0 - 3; d = 5;"
+  for (i = 0; i < 1000; i++) {
+    print "a = a / 3 + b * 10 + 999983; b = a / 7 - c / 16;"
+    print "c = (b - a) / 10 + c * 9 - " i % 11 ";"
+    print "d = d / 2 + (a + b) / 1000 + c / 5;"
+  }
+  print "a + b + c + d;"
+}' > tmp-bench.c
+}
+
+# Calls the program as a function many times, so that starting process
+# and loading code are not measured
+cat > tmp-bench-main.c <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+long program(void) __asm__("_main");
+
+int main(int argc, char **argv) {
+    int calls = atoi(argv[1]);
+    struct timespec start, end;
+
+    program();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < calls; i++) {
+        program();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%.1f\n", ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / calls / 1000);
+    return 0;
+}
+EOF
+
+# `measure <options> [calls]` (with calls, time per warm call instead of runs)
+measure() {
+  ./0cc $1 tmp-bench.c > tmp-bench.s
+
+  insts=$(grep -c '^    ' tmp-bench.s)
+  mems=$(grep '\[\|push\|pop' tmp-bench.s | grep -vc 'lea')
+
+  if [ -n "$2" ]; then
+    gcc-15 -c tmp-bench.s -o tmp-bench.o
+    gcc-15 -O2 -z noexecstack tmp-bench-main.c tmp-bench.o -o tmp-bench
+    time=$(./tmp-bench "$2")
+    unit="us/call"
+  else
+    gcc-15 tmp-bench.s -o tmp-bench
+
+    start=$(date +%s%N)
+    for i in $(seq 1 $runs); do
+      ./tmp-bench
+    done
+    end=$(date +%s%N)
+    time="$(((end - start) / 100000))e-1"
+    unit="ms/$runs runs"
+  fi
+
+  printf "  %-26s %8d insts %8d memory accesses %8.1f %s\n" "${1:-(default)}" "$insts" "$mems" "$time" "$unit"
+}
+
+echo "generated code:"
+gen_mixed
+measure "-fno-sethi-ullman"
+measure "-fno-isel"
+measure ""
+measure "-fir -fno-regalloc"
+measure "-fir"
+
+echo "multiplication & division by constants:"
+gen_div
+measure "-fno-strength-reduce" 2000
+measure "" 2000
+measure "-fir -fno-strength-reduce" 2000
+measure "-fir" 2000
+
+rm -f tmp-bench*
@@ -0,0 +1,308 @@
+/*
+ * Compilation cache
+ *
+ * Assembly is stored in cache directory as `<key>.s`, where key is a hash
+ * of the compiler build, output-affecting options and the source bytes.
+ * Entries are written atomically (temporary file + rename), and the least
+ * recently used entries are removed when the directory exceeds its limit.
+ */
+
+// for utimensat(2)
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "0cc.h"
+
+// Identity of this compiler (Makefile defines it from hash of sources)
+#ifndef BUILD_ID
+#define BUILD_ID __DATE__ " " __TIME__
+#endif
+
+// Default limit of cache directory size
+#define CACHE_DEFAULT_LIMIT (64L * 1024 * 1024)
+
+// Counters of this process (reported by -cache-stats)
+static atomic_long cache_hits;
+static atomic_long cache_misses;
+static atomic_long cache_evictions;
+
+/* Hash (XXH64) */
+
+#define PRIME64_1 0x9E3779B185EBCA87UL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FUL
+#define PRIME64_3 0x165667B19E3779F9UL
+#define PRIME64_4 0x85EBCA77C2B2AE63UL
+#define PRIME64_5 0x27D4EB2F165667C5UL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t xxh64(char *p, size_t len, uint64_t seed) {
+    char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (end - p >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= (unsigned char)*p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* Cache functions */
+
+// Hash of things other than source which change output
+static uint64_t cache_seed(Options *opts) {
+    char buf[256];
+
+    int len = snprintf(buf, sizeof(buf), "0cc %s stream=%d fold=%d cse=%d dce=%d peephole=%d su=%d isel=%d sr=%d ifcvt=%d share=%d ir=%d regalloc=%d object=%d", BUILD_ID, opts->streaming, !opts->no_fold, !opts->no_cse, !opts->no_dce, !opts->no_peephole, !opts->no_sethi_ullman, !opts->no_isel, !opts->no_strength_reduce, !opts->no_if_conversion, !opts->no_share_slots, opts->use_ir, !opts->no_regalloc, opts->object);
+
+    return xxh64(buf, len, 0);
+}
+
+uint64_t cache_key(Options *opts, Source *src) {
+    return xxh64(src->data, src->len, cache_seed(opts));
+}
+
+static void cache_path(char *buf, size_t size, char *dir, uint64_t key) {
+    snprintf(buf, size, "%s/%016lx.s", dir, (unsigned long)key);
+}
+
+// Write cached assembly to `out`. Return 1 on hit.
+int cache_lookup(Options *opts, uint64_t key, Emitter *out) {
+    char path[4096];
+    cache_path(path, sizeof(path), opts->cache_dir, key);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        atomic_fetch_add(&cache_misses, 1);
+        return 0;
+    }
+
+    Emitter cached = {malloc(st.st_size + 1), 0, st.st_size + 1, -1};
+
+    while (cached.len < (size_t)st.st_size) {
+        ssize_t got = read(fd, cached.buf + cached.len, st.st_size - cached.len);
+
+        if (got <= 0) {
+            break;
+        }
+        cached.len += got;
+    }
+
+    close(fd);
+
+    if (cached.len != (size_t)st.st_size) {
+        free(cached.buf);
+        atomic_fetch_add(&cache_misses, 1);
+        return 0;
+    }
+
+    emit_append(out, &cached);
+    free(cached.buf);
+
+    // Mark as recently used (for eviction)
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    atomic_fetch_add(&cache_hits, 1);
+    return 1;
+}
+
+// Entry of cache directory (for eviction)
+typedef struct {
+    char *name;
+    off_t size;
+    time_t mtime;
+} CacheEntry;
+
+static int compare_cache_entry(const void *a, const void *b) {
+    const CacheEntry *x = a;
+    const CacheEntry *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Remove least recently used entries until directory fits in limit
+static void cache_evict(char *dir, long limit) {
+    DIR *d = opendir(dir);
+
+    if (d == NULL) {
+        return;
+    }
+
+    CacheEntry *entries = NULL;
+    int len = 0;
+    int capacity = 0;
+    long total = 0;
+    char path[4096];
+    struct dirent *ent;
+
+    while ((ent = readdir(d)) != NULL) {
+        size_t name_len = strlen(ent->d_name);
+
+        if (name_len != 18 || strcmp(ent->d_name + 16, ".s") != 0) {
+            continue;
+        }
+
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+
+        if (stat(path, &st) < 0) {
+            continue;
+        }
+
+        if (len == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, sizeof(CacheEntry) * capacity);
+        }
+
+        entries[len].name = strdup(ent->d_name);
+        entries[len].size = st.st_size;
+        entries[len].mtime = st.st_mtime;
+        len++;
+        total += st.st_size;
+    }
+
+    closedir(d);
+
+    qsort(entries, len, sizeof(CacheEntry), compare_cache_entry);
+
+    for (int i = 0; i < len && total > limit; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+
+        if (unlink(path) == 0) {
+            total -= entries[i].size;
+            atomic_fetch_add(&cache_evictions, 1);
+        }
+    }
+
+    for (int i = 0; i < len; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+// Store assembly in `buf` as entry of `key`
+void cache_store(Options *opts, uint64_t key, Emitter *buf) {
+    char *dir = opts->cache_dir;
+    char path[4096];
+    char tmp_path[4096];
+
+    mkdir(dir, 0755);
+
+    // Write to unique temporary file, then rename it,
+    // so that readers never see half-written entry
+    static atomic_long tmp_count;
+    snprintf(tmp_path, sizeof(tmp_path), "%s/tmp-%d-%ld", dir, (int)getpid(), atomic_fetch_add(&tmp_count, 1));
+    cache_path(path, sizeof(path), dir, key);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+    if (fd < 0) {
+        return;
+    }
+
+    char *p = buf->buf;
+    size_t len = buf->len;
+
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+
+        if (written <= 0) {
+            break;
+        }
+        p += written;
+        len -= written;
+    }
+
+    close(fd);
+
+    if (len > 0 || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return;
+    }
+
+    cache_evict(dir, opts->cache_limit > 0 ? opts->cache_limit : CACHE_DEFAULT_LIMIT);
+}
+
+void cache_dump_stats(FILE *out) {
+    fprintf(out, "cache stats: %ld hits, %ld misses, %ld evictions\n",
+            atomic_load(&cache_hits), atomic_load(&cache_misses), atomic_load(&cache_evictions));
+}
@@ -1,209 +1,1244 @@
 /*
  * Assembly Code Generator
+ *
+ * Top-level statements are split into chunks, and each chunk is generated
+ * on its own thread into a private buffer. Labels are numbered by the
+ * parser, so the output is the same regardless of the number of threads.
+ *
+ * Instructions are kept as records (`Inst`) until the end of each top-level
+ * statement, and then rewritten by peephole optimizer and printed.
+ *
+ * Expressions are covered by the cheapest tiles (variables and numbers are
+ * used as memory & immediate operands where instructions take them), and
+ * evaluated into a small set of registers in Sethi-Ullman order: the operand
+ * which needs more registers is evaluated first, so the stack is used only
+ * when the set is exhausted. (With -fno-sethi-ullman, every value goes
+ * through the stack.)
+ *
+ * A comparison in the condition of `if` is not turned into 0 or 1: `cmp` is
+ * followed by the jump, or by `cmov` when both arms just assign a variable or
+ * number to the same variable (if-conversion).
  */
 
+#include <pthread.h>
+
 #include "0cc.h"
 
-void prefix();
-void prologue();
-void epilogue();
-void generate(Node *);
-void gen_lval(Node *);
+// Tiles which cover expression node (instruction selection)
+enum {
+    TILE_LEAF, // `mov r, [rbp-N]` or `mov r, imm`
+    TILE_REG_REG, // `op r1, r2` (both operands in registers)
+    TILE_REG_OPND, // `op r, [rbp-N]` or `op r, imm` (right operand is leaf)
+    TILE_OPND_REG, // the same with operands swapped (commutative operator, left operand is leaf)
+    TILE_STORE, // `mov [rbp-N], r`
+    TILE_STORE_IMM, // `mov QWORD PTR [rbp-N], imm`
+};
 
-/* Assembly generator */
+// Label of expression node (0 if not computed yet)
+typedef struct {
+    uint8_t tile; // TILE_* which costs the least
+    uint8_t need; // registers needed (Sethi-Ullman number)
+    uint8_t has_assign; // whether it has assignment (its operands are evaluated from left to right)
+    int cost; // instructions to evaluate it into a register
+} Label;
+
+// Code generation state (one per thread)
+typedef struct {
+    Compiler *cc;
+    Emitter *out;
+    NodeId *stmts; // chunk of top-level statements
+    int len;
+    NodeId next; // top-level statement after chunk (0 if none)
+    InstVec code; // instructions not printed yet
+    long peephole_counts[PEEP_NUM_RULES];
+    Ir *ir; // IR being lowered (IR code generator)
+    Label *labels; // labels of nodes by NodeId (instruction selection)
+    int scratch; // registers which don't hold values across statements
+    IrInst **consts; // constant definitions of virtual registers (IR code generator)
+    int *uses; // use counts of virtual registers (IR code generator)
+} Codegen;
+
+// Don't split top-level statements into chunks smaller than this
+#define MIN_CHUNK_STMTS 512
+
+// Registers which expressions are evaluated into (Sethi-Ullman order)
+static int su_regs[] = {REG_RCX, REG_RSI, REG_R8, REG_R9, REG_R10, REG_R11};
+
+#define NUM_SU_REGS (int)(sizeof(su_regs) / sizeof(su_regs[0]))
 
-void codegen(Vector *nodes) {
-    prefix();
+// Registers used in a few instructions (`rax` also holds the value of statement)
+#define TEMP_REGS ((1 << REG_RAX) | (1 << REG_RDI) | (1 << REG_RDX))
 
-    prologue();
+void prefix(Codegen *);
+void prologue(Codegen *, Operand);
+void epilogue(Codegen *);
+void generate(Codegen *, NodeId);
+void gen_lval(Codegen *, NodeId);
 
-    // nodes's last element is EOF node, and we will ignore it
-    for (int i = 0; i < nodes->len - 1; i++) {
-        Node *node = (Node *)nodes->data[i];
+/* Instructions */
+
+static Operand reg(int r) {
+    return (Operand){.kind = OPND_REG, .reg = r};
+}
+
+static Operand imm(long value) {
+    return (Operand){.kind = OPND_IMM, .value = value};
+}
+
+static Operand mem(int base) {
+    return (Operand){.kind = OPND_MEM, .reg = base};
+}
 
-        generate(node);
+static Operand label(char *name, int number) {
+    return (Operand){.kind = OPND_LABEL, .name = name, .value = number};
+}
+
+static void inst(Codegen *g, int op, Operand dst, Operand src) {
+    instvec_push(&g->code, (Inst){op, dst, src});
+}
+
+// op
+static void inst0(Codegen *g, int op) {
+    inst(g, op, (Operand){0}, (Operand){0});
+}
+
+// op x
+static void inst1(Codegen *g, int op, Operand x) {
+    inst(g, op, x, (Operand){0});
+}
+
+static void codegen_init(Codegen *g, Compiler *cc, Emitter *out) {
+    *g = (Codegen){.cc = cc, .out = out, .scratch = TEMP_REGS};
+    instvec_init(&g->code);
+
+    for (int i = 0; i < NUM_SU_REGS; i++) {
+        g->scratch |= 1 << su_regs[i];
+    }
+}
 
-        printf("    pop rax\n");
+// Optimize and print instructions. `live_out` is the mask of registers
+// which may be read after them (`rax` is the exit code of program).
+static void flush_code(Codegen *g, int live_out) {
+    if (!g->cc->opts->no_peephole) {
+        peephole(&g->code, live_out, g->scratch, g->peephole_counts);
     }
 
-    epilogue();
+    for (size_t i = 0; i < g->code.len; i++) {
+        emit_inst(g->out, &g->code.data[i]);
+    }
+
+    g->code.len = 0;
 }
 
-void gen_lval(Node *node) {
-    if (node->type != NODE_IDENT) {
-        error("Left value of assinment is not variable", NULL);
+// Flush the rest and add up stats (must not run concurrently with other codegens)
+static void codegen_finish(Codegen *g) {
+    flush_code(g, 1 << REG_RAX);
+
+    for (int i = 0; i < PEEP_NUM_RULES; i++) {
+        g->cc->peephole_counts[i] += g->peephole_counts[i];
+    }
+
+    instvec_destroy(&g->code);
+    free(g->labels);
+}
+
+/* Assembly generator */
+
+// Whether statement sets `rax` (every statement but empty block does)
+static int sets_rax(Compiler *cc, NodeId id) {
+    Node *node = &cc->ast->nodes.data[id];
+
+    if (node->type != NODE_BLOCK) {
+        return 1;
     }
 
-    long offset = (long)map_get(vars, node->name);
+    for (uint32_t i = 0; i < node->list.len; i++) {
+        if (sets_rax(cc, cc->ast->extra.data[node->list.first + i])) {
+            return 1;
+        }
+    }
 
-    printf("    mov rax, rbp\n");
-    printf("    sub rax, %ld\n", offset);
-    printf("    push rax\n");
+    return 0;
 }
 
-void generate(Node *node) {
-    if (node->type == NODE_RETURN) {
-        generate(node->lhs);
-        printf("    pop rax\n");
-        printf("    mov rsp, rbp\n");
-        printf("    pop rbp\n");
-        printf("    ret\n");
-        return;
+/* Instruction selection (tiling) & Sethi-Ullman order */
+
+static int is_leaf(Node *node) {
+    return node->type == NODE_NUM || node->type == NODE_IDENT;
+}
+
+// Instructions of operator with right operand `leaf` in place (register if NULL), -1 if it can't be
+static int op_cost(Codegen *g, int type, Node *leaf) {
+    int is_imm = leaf != NULL && leaf->type == NODE_NUM;
+
+    switch (type) {
+    case '+':
+    case '-':
+    case '*':
+        return 1;
+    case '/':
+        if (!is_imm) {
+            // `mov rax, x` `cqo` `idiv y` `mov r, rax`
+            return 4;
+        }
+
+        // Lowered to shifts or multiplication (longer than `idiv` but much faster)
+        return g->cc->opts->no_strength_reduce || leaf->value == 0 ? -1 : 4;
+    default:
+        // `cmp x, y` `setcc al` `movzx rax, al` `mov r, rax`
+        return 4;
     }
+}
+
+static int is_commutative(int type) {
+    return type == '+' || type == '*' || type == NODE_EQ || type == NODE_NE;
+}
+
+// Try to cover binary node by `tile` (`leaf` is the operand in place, `other` is in register)
+static void try_tile(Codegen *g, Label *label, int type, int tile, Node *leaf, NodeId other) {
+    int cost = op_cost(g, type, leaf);
 
-    if (node->type == NODE_NUM) {
-        printf("    push %d\n", node->value);
+    if (cost < 0) {
         return;
     }
 
-    if (node->type == NODE_EQ) {
-        generate(node->lhs);
-        generate(node->rhs);
-        printf("    pop rdi\n");
-        printf("    pop rax\n");
-        printf("    cmp rax, rdi\n");
-        printf("    sete al\n");
-        printf("    movzx rax, al\n"); // In Linux, use `movzb` instead.
-        printf("    push rax\n");
-        return;
+    Label *l = &g->labels[other];
+    cost += l->cost;
+
+    if (cost < label->cost) {
+        label->tile = tile;
+        label->cost = cost;
+        label->need = l->need;
     }
+}
 
-    if (node->type == NODE_NE) {
-        generate(node->lhs);
-        generate(node->rhs);
-        printf("    pop rdi\n");
-        printf("    pop rax\n");
-        printf("    cmp rax, rdi\n");
-        printf("    setne al\n");
-        printf("    movzx rax, al\n"); // In Linux, use `movzb` instead.
-        printf("    push rax\n");
+// Choose the cheapest tile for node whose children are labeled, and count registers it needs
+static void label_one(Codegen *g, NodeId id) {
+    Label *label = &g->labels[id];
+    Node *node = &g->cc->ast->nodes.data[id];
+
+    if (is_leaf(node)) {
+        *label = (Label){TILE_LEAF, 1, 0, 1};
         return;
     }
 
-    if (node->type == NODE_LE) {
-        generate(node->lhs);
-        generate(node->rhs);
-        printf("    pop rdi\n");
-        printf("    pop rax\n");
-        printf("    cmp rax, rdi\n");
-        printf("    setle al\n");
-        printf("    movzx rax, al\n"); // In Linux, use `movzb` instead.
-        printf("    push rax\n");
+    int isel = !g->cc->opts->no_isel;
+    Node *rhs_node = &g->cc->ast->nodes.data[node->rhs];
+    Label *rhs = &g->labels[node->rhs];
+
+    if (node->type == '=') {
+        if (isel && rhs_node->type == NODE_NUM) {
+            // Value is also set to register (and removed by peephole optimizer if it's not used)
+            *label = (Label){TILE_STORE_IMM, 1, 1, 2};
+        } else {
+            *label = (Label){TILE_STORE, rhs->need, 1, rhs->cost + 1};
+        }
         return;
     }
 
-    if (node->type == NODE_LT) {
-        generate(node->lhs);
-        generate(node->rhs);
-        printf("    pop rdi\n");
-        printf("    pop rax\n");
-        printf("    cmp rax, rdi\n");
-        printf("    setl al\n");
-        printf("    movzx rax, al\n"); // In Linux, use `movzb` instead.
-        printf("    push rax\n");
-        return;
+    Node *lhs_node = &g->cc->ast->nodes.data[node->lhs];
+    Label *lhs = &g->labels[node->lhs];
+    int need = lhs->need == rhs->need ? lhs->need + 1 : lhs->need > rhs->need ? lhs->need : rhs->need;
+
+    *label = (Label){TILE_REG_REG, need, lhs->has_assign | rhs->has_assign, lhs->cost + rhs->cost + op_cost(g, node->type, NULL)};
+
+    if (isel && is_leaf(rhs_node)) {
+        try_tile(g, label, node->type, TILE_REG_OPND, rhs_node, node->lhs);
     }
 
-    if (node->type == NODE_IDENT) {
-        gen_lval(node);
-        printf("    pop rax\n");
-        printf("    mov rax, [rax]\n");
-        printf("    push rax\n");
-        return;
+    // Swapped leaf is read after the other operand, so the other one must not assign
+    if (isel && is_leaf(lhs_node) && is_commutative(node->type) && !rhs->has_assign) {
+        try_tile(g, label, node->type, TILE_OPND_REG, lhs_node, node->rhs);
     }
+}
 
-    if (node->type == '=') {
-        gen_lval(node->lhs);
-        generate(node->rhs);
+// Label expression (children first, on explicit stack)
+static void label_node(Codegen *g, NodeId id) {
+    VisitVec stack;
+    visitvec_init(&stack);
+    visitvec_push(&stack, (Visit){id, 0});
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        Node *node = &g->cc->ast->nodes.data[v.id];
+
+        if (g->labels[v.id].need != 0) {
+            continue;
+        }
 
-        printf("    pop rdi\n");
-        printf("    pop rax\n");
-        printf("    mov [rax], rdi\n");
-        printf("    push rdi\n");
+        if (v.state == 0 && !is_leaf(node)) {
+            visitvec_push(&stack, (Visit){v.id, 1});
+            visitvec_push(&stack, (Visit){node->rhs, 0});
+            if (node->type != '=') {
+                visitvec_push(&stack, (Visit){node->lhs, 0});
+            }
+            continue;
+        }
+
+        label_one(g, v.id);
+    }
+
+    visitvec_destroy(&stack);
+}
+
+static Operand var_slot(Codegen *g, NodeId id) {
+    long offset = map_get(g->cc->vars, g->cc->ast->nodes.data[id].name);
+
+    return (Operand){.kind = OPND_MEM, .reg = REG_RBP, .value = -offset};
+}
+
+// Memory or immediate operand of leaf
+static Operand leaf_operand(Codegen *g, NodeId id) {
+    Node *node = &g->cc->ast->nodes.data[id];
+
+    return node->type == NODE_NUM ? imm(node->value) : var_slot(g, id);
+}
+
+// `dst = x * c` (`x` is not `rax` or `rdx`)
+static void gen_mul_imm(Codegen *g, int dst, Operand x, long c) {
+    if (!g->cc->opts->no_strength_reduce) {
+        lower_mul_imm(&g->code, dst, x, c);
         return;
     }
 
-    if (node->type == NODE_IF) {
-        condition_count++;
-        // Copy `condition_count` value, because this variable is not closed to this function
-        // and there is possibility of nested condition conrtol (e.x. if (true) if (false) stmt else stmt;)
-        // In such case, `condition_count` can't be stable value.
-        int label = condition_count;
-
-        generate(node->lhs);
-        Node *if_body = node->rhs;
-
-        if (if_body->rhs != NULL) {
-            // `if` ~ `else`
-            printf("    pop rax\n");
-            printf("    cmp rax, 0\n");
-            printf("    je .Lelse%d\n", label);
-            generate(if_body->lhs);
-            printf("    jmp .Lend%d\n", label);
-            printf(".Lelse%d:\n", label);
-            generate(if_body->rhs);
-            printf(".Lend%d:\n", label);
+    if (!(x.kind == OPND_REG && x.reg == dst)) {
+        inst(g, INST_MOV, reg(dst), x);
+    }
+    inst(g, INST_IMUL, reg(dst), imm(c));
+}
+
+// `result = lhs op rhs` (`result` is register of `lhs` or `rhs`)
+static void gen_binop(Codegen *g, int type, Operand lhs, Operand rhs, Operand result) {
+    int setcc;
+
+    switch (type) {
+    case '+':
+        if (rhs.kind == OPND_REG && rhs.reg == result.reg) {
+            inst(g, INST_ADD, result, lhs);
+        } else {
+            inst(g, INST_ADD, result, rhs);
+        }
+        return;
+    case '-':
+        if (lhs.kind == OPND_REG && lhs.reg == result.reg) {
+            inst(g, INST_SUB, result, rhs);
             return;
+        }
+
+        inst(g, INST_MOV, reg(REG_RAX), lhs);
+        inst(g, INST_SUB, reg(REG_RAX), rhs);
+        inst(g, INST_MOV, result, reg(REG_RAX));
+        return;
+    case '*':
+        if (rhs.kind == OPND_IMM) {
+            gen_mul_imm(g, result.reg, lhs, rhs.value);
+        } else if (rhs.kind == OPND_REG && rhs.reg == result.reg) {
+            inst(g, INST_IMUL, result, lhs);
         } else {
-            // `if` ~
-            printf("    pop rax\n");
-            printf("    cmp rax, 0\n");
-            printf("    je .Lend%d\n", label);
-            generate(if_body->lhs);
-            printf(".Lend%d:\n", label);
-            printf("    push rax\n");
+            inst(g, INST_IMUL, result, rhs);
+        }
+        return;
+    case '/':
+        if (rhs.kind == OPND_IMM) {
+            lower_div_imm(&g->code, result.reg, lhs, rhs.value);
             return;
         }
+
+        inst(g, INST_MOV, reg(REG_RAX), lhs);
+        inst0(g, INST_CQO);
+        inst1(g, INST_IDIV, rhs);
+        inst(g, INST_MOV, result, reg(REG_RAX));
+        return;
+    case NODE_EQ:
+        setcc = INST_SETE;
+        break;
+    case NODE_NE:
+        setcc = INST_SETNE;
+        break;
+    case NODE_LT:
+        setcc = INST_SETL;
+        break;
+    default:
+        setcc = INST_SETLE;
     }
 
-    if (node->type == NODE_BLOCK) {
-        for (int i = 0; i < node->stmts->len; i++) {
-            Node *item = (Node *)(node->stmts->data[i]);
-            generate(item);
+    inst(g, INST_CMP, lhs, rhs);
+    inst1(g, setcc, reg(REG_AL));
+    inst(g, INST_MOVZX, reg(REG_RAX), reg(REG_AL));
+    inst(g, INST_MOV, result, reg(REG_RAX));
+}
+
+// Steps of evaluating node into register
+enum {
+    STEP_ENTER,
+    STEP_FIRST_DONE, // the first of two operands in registers is evaluated
+    STEP_OPERANDS_DONE,
+};
+
+// Whether right operand of TILE_REG_REG node is evaluated first
+// (heavier operand first, but operands with assignment are evaluated from left to right)
+static int is_rhs_first(Codegen *g, NodeId id) {
+    Node *node = &g->cc->ast->nodes.data[id];
+
+    return !g->labels[id].has_assign && g->labels[node->rhs].need > g->labels[node->lhs].need;
+}
+
+// Evaluate expression into `su_regs[k]` (registers after it may be used too).
+// If `lhs_opnd` is given, the operator of root (binary node) is not applied, and
+// its operands are returned instead. When no register is left for the second
+// operand, the first one is saved on the stack. Nodes are visited on explicit stack.
+static void gen_tree(Codegen *g, NodeId id, int k, Operand *lhs_opnd, Operand *rhs_opnd) {
+    VisitVec stack;
+    visitvec_init(&stack);
+    visitvec_push(&stack, (Visit){id, STEP_ENTER, k});
+
+    label_node(g, id);
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        Node *node = &g->cc->ast->nodes.data[v.id];
+        Label *label = &g->labels[v.id];
+        Operand r = reg(su_regs[v.arg]);
+        int spill = v.arg + 1 == NUM_SU_REGS;
+        int rhs_first = label->tile == TILE_REG_REG && is_rhs_first(g, v.id);
+        NodeId first = rhs_first ? node->rhs : node->lhs;
+        NodeId second = rhs_first ? node->lhs : node->rhs;
+
+        if (v.state == STEP_ENTER) {
+            switch (label->tile) {
+            case TILE_LEAF:
+                inst(g, INST_MOV, r, leaf_operand(g, v.id));
+                continue;
+            case TILE_STORE_IMM:
+                inst(g, INST_MOV, var_slot(g, node->lhs), leaf_operand(g, node->rhs));
+                inst(g, INST_MOV, r, leaf_operand(g, node->rhs));
+                continue;
+            case TILE_STORE:
+            case TILE_REG_OPND:
+                visitvec_push(&stack, (Visit){v.id, STEP_OPERANDS_DONE, v.arg});
+                visitvec_push(&stack, (Visit){label->tile == TILE_STORE ? node->rhs : node->lhs, STEP_ENTER, v.arg});
+                continue;
+            case TILE_OPND_REG:
+                // Swapped (the operator is commutative)
+                visitvec_push(&stack, (Visit){v.id, STEP_OPERANDS_DONE, v.arg});
+                visitvec_push(&stack, (Visit){node->rhs, STEP_ENTER, v.arg});
+                continue;
+            default:
+                visitvec_push(&stack, (Visit){v.id, STEP_FIRST_DONE, v.arg});
+                visitvec_push(&stack, (Visit){first, STEP_ENTER, v.arg});
+                continue;
+            }
         }
 
+        if (v.state == STEP_FIRST_DONE) {
+            if (spill) {
+                inst1(g, INST_PUSH, r);
+            }
+            visitvec_push(&stack, (Visit){v.id, STEP_OPERANDS_DONE, v.arg});
+            visitvec_push(&stack, (Visit){second, STEP_ENTER, spill ? v.arg : v.arg + 1});
+            continue;
+        }
+
+        Operand lhs, rhs;
+
+        switch (label->tile) {
+        case TILE_STORE:
+            inst(g, INST_MOV, var_slot(g, node->lhs), r);
+            continue;
+        case TILE_REG_OPND:
+            lhs = r;
+            rhs = leaf_operand(g, node->rhs);
+            break;
+        case TILE_OPND_REG:
+            lhs = r;
+            rhs = leaf_operand(g, node->lhs);
+            break;
+        default: {
+            Operand first_opnd = r;
+            Operand second_opnd = reg(su_regs[v.arg + 1 - spill]);
+
+            if (spill) {
+                inst1(g, INST_POP, reg(REG_RDI));
+                first_opnd = reg(REG_RDI);
+            }
+
+            lhs = rhs_first ? second_opnd : first_opnd;
+            rhs = rhs_first ? first_opnd : second_opnd;
+        }
+        }
+
+        if (v.id == id && lhs_opnd != NULL) {
+            *lhs_opnd = lhs;
+            *rhs_opnd = rhs;
+            continue;
+        }
+
+        gen_binop(g, node->type, lhs, rhs, r);
+    }
+
+    visitvec_destroy(&stack);
+}
+
+// Evaluate expression into `su_regs[k]`
+static void gen_reg(Codegen *g, NodeId id, int k) {
+    gen_tree(g, id, k, NULL, NULL);
+}
+
+// Evaluate operands of binary node for `lhs op rhs` whose result goes to `su_regs[k]`
+static void gen_operands(Codegen *g, NodeId id, int k, Operand *lhs_opnd, Operand *rhs_opnd) {
+    gen_tree(g, id, k, lhs_opnd, rhs_opnd);
+}
+
+static void init_labels(Codegen *g) {
+    if (g->labels == NULL) {
+        // Pages are not touched until labels of their nodes are computed
+        g->labels = calloc(g->cc->ast->nodes.len, sizeof(Label));
+    }
+}
+
+// Evaluate expression into `rax`
+static void gen_value(Codegen *g, NodeId id) {
+    if (g->cc->opts->no_sethi_ullman) {
+        generate(g, id);
+        inst1(g, INST_POP, reg(REG_RAX));
         return;
     }
 
-    generate(node->lhs);
-    generate(node->rhs);
+    init_labels(g);
+    gen_reg(g, id, 0);
+    inst(g, INST_MOV, reg(REG_RAX), reg(su_regs[0]));
+}
 
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
+static int is_comparison(int type) {
+    return type == NODE_EQ || type == NODE_NE || type == NODE_LT || type == NODE_LE;
+}
 
-    switch (node->type) {
-    case '+':
-        printf("    add rax, rdi\n");
+// Set flags by condition, and return the comparison which is true if it holds.
+// Comparison is not turned into 0 or 1 (`rax` is set to 0 if `zero_rax`, as the value of false).
+static int gen_cond(Codegen *g, NodeId id, int zero_rax) {
+    Node *node = &g->cc->ast->nodes.data[id];
+    Operand lhs, rhs;
+
+    if (g->cc->opts->no_sethi_ullman || !is_comparison(node->type)) {
+        gen_value(g, id);
+        inst(g, INST_CMP, reg(REG_RAX), imm(0));
+        return NODE_NE;
+    }
+
+    init_labels(g);
+    gen_operands(g, id, 0, &lhs, &rhs);
+
+    if (zero_rax) {
+        inst(g, INST_MOV, reg(REG_RAX), imm(0));
+    }
+    inst(g, INST_CMP, lhs, rhs);
+
+    return node->type;
+}
+
+// Jump taken if comparison doesn't hold
+static int jump_unless(int type) {
+    switch (type) {
+    case NODE_EQ:
+        return INST_JNE;
+    case NODE_NE:
+        return INST_JE;
+    case NODE_LT:
+        return INST_JGE;
+    default:
+        return INST_JG;
+    }
+}
+
+static int cmov(int type) {
+    switch (type) {
+    case NODE_EQ:
+        return INST_CMOVE;
+    case NODE_NE:
+        return INST_CMOVNE;
+    case NODE_LT:
+        return INST_CMOVL;
+    default:
+        return INST_CMOVLE;
+    }
+}
+
+// Statement in block of one statement
+static Node *single_stmt(Ast *ast, NodeId id) {
+    Node *node = &ast->nodes.data[id];
+
+    while (node->type == NODE_BLOCK && node->list.len == 1) {
+        node = &ast->nodes.data[ast->extra.data[node->list.first]];
+    }
+
+    return node;
+}
+
+// `if (c) x = y; else x = z;` (`y` & `z` are variables or numbers) -> `cmov` instead of branches
+static int gen_select(Codegen *g, NodeId cond, NodeId if_body, NodeId else_body) {
+    Ast *ast = g->cc->ast;
+    Node *then_node = single_stmt(ast, if_body);
+    Node *else_node = single_stmt(ast, else_body);
+
+    if (g->cc->opts->no_if_conversion || g->cc->opts->no_sethi_ullman || then_node->type != '=' ||
+        else_node->type != '=' || ast->nodes.data[then_node->lhs].name != ast->nodes.data[else_node->lhs].name ||
+        !is_leaf(&ast->nodes.data[then_node->rhs]) || !is_leaf(&ast->nodes.data[else_node->rhs])) {
+        return 0;
+    }
+
+    // `mov` doesn't change flags, so values are loaded after comparison
+    int type = gen_cond(g, cond, 0);
+    Operand r = reg(su_regs[0]);
+    Operand value = leaf_operand(g, then_node->rhs);
+
+    inst(g, INST_MOV, r, leaf_operand(g, else_node->rhs));
+
+    if (value.kind == OPND_IMM) {
+        inst(g, INST_MOV, reg(su_regs[1]), value);
+        value = reg(su_regs[1]);
+    }
+
+    inst(g, cmov(type), r, value);
+    inst(g, INST_MOV, var_slot(g, then_node->lhs), r);
+    inst(g, INST_MOV, reg(REG_RAX), r);
+
+    return 1;
+}
+
+// Steps of generating statement
+enum {
+    STMT_ENTER,
+    STMT_IF_DONE, // `if` arm of `if` ~ `else` is generated
+    STMT_END, // the last arm of `if` is generated
+};
+
+// Statement leaves its value in `rax` (program exits with the value of the last one).
+// Nested statements are visited on explicit stack, so deep nesting doesn't exhaust C stack.
+static void gen_stmt(Codegen *g, NodeId id) {
+    Ast *ast = g->cc->ast;
+    VisitVec stack;
+    visitvec_init(&stack);
+    visitvec_push(&stack, (Visit){id, STMT_ENTER});
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        Node *node = &ast->nodes.data[v.id];
+
+        if (v.state == STMT_IF_DONE) {
+            inst1(g, INST_JMP, label("end", node->label));
+            inst1(g, INST_LABEL, label("else", node->label));
+            visitvec_push(&stack, (Visit){v.id, STMT_END});
+            visitvec_push(&stack, (Visit){ast->extra.data[node->rhs + 1], STMT_ENTER});
+            continue;
+        }
+
+        if (v.state == STMT_END) {
+            inst1(g, INST_LABEL, label("end", node->label));
+            continue;
+        }
+
+        if (node->type == NODE_RETURN) {
+            gen_value(g, node->lhs);
+            epilogue(g);
+            continue;
+        }
+
+        if (node->type == NODE_IF) {
+            // Label number is given by parser (not counted here),
+            // so that chunks generated concurrently don't collide
+            int number = node->label;
+            NodeId if_body = ast->extra.data[node->rhs];
+            NodeId else_body = ast->extra.data[node->rhs + 1];
+
+            // Arm which doesn't set `rax` leaves condition there, so it must be evaluated as value
+            int fused = sets_rax(g->cc, if_body) && (else_body == 0 || sets_rax(g->cc, else_body));
+
+            if (fused && else_body != 0 && gen_select(g, node->lhs, if_body, else_body)) {
+                continue;
+            }
+
+            int jump;
+
+            if (!fused) {
+                gen_value(g, node->lhs);
+                inst(g, INST_CMP, reg(REG_RAX), imm(0));
+                jump = INST_JE;
+            } else {
+                // Jump by flags of comparison (without `setcc`)
+                jump = jump_unless(gen_cond(g, node->lhs, else_body == 0));
+            }
+
+            if (else_body != 0) {
+                // `if` ~ `else`
+                inst1(g, jump, label("else", number));
+                visitvec_push(&stack, (Visit){v.id, STMT_IF_DONE});
+            } else {
+                // `if` ~ (condition is left in `rax` when body is skipped)
+                inst1(g, jump, label("end", number));
+                visitvec_push(&stack, (Visit){v.id, STMT_END});
+            }
+            visitvec_push(&stack, (Visit){if_body, STMT_ENTER});
+            continue;
+        }
+
+        if (node->type == NODE_BLOCK) {
+            for (uint32_t i = node->list.len; i > 0; i--) {
+                visitvec_push(&stack, (Visit){ast->extra.data[node->list.first + i - 1], STMT_ENTER});
+            }
+            continue;
+        }
+
+        // Expression statement
+        gen_value(g, v.id);
+    }
+
+    visitvec_destroy(&stack);
+}
+
+static void *gen_chunk(void *arg) {
+    Codegen *g = arg;
+
+    for (int i = 0; i < g->len; i++) {
+        gen_stmt(g, g->stmts[i]);
+
+        // Registers are dead at the end of statement, unless it gives the exit code
+        NodeId next = i + 1 < g->len ? g->stmts[i + 1] : g->next;
+        flush_code(g, next != 0 && sets_rax(g->cc, next) ? 0 : 1 << REG_RAX);
+    }
+
+    return NULL;
+}
+
+void codegen(Compiler *cc) {
+    codegen_begin(cc, 0);
+
+    Ast *ast = cc->ast;
+    Node *root = &ast->nodes.data[cc->root];
+    NodeId *stmts = ast->extra.data + root->list.first;
+    int len = root->list.len;
+
+    int chunks = len / MIN_CHUNK_STMTS;
+    if (chunks > cc->opts->jobs) {
+        chunks = cc->opts->jobs;
+    }
+
+    if (chunks <= 1) {
+        Codegen g;
+        codegen_init(&g, cc, cc->emitter);
+        g.stmts = stmts;
+        g.len = len;
+
+        gen_chunk(&g);
+        codegen_finish(&g);
+    } else {
+        Codegen *gs = calloc(chunks, sizeof(Codegen));
+        pthread_t *threads = calloc(chunks, sizeof(pthread_t));
+
+        for (int i = 0; i < chunks; i++) {
+            int begin = (long)len * i / chunks;
+            int end = (long)len * (i + 1) / chunks;
+
+            codegen_init(&gs[i], cc, new_chunk_emitter(cc->emitter));
+            gs[i].stmts = stmts + begin;
+            gs[i].len = end - begin;
+            gs[i].next = end < len ? stmts[end] : 0;
+            pthread_create(&threads[i], NULL, gen_chunk, &gs[i]);
+        }
+
+        // Concatenate in source order
+        for (int i = 0; i < chunks; i++) {
+            pthread_join(threads[i], NULL);
+            codegen_finish(&gs[i]);
+            emit_append(cc->emitter, gs[i].out);
+            emit_close(gs[i].out);
+        }
+
+        free(gs);
+        free(threads);
+    }
+
+    codegen_end(cc, 0);
+
+    if (cc->opts->show_peephole_stats) {
+        peephole_dump_stats(cc->peephole_counts, cc->diag);
+    }
+}
+
+// In streaming mode, frame size is unknown until all statements are parsed,
+// so prologue refers to a symbol which is defined by `codegen_end()`.
+void codegen_begin(Compiler *cc, int streaming) {
+    Codegen g;
+    codegen_init(&g, cc, cc->emitter);
+
+    prefix(&g);
+
+    if (streaming) {
+        prologue(&g, (Operand){.kind = OPND_SYM, .name = "OFFSET .Lframe_size"});
+    } else {
+        prologue(&g, imm(cc->frame_size));
+    }
+
+    codegen_finish(&g);
+}
+
+// Next statement is unknown, so `rax` is kept for exit code
+void codegen_stmt(Compiler *cc, NodeId node) {
+    Codegen g;
+    codegen_init(&g, cc, cc->emitter);
+
+    gen_stmt(&g, node);
+
+    codegen_finish(&g);
+}
+
+void codegen_end(Compiler *cc, int streaming) {
+    Codegen g;
+    codegen_init(&g, cc, cc->emitter);
+
+    epilogue(&g);
+
+    codegen_finish(&g);
+
+    if (streaming) {
+        emit_set(g.out, ".Lframe_size", align_frame(cc->vars->keys.len * 8));
+
+        if (cc->opts->show_peephole_stats) {
+            peephole_dump_stats(cc->peephole_counts, cc->diag);
+        }
+    }
+}
+
+/* IR code generator */
+
+// Registers saved by prologue if register allocator uses them
+static int callee_saved_regs[] = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+
+#define NUM_CALLEE_SAVED_REGS (int)(sizeof(callee_saved_regs) / sizeof(callee_saved_regs[0]))
+
+// `[rbp - slot * 8]`
+static Operand slot(int number) {
+    return (Operand){.kind = OPND_MEM, .reg = REG_RBP, .value = -8L * number};
+}
+
+// Register or stack slot of virtual register
+static Operand loc(Codegen *g, int r) {
+    IrLoc *l = &g->ir->locs[r];
+
+    return l->reg >= 0 ? reg(l->reg) : slot(l->slot);
+}
+
+static int same_operand(Operand *x, Operand *y) {
+    return x->kind == y->kind && x->reg == y->reg && x->value == y->value;
+}
+
+// `mov dst, src` (memory to memory goes through `rax`)
+static void move(Codegen *g, Operand dst, Operand src) {
+    if (same_operand(&dst, &src)) {
+        return;
+    }
+
+    if (dst.kind == OPND_MEM && src.kind == OPND_MEM) {
+        inst(g, INST_MOV, reg(REG_RAX), src);
+        src = reg(REG_RAX);
+    }
+
+    inst(g, INST_MOV, dst, src);
+}
+
+// Save (or restore) callee-saved registers used by register allocator
+// in slots after the ones of spilled virtual registers
+static void save_regs(Codegen *g, int restore) {
+    int number = g->ir->slot_count;
+
+    for (int i = 0; i < NUM_CALLEE_SAVED_REGS; i++) {
+        int r = callee_saved_regs[i];
+
+        if (g->ir->used_regs & (1 << r)) {
+            number++;
+
+            if (restore) {
+                inst(g, INST_MOV, reg(r), slot(number));
+            } else {
+                inst(g, INST_MOV, slot(number), reg(r));
+            }
+        }
+    }
+}
+
+static int frame_slots(Ir *ir) {
+    int number = ir->slot_count;
+
+    for (int i = 0; i < NUM_CALLEE_SAVED_REGS; i++) {
+        if (ir->used_regs & (1 << callee_saved_regs[i])) {
+            number++;
+        }
+    }
+
+    return number;
+}
+
+static int setcc(int ir_op) {
+    switch (ir_op) {
+    case IR_EQ:
+        return INST_SETE;
+    case IR_NE:
+        return INST_SETNE;
+    case IR_LT:
+        return INST_SETL;
+    default:
+        return INST_SETLE;
+    }
+}
+
+// Whether virtual register `r` is defined only by `IR_CONST` (the value is known)
+static int is_const(Codegen *g, int r) {
+    return g->consts[r] != NULL;
+}
+
+// Jump taken if comparison doesn't hold
+static int ir_jump_unless(int ir_op) {
+    switch (ir_op) {
+    case IR_EQ:
+        return INST_JNE;
+    case IR_NE:
+        return INST_JE;
+    case IR_LT:
+        return INST_JGE;
+    default:
+        return INST_JG;
+    }
+}
+
+// Branch by value of `br->a`, or by flags of comparison `cmp` which defines it (if not NULL)
+static void gen_ir_branch(Codegen *g, IrInst *cmp, IrInst *br, int next_block) {
+    int jump = INST_JE;
+
+    if (cmp == NULL) {
+        inst(g, INST_CMP, loc(g, br->a), imm(0));
+    } else {
+        Operand a = loc(g, cmp->a);
+
+        if (a.kind != OPND_REG) {
+            inst(g, INST_MOV, reg(REG_RAX), a);
+            a = reg(REG_RAX);
+        }
+
+        inst(g, INST_CMP, a, loc(g, cmp->b));
+        jump = ir_jump_unless(cmp->op);
+    }
+
+    inst1(g, jump, label("bb", br->targets[1]));
+
+    if (br->targets[0] != next_block) {
+        inst1(g, INST_JMP, label("bb", br->targets[0]));
+    }
+}
+
+// Whether `insts[i]` is comparison only used by branch after it (then it's fused with the branch)
+static int is_branch_cond(Codegen *g, IrInstVec *insts, size_t i) {
+    IrInst *inst = &insts->data[i];
+
+    if (inst->op != IR_EQ && inst->op != IR_NE && inst->op != IR_LT && inst->op != IR_LE) {
+        return 0;
+    }
+
+    return i + 1 < insts->len && insts->data[i + 1].op == IR_BR && insts->data[i + 1].a == inst->dst &&
+           g->uses[inst->dst] == 1;
+}
+
+// Destination of instruction is never at the same place as its operands (see regalloc.c),
+// and `rax`, `rdi` & `rdx` are not allocated, so they hold values only within instruction
+static void gen_ir_inst(Codegen *g, IrInst *ir_inst, int next_block) {
+    Operand dst = loc(g, ir_inst->dst);
+    Operand a = loc(g, ir_inst->a);
+    Operand b = loc(g, ir_inst->b);
+
+    switch (ir_inst->op) {
+    case IR_CONST:
+        inst(g, INST_MOV, dst, imm(ir_inst->imm));
+        return;
+    case IR_COPY:
+        move(g, dst, a);
+        return;
+    case IR_ADD:
+    case IR_SUB: {
+        int op = ir_inst->op == IR_ADD ? INST_ADD : INST_SUB;
+
+        if (dst.kind == OPND_REG) {
+            move(g, dst, a);
+            inst(g, op, dst, b);
+            return;
+        }
+
+        inst(g, INST_MOV, reg(REG_RAX), a);
+        inst(g, op, reg(REG_RAX), b);
         break;
-    case '-':
-        printf("    sub rax, rdi\n");
+    }
+    case IR_MUL: {
+        Operand r = dst.kind == OPND_REG ? dst : reg(REG_RAX);
+
+        if (is_const(g, ir_inst->b)) {
+            gen_mul_imm(g, r.reg, a, g->consts[ir_inst->b]->imm);
+        } else if (is_const(g, ir_inst->a)) {
+            gen_mul_imm(g, r.reg, b, g->consts[ir_inst->a]->imm);
+        } else {
+            move(g, r, a);
+            inst(g, INST_IMUL, r, b);
+        }
+
+        if (dst.kind == OPND_REG) {
+            return;
+        }
         break;
-    case '*':
-        printf("    mul rdi\n");
+    }
+    case IR_DIV:
+        if (is_const(g, ir_inst->b) && g->consts[ir_inst->b]->imm != 0 && !g->cc->opts->no_strength_reduce) {
+            lower_div_imm(&g->code, dst.kind == OPND_REG ? dst.reg : REG_RAX, a, g->consts[ir_inst->b]->imm);
+
+            if (dst.kind == OPND_REG) {
+                return;
+            }
+            break;
+        }
+
+        inst(g, INST_MOV, reg(REG_RAX), a);
+        inst0(g, INST_CQO);
+        inst1(g, INST_IDIV, b);
         break;
-    case '/':
-        printf("    mov rdx, 0\n");
-        printf("    div rdi\n");
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+        if (a.kind != OPND_REG) {
+            inst(g, INST_MOV, reg(REG_RAX), a);
+            a = reg(REG_RAX);
+        }
+
+        inst(g, INST_CMP, a, b);
+        inst1(g, setcc(ir_inst->op), reg(REG_AL));
+        inst(g, INST_MOVZX, reg(REG_RAX), reg(REG_AL));
+        break;
+    case IR_BR:
+        gen_ir_branch(g, NULL, ir_inst, next_block);
+        return;
+    case IR_JMP:
+        // Fall through to the next block
+        if (ir_inst->targets[0] != next_block) {
+            inst1(g, INST_JMP, label("bb", ir_inst->targets[0]));
+        }
+        return;
+    case IR_RET:
+        move(g, reg(REG_RAX), a);
+        save_regs(g, 1);
+        epilogue(g);
+        return;
+    default:
+        error("IR is not lowered to registers\n", NULL);
     }
 
-    printf("    push rax\n");
+    inst(g, INST_MOV, dst, reg(REG_RAX));
+}
+
+// `IR_CONST` instruction of each virtual register which has no other definition (or NULL)
+static IrInst **find_consts(Ir *ir) {
+    IrInst **consts = calloc(ir->reg_count + 1, sizeof(IrInst *));
+    int *defs = calloc(ir->reg_count + 1, sizeof(int));
+
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrBlock *block = ir->blocks.data[i];
+
+        for (size_t j = 0; j < block->insts.len; j++) {
+            IrInst *inst = &block->insts.data[j];
+
+            if (inst->dst == 0) {
+                continue;
+            }
+
+            consts[inst->dst] = defs[inst->dst]++ == 0 && inst->op == IR_CONST ? inst : NULL;
+        }
+    }
+
+    free(defs);
+    return consts;
+}
+
+// Number of instructions which read each virtual register
+static int *count_uses(Ir *ir) {
+    int *uses = calloc(ir->reg_count + 1, sizeof(int));
+
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrBlock *block = ir->blocks.data[i];
+
+        for (size_t j = 0; j < block->insts.len; j++) {
+            uses[block->insts.data[j].a]++;
+            uses[block->insts.data[j].b]++;
+        }
+    }
+
+    return uses;
+}
+
+// Generate code from IR after register allocation (blocks are laid out in order of index)
+void codegen_ir(Compiler *cc, Ir *ir) {
+    Codegen g;
+    codegen_init(&g, cc, cc->emitter);
+    g.ir = ir;
+    g.scratch = TEMP_REGS; // others are allocated to virtual registers
+    g.consts = find_consts(ir);
+    g.uses = count_uses(ir);
+
+    prefix(&g);
+    prologue(&g, imm(align_frame(frame_slots(ir) * 8L)));
+    save_regs(&g, 0);
+
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrBlock *block = ir->blocks.data[i];
+
+        inst1(&g, INST_LABEL, label("bb", block->id));
+
+        for (size_t j = 0; j < block->insts.len; j++) {
+            if (is_branch_cond(&g, &block->insts, j)) {
+                gen_ir_branch(&g, &block->insts.data[j], &block->insts.data[j + 1], block->id + 1);
+                j++;
+                continue;
+            }
+
+            gen_ir_inst(&g, &block->insts.data[j], block->id + 1);
+        }
+
+        // `rax`, `rdi` & `rdx` are dead here
+        flush_code(&g, 0);
+    }
+
+    codegen_finish(&g);
+    free(g.consts);
+    free(g.uses);
+
+    if (cc->opts->show_peephole_stats) {
+        peephole_dump_stats(cc->peephole_counts, cc->diag);
+    }
+}
+
+void gen_lval(Codegen *g, NodeId id) {
+    Node *node = &g->cc->ast->nodes.data[id];
+
+    if (node->type != NODE_IDENT) {
+        // `assign()` rejects such code
+        error("Left value of assinment is not variable\n", NULL);
+    }
+
+    long offset = map_get(g->cc->vars, node->name);
+
+    inst(g, INST_MOV, reg(REG_RAX), reg(REG_RBP));
+    inst(g, INST_SUB, reg(REG_RAX), imm(offset));
+    inst1(g, INST_PUSH, reg(REG_RAX));
+}
+
+// Push value of expression (operands are visited on explicit stack)
+void generate(Codegen *g, NodeId id) {
+    VisitVec stack;
+    visitvec_init(&stack);
+    visitvec_push(&stack, (Visit){id, 0});
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        // Nodes are only read during code generation, so the pointer stays valid
+        Node *node = &g->cc->ast->nodes.data[v.id];
+
+        if (v.state == 0) {
+            switch (node->type) {
+            case NODE_NUM:
+                inst1(g, INST_PUSH, imm(node->value));
+                break;
+            case NODE_IDENT:
+                gen_lval(g, v.id);
+                inst1(g, INST_POP, reg(REG_RAX));
+                inst(g, INST_MOV, reg(REG_RAX), mem(REG_RAX));
+                inst1(g, INST_PUSH, reg(REG_RAX));
+                break;
+            case '=':
+                gen_lval(g, node->lhs);
+                visitvec_push(&stack, (Visit){v.id, 1});
+                visitvec_push(&stack, (Visit){node->rhs, 0});
+                break;
+            default:
+                // Left operand is pushed first
+                visitvec_push(&stack, (Visit){v.id, 1});
+                visitvec_push(&stack, (Visit){node->rhs, 0});
+                visitvec_push(&stack, (Visit){node->lhs, 0});
+            }
+            continue;
+        }
+
+        // Both operands are pushed
+        inst1(g, INST_POP, reg(REG_RDI));
+        inst1(g, INST_POP, reg(REG_RAX));
+
+        int setcc;
+
+        switch (node->type) {
+        case '=':
+            inst(g, INST_MOV, mem(REG_RAX), reg(REG_RDI));
+            inst1(g, INST_PUSH, reg(REG_RDI));
+            continue;
+        case '+':
+            inst(g, INST_ADD, reg(REG_RAX), reg(REG_RDI));
+            inst1(g, INST_PUSH, reg(REG_RAX));
+            continue;
+        case '-':
+            inst(g, INST_SUB, reg(REG_RAX), reg(REG_RDI));
+            inst1(g, INST_PUSH, reg(REG_RAX));
+            continue;
+        case '*':
+            inst(g, INST_IMUL, reg(REG_RAX), reg(REG_RDI));
+            inst1(g, INST_PUSH, reg(REG_RAX));
+            continue;
+        case '/':
+            inst0(g, INST_CQO);
+            inst1(g, INST_IDIV, reg(REG_RDI));
+            inst1(g, INST_PUSH, reg(REG_RAX));
+            continue;
+        case NODE_EQ:
+            setcc = INST_SETE;
+            break;
+        case NODE_NE:
+            setcc = INST_SETNE;
+            break;
+        case NODE_LT:
+            setcc = INST_SETL;
+            break;
+        default:
+            setcc = INST_SETLE;
+        }
+
+        inst(g, INST_CMP, reg(REG_RAX), reg(REG_RDI));
+        inst1(g, setcc, reg(REG_AL));
+        inst(g, INST_MOVZX, reg(REG_RAX), reg(REG_AL));
+        inst1(g, INST_PUSH, reg(REG_RAX));
+    }
+
+    visitvec_destroy(&stack);
+}
+
+// `rsp` is 16-byte aligned after `push rbp`, and kept so by frame size
+long align_frame(long size) {
+    return (size + 15) & ~15L;
 }
 
-void prologue() {
-    int total_vars = vars->keys->len;
-    printf("    push rbp\n");
-    printf("    mov rbp, rsp\n");
-    printf("    sub rsp, %d\n", total_vars * 8);
+void prologue(Codegen *g, Operand frame_size) {
+    inst1(g, INST_PUSH, reg(REG_RBP));
+    inst(g, INST_MOV, reg(REG_RBP), reg(REG_RSP));
+    inst(g, INST_SUB, reg(REG_RSP), frame_size);
 }
 
-void epilogue() {
-    printf("    mov rsp, rbp\n");
-    printf("    pop rbp\n");
-    printf("    ret\n");
+void epilogue(Codegen *g) {
+    inst(g, INST_MOV, reg(REG_RSP), reg(REG_RBP));
+    inst1(g, INST_POP, reg(REG_RBP));
+    inst0(g, INST_RET);
 }
 
-void prefix() {
-    printf(".intel_syntax noprefix\n");
-    printf(".global _main\n");
-    printf("_main:\n");
+void prefix(Codegen *g) {
+    emit_line(g->out, ".intel_syntax noprefix");
+    emit_line(g->out, ".global _main");
+    emit_line(g->out, "_main:");
 }
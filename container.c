@@ -2,57 +2,460 @@
  * Utility data structures
  *
  * Supported structures:
- * 1. Vector
+ * 1. Typed vectors (with small-buffer optimization)
  * 2. Map
+ * 3. Symbol table
+ * 4. Arena
+ * 5. AST (flat node array)
  */
 
 #include "0cc.h"
 
 /* Vector functions */
 
-Vector *new_vector() {
-    Vector *vec = malloc(sizeof(Vector));
+// Define functions of vector type declared by VECTOR_TYPE & VECTOR_PROTOTYPES
+#define DEFINE_VECTOR(name, prefix, type)                                        \
+    name *new_##prefix() {                                                       \
+        name *vec = malloc(sizeof(name));                                        \
+        prefix##_init(vec);                                                      \
+        return vec;                                                              \
+    }                                                                            \
+                                                                                 \
+    void prefix##_init(name *vec) {                                              \
+        vec->data = vec->inline_data;                                            \
+        vec->len = 0;                                                            \
+        vec->capacity = sizeof(vec->inline_data) / sizeof(type);                 \
+    }                                                                            \
+                                                                                 \
+    /* Make room for `capacity` elements (moves elements out of the struct) */   \
+    void prefix##_reserve(name *vec, size_t capacity) {                          \
+        if (capacity <= vec->capacity) {                                         \
+            return;                                                              \
+        }                                                                        \
+                                                                                 \
+        if (vec->data == vec->inline_data) {                                     \
+            vec->data = malloc(sizeof(type) * capacity);                         \
+            memcpy(vec->data, vec->inline_data, sizeof(type) * vec->len);        \
+        } else {                                                                 \
+            vec->data = realloc(vec->data, sizeof(type) * capacity);             \
+        }                                                                        \
+        vec->capacity = capacity;                                                \
+    }                                                                            \
+                                                                                 \
+    void prefix##_push(name *vec, type elem) {                                   \
+        if (vec->len == vec->capacity) {                                         \
+            prefix##_reserve(vec, vec->capacity * 2);                            \
+        }                                                                        \
+        vec->data[vec->len++] = elem;                                            \
+    }                                                                            \
+                                                                                 \
+    /* Free elements of vector which is not allocated by `new_*()` */            \
+    void prefix##_destroy(name *vec) {                                           \
+        if (vec->data != vec->inline_data) {                                     \
+            free(vec->data);                                                     \
+        }                                                                        \
+        prefix##_init(vec);                                                      \
+    }                                                                            \
+                                                                                 \
+    void prefix##_free(name *vec) {                                              \
+        prefix##_destroy(vec);                                                   \
+        free(vec);                                                               \
+    }
 
-    int default_capacity = 16;
+DEFINE_VECTOR(Vector, vec, void *)
+DEFINE_VECTOR(StrVec, strvec, char *)
+DEFINE_VECTOR(LongVec, longvec, long)
+DEFINE_VECTOR(TokenVec, tokenvec, Token)
+DEFINE_VECTOR(NodeVec, nodevec, Node)
+DEFINE_VECTOR(NodeIdVec, nodeidvec, NodeId)
+DEFINE_VECTOR(VisitVec, visitvec, Visit)
+DEFINE_VECTOR(InstVec, instvec, Inst)
+DEFINE_VECTOR(IntVec, intvec, int)
+DEFINE_VECTOR(IrInstVec, irinstvec, IrInst)
 
-    vec->data = malloc(sizeof(void *) * default_capacity);
-    vec->capacity = default_capacity;
-    vec->len = 0;
+/* Map functions */
 
-    return vec;
-}
+#define MAP_DEFAULT_CAPACITY 16
 
-void vec_push(Vector *vec, void *elem) {
-    if (vec->capacity == vec->len) {
-        vec->capacity *= 2;
-        vec->data = realloc(vec->data, sizeof(void *) * vec->capacity);
-    }
-    vec->data[vec->len] = elem;
-    vec->len++;
-}
+// Hash of interned key pointer
+static unsigned int hash_pointer(void *ptr) {
+    unsigned long x = (unsigned long)ptr >> 3;
 
-/* Map functions */
+    return (unsigned int)((x * 0x9E3779B97F4A7C15UL) >> 32);
+}
 
 Map *new_map() {
     Map *map = malloc(sizeof(Map));
 
-    map->keys = new_vector();
-    map->vals = new_vector();
+    strvec_init(&map->keys);
+    longvec_init(&map->vals);
+    map->capacity = MAP_DEFAULT_CAPACITY;
+    map->index = calloc(map->capacity, sizeof(size_t));
 
     return map;
 }
 
-void map_push(Map *map, char *key, void *val) {
-    vec_push(map->keys, (void *)key);
-    vec_push(map->vals, val);
+// Set `keys` position (0-origin) to index slot for key (overwrite if key exists)
+static void map_index_set(Map *map, char *key, size_t position) {
+    size_t mask = map->capacity - 1;
+
+    for (size_t i = hash_pointer(key) & mask;; i = (i + 1) & mask) {
+        size_t slot = map->index[i];
+
+        if (slot == 0 || map->keys.data[slot - 1] == key) {
+            map->index[i] = position + 1;
+            return;
+        }
+    }
+}
+
+static void map_grow(Map *map) {
+    free(map->index);
+
+    map->capacity *= 2;
+    map->index = calloc(map->capacity, sizeof(size_t));
+
+    // Re-insert from oldest to newest, so the last pushed key wins again
+    for (size_t i = 0; i < map->keys.len; i++) {
+        map_index_set(map, map->keys.data[i], i);
+    }
+}
+
+// `key` must be interned by `intern()`
+void map_push(Map *map, char *key, long val) {
+    strvec_push(&map->keys, key);
+    longvec_push(&map->vals, val);
+
+    // Keep load factor under 1/2
+    if (map->keys.len * 2 > map->capacity) {
+        map_grow(map);
+        return;
+    }
+
+    map_index_set(map, key, map->keys.len - 1);
+}
+
+// `key` must be interned by `intern()`. Return 0 if key is not found.
+long map_get(Map *map, char *key) {
+    size_t mask = map->capacity - 1;
+
+    for (size_t i = hash_pointer(key) & mask;; i = (i + 1) & mask) {
+        size_t slot = map->index[i];
+
+        if (slot == 0) {
+            return 0;
+        }
+
+        if (map->keys.data[slot - 1] == key) {
+            return map->vals.data[slot - 1];
+        }
+    }
+}
+
+// Remove every key (capacity is kept for reuse)
+void map_clear(Map *map) {
+    map->keys.len = 0;
+    map->vals.len = 0;
+    memset(map->index, 0, sizeof(size_t) * map->capacity);
+}
+
+void map_free(Map *map) {
+    strvec_destroy(&map->keys);
+    longvec_destroy(&map->vals);
+    free(map->index);
+    free(map);
+}
+
+/* Symbol table functions */
+
+#define SYMBOL_TABLE_DEFAULT_CAPACITY 256
+
+// FNV-1a
+static unsigned int hash_string(char *str, int len) {
+    unsigned int hash = 2166136261u;
+
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+SymbolTable *new_symbol_table() {
+    SymbolTable *table = malloc(sizeof(SymbolTable));
+
+    table->capacity = SYMBOL_TABLE_DEFAULT_CAPACITY;
+    table->len = 0;
+    table->keys = calloc(table->capacity, sizeof(char *));
+    table->hashes = calloc(table->capacity, sizeof(unsigned int));
+    table->arena = new_arena();
+
+    return table;
 }
 
-void *map_get(Map *map, char *key) {
-    for (int i = map->keys->len - 1; i >= 0; i--) {
-        if (strcmp((char *)map->keys->data[i], key) == 0) {
-            return map->vals->data[i];
+static void symbol_table_grow(SymbolTable *table) {
+    char **keys = table->keys;
+    unsigned int *hashes = table->hashes;
+    int capacity = table->capacity;
+
+    table->capacity *= 2;
+    table->keys = calloc(table->capacity, sizeof(char *));
+    table->hashes = calloc(table->capacity, sizeof(unsigned int));
+
+    int mask = table->capacity - 1;
+
+    for (int i = 0; i < capacity; i++) {
+        if (keys[i] == NULL) {
+            continue;
+        }
+
+        int j = hashes[i] & mask;
+        while (table->keys[j] != NULL) {
+            j = (j + 1) & mask;
         }
+        table->keys[j] = keys[i];
+        table->hashes[j] = hashes[i];
+    }
+
+    free(keys);
+    free(hashes);
+}
+
+// Return canonical (arena allocated) copy of str[0..len)
+char *intern(SymbolTable *table, char *str, int len) {
+    unsigned int hash = hash_string(str, len);
+    int mask = table->capacity - 1;
+    int i = hash & mask;
+
+    while (table->keys[i] != NULL) {
+        char *key = table->keys[i];
+
+        if (table->hashes[i] == hash && strncmp(key, str, len) == 0 && key[len] == '\0') {
+            return key;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    char *key = arena_strndup(table->arena, str, len);
+    table->keys[i] = key;
+    table->hashes[i] = hash;
+    table->len++;
+
+    if (table->len * 2 > table->capacity) {
+        symbol_table_grow(table);
+    }
+
+    return key;
+}
+
+// Forget every name (capacity and one arena chunk are kept for reuse)
+void symbol_table_clear(SymbolTable *table) {
+    memset(table->keys, 0, sizeof(char *) * table->capacity);
+    table->len = 0;
+    arena_reset(table->arena);
+}
+
+void symbol_table_free(SymbolTable *table) {
+    arena_free(table->arena);
+    free(table->keys);
+    free(table->hashes);
+    free(table);
+}
+
+/* Arena functions */
+
+// Default chunk size, bigger requests get a dedicated chunk
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 8
+
+static char *arena_category_names[ARENA_NUM_CATEGORIES] = {
+    "identifiers",
+};
+
+Arena *new_arena() {
+    Arena *arena = calloc(1, sizeof(Arena));
+
+    return arena;
+}
+
+static ArenaChunk *arena_new_chunk(Arena *arena, size_t size) {
+    size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + capacity);
+
+    if (chunk == NULL) {
+        error("Out of memory\n", NULL);
+    }
+
+    chunk->next = arena->head;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+
+    arena->head = chunk;
+    arena->chunks++;
+    arena->reserved += capacity;
+
+    if (arena->reserved > arena->peak_reserved) {
+        arena->peak_reserved = arena->reserved;
+    }
+
+    return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t size, int category) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaChunk *chunk = arena->head;
+
+    if (chunk == NULL || chunk->capacity - chunk->used < size) {
+        chunk = arena_new_chunk(arena, size);
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+
+    arena->bytes[category] += size;
+    arena->count[category]++;
+
+    return ptr;
+}
+
+char *arena_strndup(Arena *arena, char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1, ARENA_IDENT);
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+
+    return copy;
+}
+
+ArenaMark arena_mark(Arena *arena) {
+    ArenaMark mark;
+
+    mark.chunk = arena->head;
+    mark.used = arena->head ? arena->head->used : 0;
+
+    return mark;
+}
+
+// Release objects allocated after `mark` (chunks allocated after it are freed)
+void arena_release(Arena *arena, ArenaMark mark) {
+    while (arena->head != mark.chunk) {
+        ArenaChunk *chunk = arena->head;
+
+        arena->head = chunk->next;
+        arena->chunks--;
+        arena->reserved -= chunk->capacity;
+        free(chunk);
+    }
+
+    if (arena->head != NULL) {
+        arena->head->used = mark.used;
+    }
+}
+
+// Release every object but keep the oldest chunk for reuse, and clear stats
+void arena_reset(Arena *arena) {
+    while (arena->head != NULL && arena->head->next != NULL) {
+        ArenaChunk *chunk = arena->head;
+
+        arena->head = chunk->next;
+        free(chunk);
+    }
+
+    if (arena->head != NULL) {
+        arena->head->used = 0;
+    }
+
+    memset(arena->bytes, 0, sizeof(arena->bytes));
+    memset(arena->count, 0, sizeof(arena->count));
+    arena->chunks = arena->head ? 1 : 0;
+    arena->reserved = arena->head ? arena->head->capacity : 0;
+    arena->peak_reserved = arena->reserved;
+}
+
+// Release every object owned by arena at once
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    free(arena);
+}
+
+void arena_dump_stats(Arena *arena, char *title, FILE *out) {
+    size_t total_bytes = 0;
+    size_t total_count = 0;
+
+    fprintf(out, "arena stats (%s):\n", title);
+
+    for (int i = 0; i < ARENA_NUM_CATEGORIES; i++) {
+        fprintf(out, "  %-12s %10zu bytes %8zu objects\n", arena_category_names[i], arena->bytes[i], arena->count[i]);
+        total_bytes += arena->bytes[i];
+        total_count += arena->count[i];
     }
 
-    return NULL;
+    fprintf(out, "  %-12s %10zu bytes %8zu objects\n", "total", total_bytes, total_count);
+    fprintf(out, "  %-12s %10zu bytes %8zu chunks\n", "reserved", arena->reserved, arena->chunks);
+    fprintf(out, "  %-12s %10zu bytes\n", "peak", arena->peak_reserved);
+}
+
+/* AST functions */
+
+Ast *new_ast() {
+    Ast *ast = malloc(sizeof(Ast));
+
+    nodevec_init(&ast->nodes);
+    nodeidvec_init(&ast->extra);
+
+    ast_clear(ast);
+
+    return ast;
+}
+
+// Append node and return its index (pointers to nodes are invalidated)
+NodeId ast_add(Ast *ast, Node node) {
+    nodevec_push(&ast->nodes, node);
+
+    return ast->nodes.len - 1;
+}
+
+// Append `len` node indices to `extra` and return index of the first one
+uint32_t ast_add_extra(Ast *ast, NodeId *ids, uint32_t len) {
+    NodeIdVec *extra = &ast->extra;
+    uint32_t first = extra->len;
+
+    if (extra->capacity < extra->len + len) {
+        nodeidvec_reserve(extra, (extra->len + len) * 2);
+    }
+
+    memcpy(extra->data + first, ids, sizeof(NodeId) * len);
+    extra->len += len;
+
+    return first;
+}
+
+// Remove all nodes (memory is kept for reuse)
+void ast_clear(Ast *ast) {
+    // NodeId 0 is reserved for "no node"
+    ast->nodes.len = 0;
+    nodevec_push(&ast->nodes, (Node){0});
+    ast->extra.len = 0;
+}
+
+void ast_free(Ast *ast) {
+    nodevec_destroy(&ast->nodes);
+    nodeidvec_destroy(&ast->extra);
+    free(ast);
+}
+
+void ast_dump_stats(Ast *ast, FILE *out) {
+    fprintf(out, "ast stats:\n");
+    fprintf(out, "  %-12s %10zu bytes %8zu objects\n", "nodes", sizeof(Node) * ast->nodes.len, ast->nodes.len - 1);
+    fprintf(out, "  %-12s %10zu bytes %8zu objects\n", "extra", sizeof(NodeId) * ast->extra.len, ast->extra.len);
+    fprintf(out, "  %-12s %10zu bytes\n", "reserved", sizeof(Node) * ast->nodes.capacity + sizeof(NodeId) * ast->extra.capacity);
 }
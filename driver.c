@@ -0,0 +1,447 @@
+/*
+ * Compiler driver
+ *
+ * 0. parse_option(): parse compile options of command line
+ * 1. compile(): compile one source with its own compiler context
+ * 2. compile_file(): compile source file to assembly (or object) file
+ * 3. compile_files(): compile many source files concurrently on a thread pool
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "0cc.h"
+
+/* Options */
+
+// Parse compile option at argv[*i] (`*i` is moved to its last argument).
+// Return 1 if parsed, 0 if argv[*i] is not compile option, -1 if it's broken.
+int parse_option(Options *opts, int argc, char **argv, int *i) {
+    char *arg = argv[*i];
+
+    if (strcmp(arg, "-stats") == 0) {
+        opts->show_stats = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-stream") == 0) {
+        opts->streaming = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-simd-lexer") == 0) {
+        opts->scalar_lexer = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-fold") == 0) {
+        opts->no_fold = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-cse") == 0) {
+        opts->no_cse = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-dce") == 0) {
+        opts->no_dce = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-peephole") == 0) {
+        opts->no_peephole = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-sethi-ullman") == 0) {
+        opts->no_sethi_ullman = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-isel") == 0) {
+        opts->no_isel = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-share-slots") == 0) {
+        opts->no_share_slots = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-if-conversion") == 0) {
+        opts->no_if_conversion = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-strength-reduce") == 0) {
+        opts->no_strength_reduce = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-peephole-stats") == 0) {
+        opts->show_peephole_stats = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fir") == 0) {
+        opts->use_ir = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-fno-regalloc") == 0) {
+        opts->no_regalloc = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-c") == 0) {
+        opts->object = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-dump-ir") == 0) {
+        opts->dump_ir = 1;
+        return 1;
+    }
+
+    // Disable all optimizations
+    if (strcmp(arg, "-O0") == 0) {
+        opts->no_fold = 1;
+        opts->no_cse = 1;
+        opts->no_dce = 1;
+        opts->no_peephole = 1;
+        opts->no_sethi_ullman = 1;
+        opts->no_isel = 1;
+        opts->no_strength_reduce = 1;
+        opts->no_if_conversion = 1;
+        opts->no_share_slots = 1;
+        opts->no_regalloc = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-cache-stats") == 0) {
+        opts->show_cache_stats = 1;
+        return 1;
+    }
+
+    if (strcmp(arg, "-j") == 0 || strcmp(arg, "-cache-dir") == 0 || strcmp(arg, "-cache-size") == 0) {
+        if (*i + 1 == argc) {
+            return -1;
+        }
+
+        char *value = argv[++*i];
+
+        if (strcmp(arg, "-j") == 0) {
+            opts->jobs = atoi(value);
+        } else if (strcmp(arg, "-cache-dir") == 0) {
+            opts->cache_dir = value;
+        } else {
+            opts->cache_limit = atol(value);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Compiler context */
+
+Compiler *new_compiler(Options *opts, Source *src, Emitter *out, FILE *diag) {
+    Compiler *cc = calloc(1, sizeof(Compiler));
+
+    cc->opts = opts;
+    cc->source = src;
+    cc->emitter = out;
+    cc->diag = diag;
+
+    tokenvec_init(&cc->tokens);
+    cc->ast = new_ast();
+    cc->vars = new_map();
+    nodeidvec_init(&cc->operands);
+    vec_init(&cc->operators);
+    nodeidvec_init(&cc->stmts);
+    cc->symbols = new_symbol_table();
+
+    return cc;
+}
+
+// Make compiler ready for next source (allocated memory is kept for reuse)
+void reset_compiler(Compiler *cc, Options *opts, Source *src, Emitter *out, FILE *diag) {
+    cc->opts = opts;
+    cc->source = src;
+    cc->emitter = out;
+    cc->diag = diag;
+
+    cc->tokens.len = 0;
+    cc->token_base = 0;
+    cc->pos = 0;
+    ast_clear(cc->ast);
+    cc->root = 0;
+    map_clear(cc->vars);
+    cc->condition_count = 0;
+    cc->temp_count = 0;
+    memset(cc->peephole_counts, 0, sizeof(cc->peephole_counts));
+
+    symbol_table_clear(cc->symbols);
+}
+
+void free_compiler(Compiler *cc) {
+    tokenvec_destroy(&cc->tokens);
+    ast_free(cc->ast);
+    map_free(cc->vars);
+    nodeidvec_destroy(&cc->operands);
+    vec_destroy(&cc->operators);
+    nodeidvec_destroy(&cc->stmts);
+    symbol_table_free(cc->symbols);
+    free(cc);
+}
+
+/* Compile functions */
+
+// Compile `cc->source` to `cc->emitter`. Return 0 on success.
+int run_compiler(Compiler *cc) {
+    Options *opts = cc->opts;
+    Source *src = cc->source;
+    Emitter *out = cc->emitter;
+    uint64_t key = 0;
+    int status = 0;
+
+    if (opts->cache_dir != NULL) {
+        key = cache_key(opts, src);
+
+        if (cache_lookup(opts, key, out)) {
+            if (opts->show_cache_stats) {
+                cache_dump_stats(cc->diag);
+            }
+            return 0;
+        }
+
+        // Capture assembly to store it in cache
+        cc->emitter = new_buffer_emitter();
+    }
+
+    // Keep instructions to encode them at last
+    Emitter *asm_out = cc->emitter;
+
+    if (opts->object) {
+        cc->emitter = new_inst_emitter();
+    }
+
+    if (setjmp(cc->bail) != 0) {
+        // `error_at()` already reported the error
+        status = 1;
+    } else if (opts->streaming && !opts->object) {
+        // Tokenize, parse & generate assembly statement by statement
+        // (object file needs all instructions at once, so -c doesn't stream)
+
+        tokenize_start(cc, src);
+
+        codegen_begin(cc, 1);
+
+        program_stream(cc);
+
+        codegen_end(cc, 1);
+    } else {
+        // Tokenize input
+
+        tokenize(cc, src);
+
+        // Convert tokens to nodes
+
+        program(cc);
+
+        // Optimize nodes
+
+        optimize(cc);
+        allocate_slots(cc, !opts->no_share_slots);
+
+        // Generate Assembly (from SSA IR if requested)
+
+        if (opts->use_ir || opts->dump_ir) {
+            Ir *ir = build_ir(cc);
+            construct_ssa(ir);
+
+            if (opts->dump_ir) {
+                ir_dump(ir, cc->diag);
+            }
+
+            if (opts->use_ir) {
+                destruct_ssa(ir);
+                allocate_registers(ir, !opts->no_regalloc);
+                codegen_ir(cc, ir);
+            } else {
+                codegen(cc);
+            }
+
+            ir_free(ir);
+        } else {
+            codegen(cc);
+        }
+    }
+
+    if (opts->object) {
+        if (status == 0) {
+            emit_object(asm_out, cc->emitter->insts);
+        }
+
+        emit_close(cc->emitter);
+        cc->emitter = asm_out;
+    }
+
+    if (opts->cache_dir != NULL) {
+        // Failed compilation is not cached (to report its errors again)
+        if (status == 0) {
+            cache_store(opts, key, cc->emitter);
+        }
+
+        emit_append(out, cc->emitter);
+        emit_close(cc->emitter);
+        cc->emitter = out;
+    }
+
+    if (opts->show_stats) {
+        fprintf(cc->diag, "token stats:\n");
+        fprintf(cc->diag, "  %-12s %10zu bytes %8zu objects\n", "tokens", sizeof(Token) * cc->tokens.len, cc->tokens.len);
+        fprintf(cc->diag, "  %-12s %10zu bytes\n", "reserved", sizeof(Token) * cc->tokens.capacity);
+        ast_dump_stats(cc->ast, cc->diag);
+        arena_dump_stats(cc->symbols->arena, "identifiers", cc->diag);
+    }
+
+    if (opts->show_cache_stats) {
+        cache_dump_stats(cc->diag);
+    }
+
+    return status;
+}
+
+// Compile `src` and write assembly to `out`. Return 0 on success.
+int compile(Options *opts, Source *src, Emitter *out, FILE *diag) {
+    Compiler *cc = new_compiler(opts, src, out, diag);
+
+    int status = run_compiler(cc);
+
+    // Release tokens, nodes and identifiers at once
+
+    free_compiler(cc);
+
+    return status;
+}
+
+// Compile file `input` to file `output`. Return 0 on success.
+int compile_file(Options *opts, char *input, char *output, FILE *diag) {
+    Source *src = new_source_file(input);
+
+    if (src == NULL) {
+        fprintf(diag, "Can't read input file: %s\n", input);
+        return 1;
+    }
+
+    Emitter *out = new_file_emitter(output);
+
+    if (out == NULL) {
+        fprintf(diag, "Can't open output file: %s\n", output);
+        close_source(src);
+        return 1;
+    }
+
+    int status = compile(opts, src, out, diag);
+
+    emit_close(out);
+    close_source(src);
+
+    // Don't leave half-written assembly
+    if (status != 0) {
+        unlink(output);
+    }
+
+    return status;
+}
+
+/* Parallel driver */
+
+// Work queue shared by workers
+typedef struct {
+    Options *opts;
+    char **inputs;
+    int count;
+    int next; // index of next input to compile
+    int failures;
+    pthread_mutex_t lock;
+} WorkQueue;
+
+// `foo.c` -> `foo.s` (`foo.o` with -c)
+static char *output_path(char *input, int object) {
+    size_t len = strlen(input);
+    char *output = malloc(len + 1);
+
+    memcpy(output, input, len + 1);
+    output[len - 1] = object ? 'o' : 's';
+
+    return output;
+}
+
+static void *worker(void *arg) {
+    WorkQueue *queue = arg;
+
+    // Files are already compiled in parallel, so each file uses one thread
+    Options opts = *queue->opts;
+    opts.jobs = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int i = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (i >= queue->count) {
+            return NULL;
+        }
+
+        char *output = output_path(queue->inputs[i], opts.object);
+        int status = compile_file(&opts, queue->inputs[i], output, stderr);
+        free(output);
+
+        if (status != 0) {
+            pthread_mutex_lock(&queue->lock);
+            queue->failures++;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+}
+
+// Compile each `*.c` in inputs to `*.s` (or `*.o`) with `opts->jobs` threads (0 means number of cores).
+// Return number of inputs which failed to compile.
+int compile_files(Options *opts, char **inputs, int count) {
+    int jobs = opts->jobs;
+
+    if (jobs <= 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (jobs > count) {
+        jobs = count;
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    WorkQueue queue = {
+        .opts = opts,
+        .inputs = inputs,
+        .count = count,
+    };
+    pthread_mutex_init(&queue.lock, NULL);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * jobs);
+
+    for (int i = 0; i < jobs; i++) {
+        pthread_create(&threads[i], NULL, worker, &queue);
+    }
+
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&queue.lock);
+
+    return queue.failures;
+}
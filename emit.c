@@ -0,0 +1,380 @@
+/*
+ * Assembly emitter
+ *
+ * Instructions (records made by codegen) are printed to a large buffer by
+ * specialized routines (no format string parsing), and the buffer is written
+ * out with one `write` whenever it becomes full and at the end of compilation.
+ *
+ * Buffer emitter (without file descriptor) just grows its buffer instead.
+ *
+ * Instruction emitter (-c) keeps instruction records instead of printing them,
+ * and they are encoded into an object file at the end (object.c).
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "0cc.h"
+
+#define EMITTER_BUFFER_SIZE (1024 * 1024)
+#define BUFFER_EMITTER_DEFAULT_SIZE (64 * 1024)
+
+static char *reg_names[] = {
+    [REG_RAX] = "rax",
+    [REG_RDI] = "rdi",
+    [REG_RDX] = "rdx",
+    [REG_RBP] = "rbp",
+    [REG_RSP] = "rsp",
+    [REG_AL] = "al",
+    [REG_RBX] = "rbx",
+    [REG_RCX] = "rcx",
+    [REG_RSI] = "rsi",
+    [REG_R8] = "r8",
+    [REG_R9] = "r9",
+    [REG_R10] = "r10",
+    [REG_R11] = "r11",
+    [REG_R12] = "r12",
+    [REG_R13] = "r13",
+    [REG_R14] = "r14",
+    [REG_R15] = "r15",
+};
+
+static char *inst_names[] = {
+    [INST_PUSH] = "push",
+    [INST_POP] = "pop",
+    [INST_MOV] = "mov",
+    [INST_MOVZX] = "movzx", // In Linux, use `movzb` instead.
+    [INST_LEA] = "lea",
+    [INST_ADD] = "add",
+    [INST_SUB] = "sub",
+    [INST_MUL] = "mul",
+    [INST_DIV] = "div",
+    [INST_IMUL] = "imul",
+    [INST_CQO] = "cqo",
+    [INST_IDIV] = "idiv",
+    [INST_NEG] = "neg",
+    [INST_SHL] = "shl",
+    [INST_SHR] = "shr",
+    [INST_SAR] = "sar",
+    [INST_CMP] = "cmp",
+    [INST_SETE] = "sete",
+    [INST_SETNE] = "setne",
+    [INST_SETL] = "setl",
+    [INST_SETLE] = "setle",
+    [INST_CMOVE] = "cmove",
+    [INST_CMOVNE] = "cmovne",
+    [INST_CMOVL] = "cmovl",
+    [INST_CMOVLE] = "cmovle",
+    [INST_JE] = "je",
+    [INST_JNE] = "jne",
+    [INST_JG] = "jg",
+    [INST_JGE] = "jge",
+    [INST_JMP] = "jmp",
+    [INST_RET] = "ret",
+};
+
+static int reg_name_lens[] = {
+    [REG_RAX] = 3,
+    [REG_RDI] = 3,
+    [REG_RDX] = 3,
+    [REG_RBP] = 3,
+    [REG_RSP] = 3,
+    [REG_AL] = 2,
+    [REG_RBX] = 3,
+    [REG_RCX] = 3,
+    [REG_RSI] = 3,
+    [REG_R8] = 2,
+    [REG_R9] = 2,
+    [REG_R10] = 3,
+    [REG_R11] = 3,
+    [REG_R12] = 3,
+    [REG_R13] = 3,
+    [REG_R14] = 3,
+    [REG_R15] = 3,
+};
+
+/* Emitter functions */
+
+Emitter *new_emitter(int fd) {
+    Emitter *e = malloc(sizeof(Emitter));
+
+    e->buf = malloc(EMITTER_BUFFER_SIZE);
+    e->capacity = EMITTER_BUFFER_SIZE;
+    e->len = 0;
+    e->fd = fd;
+    e->insts = NULL;
+
+    return e;
+}
+
+// Open `path` for writing and create emitter for it, NULL if it can't be opened
+Emitter *new_file_emitter(char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    return new_emitter(fd);
+}
+
+// Emitter which keeps everything in memory
+Emitter *new_buffer_emitter() {
+    Emitter *e = malloc(sizeof(Emitter));
+
+    e->buf = malloc(BUFFER_EMITTER_DEFAULT_SIZE);
+    e->capacity = BUFFER_EMITTER_DEFAULT_SIZE;
+    e->len = 0;
+    e->fd = -1;
+    e->insts = NULL;
+
+    return e;
+}
+
+// Emitter which keeps instruction records (directives are dropped)
+Emitter *new_inst_emitter() {
+    Emitter *e = new_buffer_emitter();
+
+    e->insts = new_instvec();
+
+    return e;
+}
+
+// Emitter of a part of output, which is appended to `out` later
+Emitter *new_chunk_emitter(Emitter *out) {
+    return out->insts ? new_inst_emitter() : new_buffer_emitter();
+}
+
+void emit_flush(Emitter *e) {
+    if (e->fd < 0) {
+        return;
+    }
+
+    char *p = e->buf;
+    size_t len = e->len;
+
+    while (len > 0) {
+        ssize_t written = write(e->fd, p, len);
+
+        if (written < 0) {
+            error("Can't write assembly\n", NULL);
+        }
+
+        p += written;
+        len -= written;
+    }
+
+    e->len = 0;
+}
+
+// Flush and release emitter (closes fd except stdout)
+void emit_close(Emitter *e) {
+    emit_flush(e);
+
+    if (e->fd >= 0 && e->fd != STDOUT_FILENO) {
+        close(e->fd);
+    }
+
+    if (e->insts) {
+        instvec_free(e->insts);
+    }
+
+    free(e->buf);
+    free(e);
+}
+
+static void emit_grow(Emitter *e, size_t size) {
+    while (e->capacity - e->len < size) {
+        e->capacity *= 2;
+    }
+
+    e->buf = realloc(e->buf, e->capacity);
+}
+
+// Make sure that at least `size` bytes are left in buffer
+static inline void emit_reserve(Emitter *e, size_t size) {
+    if (e->capacity - e->len < size) {
+        if (e->fd < 0) {
+            emit_grow(e, size);
+        } else {
+            emit_flush(e);
+        }
+    }
+}
+
+static inline void put(Emitter *e, char *str, size_t len) {
+    memcpy(e->buf + e->len, str, len);
+    e->len += len;
+}
+
+static inline void put_char(Emitter *e, char c) {
+    e->buf[e->len++] = c;
+}
+
+static inline void put_reg(Emitter *e, int reg) {
+    put(e, reg_names[reg], reg_name_lens[reg]);
+}
+
+static inline void put_imm(Emitter *e, long value) {
+    char tmp[24];
+    int i = sizeof(tmp);
+    unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+
+    do {
+        tmp[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+
+    if (value < 0) {
+        tmp[--i] = '-';
+    }
+
+    put(e, tmp + i, sizeof(tmp) - i);
+}
+
+// Indent and opcode (with trailing space when operands follow)
+static inline void put_op(Emitter *e, char *op, int has_operands) {
+    put(e, "    ", 4);
+    put(e, op, strlen(op));
+
+    if (has_operands) {
+        put_char(e, ' ');
+    }
+}
+
+// Append everything emitted to `src`
+void emit_append(Emitter *e, Emitter *src) {
+    if (src->insts) {
+        instvec_reserve(e->insts, e->insts->len + src->insts->len);
+        for (size_t i = 0; i < src->insts->len; i++) {
+            instvec_push(e->insts, src->insts->data[i]);
+        }
+        return;
+    }
+
+    if (e->fd >= 0) {
+        // Large output goes to file directly
+        emit_flush(e);
+
+        Emitter tmp = *e;
+        tmp.buf = src->buf;
+        tmp.len = src->len;
+        emit_flush(&tmp);
+        return;
+    }
+
+    emit_reserve(e, src->len);
+    put(e, src->buf, src->len);
+}
+
+// Raw bytes (object file)
+void emit_bytes(Emitter *e, void *data, size_t len) {
+    emit_reserve(e, len);
+    put(e, data, len);
+}
+
+// Raw line (directive etc.)
+void emit_line(Emitter *e, char *line) {
+    if (e->insts) {
+        return;
+    }
+
+    size_t len = strlen(line);
+
+    emit_reserve(e, len + 1);
+    put(e, line, len);
+    put_char(e, '\n');
+}
+
+// .L<name><number>
+static inline void put_label(Emitter *e, Operand *label) {
+    put(e, ".L", 2);
+    put(e, label->name, strlen(label->name));
+    put_imm(e, label->value);
+}
+
+// `size` is needed when no register tells operand size (`mov QWORD PTR [rbp-8], 1`)
+static inline void put_operand(Emitter *e, Operand *opnd, int size) {
+    switch (opnd->kind) {
+    case OPND_REG:
+        put_reg(e, opnd->reg);
+        break;
+    case OPND_IMM:
+        put_imm(e, opnd->value);
+        break;
+    case OPND_MEM:
+        if (size) {
+            put(e, "QWORD PTR ", 10);
+        }
+        put_char(e, '[');
+        put_reg(e, opnd->reg);
+        if (opnd->scale != 0) {
+            put_char(e, '+');
+            put_reg(e, opnd->index);
+            put_char(e, '*');
+            put_imm(e, opnd->scale);
+        }
+        if (opnd->value != 0) {
+            if (opnd->value > 0) {
+                put_char(e, '+');
+            }
+            put_imm(e, opnd->value);
+        }
+        put_char(e, ']');
+        break;
+    case OPND_LABEL:
+        put_label(e, opnd);
+        break;
+    case OPND_SYM:
+        put(e, opnd->name, strlen(opnd->name));
+        break;
+    }
+}
+
+// One instruction (or label) per line
+void emit_inst(Emitter *e, Inst *inst) {
+    if (inst->op == INST_NOP) {
+        return;
+    }
+
+    if (e->insts) {
+        instvec_push(e->insts, *inst);
+        return;
+    }
+
+    emit_reserve(e, 128 + (inst->dst.name ? strlen(inst->dst.name) : 0) + (inst->src.name ? strlen(inst->src.name) : 0));
+
+    if (inst->op == INST_LABEL) {
+        put_label(e, &inst->dst);
+        put(e, ":\n", 2);
+        return;
+    }
+
+    put_op(e, inst_names[inst->op], inst->dst.kind != OPND_NONE);
+
+    if (inst->dst.kind != OPND_NONE) {
+        // Size of memory operand is told by the other operand if it's a register
+        put_operand(e, &inst->dst, inst->src.kind != OPND_REG);
+    }
+
+    if (inst->src.kind != OPND_NONE) {
+        put(e, ", ", 2);
+        put_operand(e, &inst->src, 0);
+    }
+
+    put_char(e, '\n');
+}
+
+// .set <name>, <value>
+void emit_set(Emitter *e, char *name, long value) {
+    if (e->insts) {
+        return;
+    }
+
+    emit_reserve(e, 64 + strlen(name));
+    put(e, ".set ", 5);
+    put(e, name, strlen(name));
+    put(e, ", ", 2);
+    put_imm(e, value);
+    put_char(e, '\n');
+}
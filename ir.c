@@ -0,0 +1,1028 @@
+/*
+ * Intermediate representation
+ *
+ * AST is lowered to three-address code on virtual registers. Code is split
+ * into basic blocks, which form the control flow graph of the program.
+ *
+ * 1. build_ir(): lower statements & expressions (variables are accessed by
+ *    IR_LOAD & IR_STORE)
+ * 2. construct_ssa(): promote variables to virtual registers (mem2reg),
+ *    inserting phis at iterated dominance frontiers of assignments
+ * 3. destruct_ssa(): replace phis with copies in predecessors
+ *
+ * Program exits with the value of the last statement (see optimize.c),
+ * so the value is kept in pseudo variable `.value` like other variables.
+ */
+
+#include "0cc.h"
+
+typedef struct {
+    Compiler *cc;
+    Ir *ir;
+    IrBlock *cur; // block which instructions are appended to
+    char *value_var; // `.value`
+} IrBuilder;
+
+/* Utils */
+
+static IrBlock *block_at(Ir *ir, int id) {
+    return ir->blocks.data[id];
+}
+
+static IrBlock *new_block(Ir *ir) {
+    IrBlock *block = calloc(1, sizeof(IrBlock));
+
+    block->id = ir->blocks.len;
+    irinstvec_init(&block->insts);
+    intvec_init(&block->preds);
+    intvec_init(&block->frontier);
+    vec_push(&ir->blocks, block);
+
+    return block;
+}
+
+static void free_block(IrBlock *block) {
+    irinstvec_destroy(&block->insts);
+    intvec_destroy(&block->preds);
+    intvec_destroy(&block->frontier);
+    free(block);
+}
+
+static int new_reg(Ir *ir) {
+    return ++ir->reg_count;
+}
+
+static IrInst *terminator(IrBlock *block) {
+    return &block->insts.data[block->insts.len - 1];
+}
+
+// Store successors of block to `succs`, and return the number of them
+static int successors(IrBlock *block, int *succs) {
+    IrInst *term = terminator(block);
+
+    switch (term->op) {
+    case IR_BR:
+        succs[0] = term->targets[0];
+        succs[1] = term->targets[1];
+        return 2;
+    case IR_JMP:
+        succs[0] = term->targets[0];
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Index of `pred` in predecessors of `block`
+static int pred_index(IrBlock *block, int pred) {
+    for (size_t i = 0; i < block->preds.len; i++) {
+        if (block->preds.data[i] == pred) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Whether instruction may be removed when its value is not used
+// (division by zero is undefined, so it needn't be kept like optimize.c)
+static int is_pure_inst(IrInst *inst) {
+    return inst->dst != 0 && inst->op != IR_LOAD;
+}
+
+/* IR builder */
+
+static int add_inst(IrBuilder *b, IrInst inst) {
+    irinstvec_push(&b->cur->insts, inst);
+
+    return inst.dst;
+}
+
+static void add_jmp(IrBuilder *b, IrBlock *target) {
+    add_inst(b, (IrInst){.op = IR_JMP, .targets = {target->id}});
+}
+
+static void add_store(IrBuilder *b, char *var, int value) {
+    add_inst(b, (IrInst){.op = IR_STORE, .var = var, .a = value});
+}
+
+static int ir_op(int node_type) {
+    switch (node_type) {
+    case '+':
+        return IR_ADD;
+    case '-':
+        return IR_SUB;
+    case '*':
+        return IR_MUL;
+    case '/':
+        return IR_DIV;
+    case NODE_EQ:
+        return IR_EQ;
+    case NODE_NE:
+        return IR_NE;
+    case NODE_LT:
+        return IR_LT;
+    case NODE_LE:
+        return IR_LE;
+    default:
+        error("Unknown operator in IR builder\n", NULL);
+    }
+}
+
+// Return register which has value of expression.
+// Operands are built in post-order on explicit stack (expressions may be very long).
+static int build_expr(IrBuilder *b, NodeId id) {
+    Node *nodes = b->cc->ast->nodes.data;
+    Ir *ir = b->ir;
+    VisitVec stack;
+    IntVec regs; // registers of operands
+
+    visitvec_init(&stack);
+    intvec_init(&regs);
+    visitvec_push(&stack, (Visit){id, 0});
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        Node *node = &nodes[v.id];
+
+        if (v.state == 0) {
+            switch (node->type) {
+            case NODE_NUM:
+                intvec_push(&regs, add_inst(b, (IrInst){.op = IR_CONST, .dst = new_reg(ir), .imm = node->value}));
+                break;
+            case NODE_IDENT:
+                intvec_push(&regs, add_inst(b, (IrInst){.op = IR_LOAD, .dst = new_reg(ir), .var = node->name}));
+                break;
+            case '=':
+                visitvec_push(&stack, (Visit){v.id, 1});
+                visitvec_push(&stack, (Visit){node->rhs, 0});
+                break;
+            default:
+                visitvec_push(&stack, (Visit){v.id, 1});
+                visitvec_push(&stack, (Visit){node->rhs, 0});
+                visitvec_push(&stack, (Visit){node->lhs, 0});
+            }
+            continue;
+        }
+
+        if (node->type == '=') {
+            // Value of assignment is the stored value (left on `regs`)
+            add_store(b, nodes[node->lhs].name, regs.data[regs.len - 1]);
+            continue;
+        }
+
+        int rhs_reg = regs.data[--regs.len];
+        int lhs_reg = regs.data[--regs.len];
+
+        intvec_push(&regs, add_inst(b, (IrInst){.op = ir_op(node->type), .dst = new_reg(ir), .a = lhs_reg, .b = rhs_reg}));
+    }
+
+    int reg = regs.data[0];
+
+    visitvec_destroy(&stack);
+    intvec_destroy(&regs);
+
+    return reg;
+}
+
+static void build_stmt(IrBuilder *b, NodeId id) {
+    Ast *ast = b->cc->ast;
+    Node *node = &ast->nodes.data[id];
+    Ir *ir = b->ir;
+
+    switch (node->type) {
+    case NODE_RETURN:
+        add_inst(b, (IrInst){.op = IR_RET, .a = build_expr(b, node->lhs)});
+
+        // Following statements are unreachable (the block is removed later)
+        b->cur = new_block(ir);
+        return;
+    case NODE_IF: {
+        NodeId if_body = ast->extra.data[node->rhs];
+        NodeId else_body = ast->extra.data[node->rhs + 1];
+        int cond = build_expr(b, node->lhs);
+
+        // Condition is the value of `if` when no arm sets it
+        add_store(b, b->value_var, cond);
+
+        IrBlock *then_block = new_block(ir);
+        IrBlock *else_block = else_body != 0 ? new_block(ir) : NULL;
+        IrBlock *join = new_block(ir);
+
+        add_inst(b, (IrInst){.op = IR_BR, .a = cond, .targets = {then_block->id, (else_block ? else_block : join)->id}});
+
+        b->cur = then_block;
+        build_stmt(b, if_body);
+        add_jmp(b, join);
+
+        if (else_block) {
+            b->cur = else_block;
+            build_stmt(b, else_body);
+            add_jmp(b, join);
+        }
+
+        b->cur = join;
+        return;
+    }
+    case NODE_BLOCK:
+        for (uint32_t i = 0; i < node->list.len; i++) {
+            build_stmt(b, ast->extra.data[node->list.first + i]);
+        }
+        return;
+    default:
+        add_store(b, b->value_var, build_expr(b, id));
+    }
+}
+
+// Lay out blocks in `order` (block indices are given again, and blocks not in it are removed)
+static void reorder_blocks(Ir *ir, IntVec *order) {
+    int count = ir->blocks.len;
+    int *new_ids = malloc(sizeof(int) * count);
+    IrBlock **blocks = malloc(sizeof(IrBlock *) * count);
+
+    for (int i = 0; i < count; i++) {
+        new_ids[i] = -1;
+        blocks[i] = block_at(ir, i);
+    }
+
+    for (size_t i = 0; i < order->len; i++) {
+        new_ids[order->data[i]] = i;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (new_ids[i] < 0) {
+            free_block(blocks[i]);
+        } else {
+            blocks[i]->id = new_ids[i];
+            ir->blocks.data[new_ids[i]] = blocks[i];
+        }
+    }
+
+    ir->blocks.len = order->len;
+
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrInst *term = terminator(block_at(ir, i));
+
+        if (term->op == IR_BR || term->op == IR_JMP) {
+            term->targets[0] = new_ids[term->targets[0]];
+            term->targets[1] = new_ids[term->targets[1]];
+        }
+    }
+
+    free(new_ids);
+    free(blocks);
+}
+
+// Lay out blocks reachable from entry in reverse postorder, so that every edge
+// goes forward (the program has no loops) and `if` arms follow their condition
+static void order_blocks(Ir *ir) {
+    int count = ir->blocks.len;
+    int *next_succ = calloc(count, sizeof(int));
+    char *visited = calloc(count, 1);
+    IntVec stack;
+    IntVec postorder;
+    intvec_init(&stack);
+    intvec_init(&postorder);
+
+    visited[0] = 1;
+    intvec_push(&stack, 0);
+
+    while (stack.len > 0) {
+        int id = stack.data[stack.len - 1];
+        int succs[2];
+        int n = successors(block_at(ir, id), succs);
+
+        // Visit the second successor first, so the first one comes first in reverse
+        if (next_succ[id] < n) {
+            int succ = succs[n - 1 - next_succ[id]++];
+
+            if (!visited[succ]) {
+                visited[succ] = 1;
+                intvec_push(&stack, succ);
+            }
+            continue;
+        }
+
+        stack.len--;
+        intvec_push(&postorder, id);
+    }
+
+    // Reverse in place
+    for (size_t i = 0, j = postorder.len - 1; i < j; i++, j--) {
+        int tmp = postorder.data[i];
+        postorder.data[i] = postorder.data[j];
+        postorder.data[j] = tmp;
+    }
+
+    reorder_blocks(ir, &postorder);
+
+    intvec_destroy(&stack);
+    intvec_destroy(&postorder);
+    free(next_succ);
+    free(visited);
+}
+
+static void compute_preds(Ir *ir) {
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        block_at(ir, i)->preds.len = 0;
+    }
+
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        int succs[2];
+        int n = successors(block_at(ir, i), succs);
+
+        for (int j = 0; j < n; j++) {
+            intvec_push(&block_at(ir, succs[j])->preds, i);
+        }
+    }
+}
+
+// Lower `cc->root` to IR (variables are not promoted to registers yet)
+Ir *build_ir(Compiler *cc) {
+    Ir *ir = calloc(1, sizeof(Ir));
+    vec_init(&ir->blocks);
+    intvec_init(&ir->args);
+
+    IrBuilder b = {cc, ir, new_block(ir), intern(cc->symbols, ".value", 6)};
+
+    // Variables read before assigned are 0 (including `.value` of empty program)
+    ir->undef = add_inst(&b, (IrInst){.op = IR_CONST, .dst = new_reg(ir), .imm = 0});
+    add_store(&b, b.value_var, ir->undef);
+
+    build_stmt(&b, cc->root);
+
+    int value = add_inst(&b, (IrInst){.op = IR_LOAD, .dst = new_reg(ir), .var = b.value_var});
+    add_inst(&b, (IrInst){.op = IR_RET, .a = value});
+
+    order_blocks(ir);
+    compute_preds(ir);
+
+    return ir;
+}
+
+/* SSA construction */
+
+// Dominator tree & dominance frontiers (Cooper, Harvey & Kennedy)
+static void compute_dominators(Ir *ir) {
+    int count = ir->blocks.len;
+    int *postorder = malloc(sizeof(int) * count); // postorder number of block
+    int *order = malloc(sizeof(int) * count); // blocks in postorder
+    int *next_succ = calloc(count, sizeof(int));
+    int numbered = 0;
+    IntVec stack;
+    intvec_init(&stack);
+
+    for (int i = 0; i < count; i++) {
+        postorder[i] = -1;
+        block_at(ir, i)->idom = -1;
+    }
+
+    // Depth first search without recursion (CFG is as deep as the program is long)
+    postorder[0] = -2;
+    intvec_push(&stack, 0);
+
+    while (stack.len > 0) {
+        int id = stack.data[stack.len - 1];
+        int succs[2];
+        int n = successors(block_at(ir, id), succs);
+
+        if (next_succ[id] < n) {
+            int succ = succs[next_succ[id]++];
+
+            if (postorder[succ] == -1) {
+                postorder[succ] = -2;
+                intvec_push(&stack, succ);
+            }
+            continue;
+        }
+
+        stack.len--;
+        postorder[id] = numbered;
+        order[numbered++] = id;
+    }
+
+    block_at(ir, 0)->idom = 0;
+
+    for (int changed = 1; changed;) {
+        changed = 0;
+
+        // Reverse postorder (except entry)
+        for (int i = numbered - 2; i >= 0; i--) {
+            IrBlock *block = block_at(ir, order[i]);
+            int idom = -1;
+
+            for (size_t j = 0; j < block->preds.len; j++) {
+                int pred = block->preds.data[j];
+
+                if (block_at(ir, pred)->idom < 0) {
+                    continue;
+                }
+
+                // Intersect
+                int a = pred;
+                int b = idom;
+
+                while (b >= 0 && a != b) {
+                    while (postorder[a] < postorder[b]) {
+                        a = block_at(ir, a)->idom;
+                    }
+                    while (postorder[b] < postorder[a]) {
+                        b = block_at(ir, b)->idom;
+                    }
+                }
+                idom = a;
+            }
+
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        IrBlock *block = block_at(ir, i);
+
+        if (block->preds.len < 2) {
+            continue;
+        }
+
+        for (size_t j = 0; j < block->preds.len; j++) {
+            for (int runner = block->preds.data[j]; runner != block->idom; runner = block_at(ir, runner)->idom) {
+                IntVec *frontier = &block_at(ir, runner)->frontier;
+
+                if (frontier->len == 0 || frontier->data[frontier->len - 1] != i) {
+                    intvec_push(frontier, i);
+                }
+            }
+        }
+    }
+
+    intvec_destroy(&stack);
+    free(postorder);
+    free(order);
+    free(next_succ);
+}
+
+typedef struct {
+    Ir *ir;
+    Map *var_ids; // variable -> index + 1
+    StrVec vars;
+    IntVec *stacks; // current values of variables (the last one is current)
+    IntVec log; // variables in the order values are pushed to `stacks`
+    int *replace; // register of IR_LOAD -> its value
+} Ssa;
+
+static int var_id(Ssa *ssa, char *var) {
+    return map_get(ssa->var_ids, var) - 1;
+}
+
+static int current_value(Ssa *ssa, char *var) {
+    IntVec *stack = &ssa->stacks[var_id(ssa, var)];
+
+    return stack->len > 0 ? stack->data[stack->len - 1] : ssa->ir->undef;
+}
+
+static void push_value(Ssa *ssa, char *var, int value) {
+    int id = var_id(ssa, var);
+
+    intvec_push(&ssa->stacks[id], value);
+    intvec_push(&ssa->log, id);
+}
+
+// Insert phis for each variable at iterated dominance frontier of blocks which assign it
+static void insert_phis(Ssa *ssa) {
+    Ir *ir = ssa->ir;
+    int count = ir->blocks.len;
+    int nvars = ssa->vars.len;
+    IntVec *defs = calloc(nvars, sizeof(IntVec)); // blocks which assign variable
+    IrInstVec *phis = calloc(count, sizeof(IrInstVec)); // phis to insert in block
+    int *has_phi = calloc(count, sizeof(int)); // variable id + 1 which phi is inserted for
+    int *in_work = calloc(count, sizeof(int));
+    IntVec work;
+    intvec_init(&work);
+
+    for (int i = 0; i < nvars; i++) {
+        intvec_init(&defs[i]);
+    }
+
+    for (int i = 0; i < count; i++) {
+        IrBlock *block = block_at(ir, i);
+        irinstvec_init(&phis[i]);
+
+        for (size_t j = 0; j < block->insts.len; j++) {
+            IrInst *inst = &block->insts.data[j];
+
+            if (inst->op == IR_STORE) {
+                IntVec *d = &defs[var_id(ssa, inst->var)];
+
+                if (d->len == 0 || d->data[d->len - 1] != i) {
+                    intvec_push(d, i);
+                }
+            }
+        }
+    }
+
+    for (int v = 0; v < nvars; v++) {
+        work.len = 0;
+
+        for (size_t i = 0; i < defs[v].len; i++) {
+            intvec_push(&work, defs[v].data[i]);
+            in_work[defs[v].data[i]] = v + 1;
+        }
+
+        while (work.len > 0) {
+            IntVec *frontier = &block_at(ir, work.data[--work.len])->frontier;
+
+            for (size_t i = 0; i < frontier->len; i++) {
+                int y = frontier->data[i];
+
+                if (has_phi[y] == v + 1) {
+                    continue;
+                }
+
+                IrBlock *block = block_at(ir, y);
+                uint32_t args = ir->args.len;
+
+                for (size_t j = 0; j < block->preds.len; j++) {
+                    intvec_push(&ir->args, 0);
+                }
+
+                irinstvec_push(&phis[y], (IrInst){.op = IR_PHI, .dst = new_reg(ir), .var = ssa->vars.data[v], .args = args});
+                has_phi[y] = v + 1;
+
+                if (in_work[y] != v + 1) {
+                    in_work[y] = v + 1;
+                    intvec_push(&work, y);
+                }
+            }
+        }
+    }
+
+    // Phis come first in block
+    for (int i = 0; i < count; i++) {
+        IrBlock *block = block_at(ir, i);
+
+        if (phis[i].len > 0) {
+            for (size_t j = 0; j < block->insts.len; j++) {
+                irinstvec_push(&phis[i], block->insts.data[j]);
+            }
+
+            irinstvec_destroy(&block->insts);
+            irinstvec_init(&block->insts);
+
+            for (size_t j = 0; j < phis[i].len; j++) {
+                irinstvec_push(&block->insts, phis[i].data[j]);
+            }
+        }
+
+        irinstvec_destroy(&phis[i]);
+    }
+
+    for (int i = 0; i < nvars; i++) {
+        intvec_destroy(&defs[i]);
+    }
+
+    intvec_destroy(&work);
+    free(defs);
+    free(phis);
+    free(has_phi);
+    free(in_work);
+}
+
+static int resolve(Ssa *ssa, int reg) {
+    return reg != 0 && ssa->replace[reg] != 0 ? ssa->replace[reg] : reg;
+}
+
+static void rename_block(Ssa *ssa, IrBlock *block) {
+    Ir *ir = ssa->ir;
+
+    for (size_t i = 0; i < block->insts.len; i++) {
+        IrInst *inst = &block->insts.data[i];
+
+        if (inst->op == IR_PHI) {
+            push_value(ssa, inst->var, inst->dst);
+            continue;
+        }
+
+        inst->a = resolve(ssa, inst->a);
+        inst->b = resolve(ssa, inst->b);
+
+        if (inst->op == IR_LOAD) {
+            ssa->replace[inst->dst] = current_value(ssa, inst->var);
+            inst->op = IR_NOP;
+        } else if (inst->op == IR_STORE) {
+            push_value(ssa, inst->var, inst->a);
+            inst->op = IR_NOP;
+        }
+    }
+
+    int succs[2];
+    int n = successors(block, succs);
+
+    for (int i = 0; i < n; i++) {
+        IrBlock *succ = block_at(ir, succs[i]);
+        int j = pred_index(succ, block->id);
+
+        for (size_t k = 0; k < succ->insts.len && succ->insts.data[k].op == IR_PHI; k++) {
+            IrInst *phi = &succ->insts.data[k];
+            ir->args.data[phi->args + j] = current_value(ssa, phi->var);
+        }
+    }
+}
+
+// Rename variables to registers in dominator tree order (without recursion)
+static void rename_vars(Ssa *ssa) {
+    Ir *ir = ssa->ir;
+    int count = ir->blocks.len;
+    int *first_child = malloc(sizeof(int) * count);
+    int *next_sibling = malloc(sizeof(int) * count);
+    int *log_len = malloc(sizeof(int) * count);
+    IntVec stack; // block id to enter, or ~id to leave
+    intvec_init(&stack);
+
+    for (int i = 0; i < count; i++) {
+        first_child[i] = -1;
+    }
+
+    for (int i = count - 1; i > 0; i--) {
+        int idom = block_at(ir, i)->idom;
+        next_sibling[i] = first_child[idom];
+        first_child[idom] = i;
+    }
+
+    intvec_push(&stack, 0);
+
+    while (stack.len > 0) {
+        int id = stack.data[--stack.len];
+
+        if (id < 0) {
+            // Values given in the subtree are out of scope
+            for (int len = log_len[~id]; (int)ssa->log.len > len;) {
+                ssa->stacks[ssa->log.data[--ssa->log.len]].len--;
+            }
+            continue;
+        }
+
+        log_len[id] = ssa->log.len;
+        rename_block(ssa, block_at(ir, id));
+
+        intvec_push(&stack, ~id);
+
+        for (int child = first_child[id]; child >= 0; child = next_sibling[child]) {
+            intvec_push(&stack, child);
+        }
+    }
+
+    intvec_destroy(&stack);
+    free(first_child);
+    free(next_sibling);
+    free(log_len);
+}
+
+// Remove instructions whose values are never used (transitively)
+static void remove_dead_values(Ir *ir) {
+    int *uses = calloc(ir->reg_count + 1, sizeof(int));
+    IrInst **defs = calloc(ir->reg_count + 1, sizeof(IrInst *));
+    IrBlock **def_blocks = calloc(ir->reg_count + 1, sizeof(IrBlock *));
+    IntVec work;
+    intvec_init(&work);
+
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrBlock *block = block_at(ir, i);
+
+        for (size_t j = 0; j < block->insts.len; j++) {
+            IrInst *inst = &block->insts.data[j];
+
+            if (inst->op == IR_NOP) {
+                continue;
+            }
+
+            defs[inst->dst] = inst;
+            def_blocks[inst->dst] = block;
+            uses[inst->a]++;
+            uses[inst->b]++;
+
+            if (inst->op == IR_PHI) {
+                for (size_t k = 0; k < block->preds.len; k++) {
+                    uses[ir->args.data[inst->args + k]]++;
+                }
+            }
+        }
+    }
+
+    for (int reg = 1; reg <= ir->reg_count; reg++) {
+        if (defs[reg] != NULL && uses[reg] == 0) {
+            intvec_push(&work, reg);
+        }
+    }
+
+    while (work.len > 0) {
+        IrInst *inst = defs[work.data[--work.len]];
+        int operands[2] = {inst->a, inst->b};
+
+        if (!is_pure_inst(inst)) {
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (operands[i] != 0 && --uses[operands[i]] == 0 && defs[operands[i]] != NULL) {
+                intvec_push(&work, operands[i]);
+            }
+        }
+
+        if (inst->op == IR_PHI) {
+            IrBlock *block = def_blocks[inst->dst];
+
+            for (size_t k = 0; k < block->preds.len; k++) {
+                int arg = ir->args.data[inst->args + k];
+
+                if (--uses[arg] == 0 && defs[arg] != NULL) {
+                    intvec_push(&work, arg);
+                }
+            }
+        }
+
+        inst->op = IR_NOP;
+    }
+
+    intvec_destroy(&work);
+    free(uses);
+    free(defs);
+    free(def_blocks);
+}
+
+// Remove IR_NOPs
+static void compact(Ir *ir) {
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrInstVec *insts = &block_at(ir, i)->insts;
+        size_t len = 0;
+
+        for (size_t j = 0; j < insts->len; j++) {
+            if (insts->data[j].op != IR_NOP) {
+                insts->data[len++] = insts->data[j];
+            }
+        }
+
+        insts->len = len;
+    }
+}
+
+// Promote variables to virtual registers
+void construct_ssa(Ir *ir) {
+    Ssa ssa = {.ir = ir, .var_ids = new_map()};
+    strvec_init(&ssa.vars);
+    intvec_init(&ssa.log);
+
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrBlock *block = block_at(ir, i);
+
+        for (size_t j = 0; j < block->insts.len; j++) {
+            char *var = block->insts.data[j].var;
+
+            if (var != NULL && map_get(ssa.var_ids, var) == 0) {
+                strvec_push(&ssa.vars, var);
+                map_push(ssa.var_ids, var, ssa.vars.len);
+            }
+        }
+    }
+
+    ssa.stacks = calloc(ssa.vars.len, sizeof(IntVec));
+
+    for (size_t i = 0; i < ssa.vars.len; i++) {
+        intvec_init(&ssa.stacks[i]);
+    }
+
+    compute_dominators(ir);
+    insert_phis(&ssa);
+
+    // Registers of phis are given after building, so `replace` is sized here
+    ssa.replace = calloc(ir->reg_count + 1, sizeof(int));
+    rename_vars(&ssa);
+
+    compact(ir);
+    remove_dead_values(ir);
+    compact(ir);
+    ir->ssa = 1;
+
+    for (size_t i = 0; i < ssa.vars.len; i++) {
+        intvec_destroy(&ssa.stacks[i]);
+    }
+
+    free(ssa.stacks);
+    free(ssa.replace);
+    intvec_destroy(&ssa.log);
+    strvec_destroy(&ssa.vars);
+    map_free(ssa.var_ids);
+}
+
+/* SSA destruction */
+
+// Append copies `dsts[i] = srcs[i]` (as if all are done at once) before terminator of block
+static void add_parallel_copies(Ir *ir, IrBlock *block, int *dsts, int *srcs, int n) {
+    IrInst term = *terminator(block);
+    block->insts.len--;
+
+    while (n > 0) {
+        int done = 0;
+
+        for (int i = 0; i < n; i++) {
+            int needed = 0;
+
+            // Destination is still read by another copy
+            for (int j = 0; j < n; j++) {
+                needed |= j != i && srcs[j] == dsts[i];
+            }
+
+            if (needed) {
+                continue;
+            }
+
+            if (dsts[i] != srcs[i]) {
+                irinstvec_push(&block->insts, (IrInst){.op = IR_COPY, .dst = dsts[i], .a = srcs[i]});
+            }
+
+            dsts[i] = dsts[n - 1];
+            srcs[i] = srcs[n - 1];
+            n--;
+            i--;
+            done = 1;
+        }
+
+        if (!done) {
+            // Every copy is in a cycle: save a destination to a temporary
+            int temp = new_reg(ir);
+            irinstvec_push(&block->insts, (IrInst){.op = IR_COPY, .dst = temp, .a = dsts[0]});
+
+            for (int i = 0; i < n; i++) {
+                if (srcs[i] == dsts[0]) {
+                    srcs[i] = temp;
+                }
+            }
+        }
+    }
+
+    irinstvec_push(&block->insts, term);
+}
+
+// Replace phis with copies at the end of predecessors
+// (blocks made to split edges are laid out just before their targets, so every edge still goes forward)
+void destruct_ssa(Ir *ir) {
+    int count = ir->blocks.len;
+    IntVec order;
+    intvec_init(&order);
+
+    for (int i = 0; i < count; i++) {
+        IrBlock *block = block_at(ir, i);
+        int first_mid = ir->blocks.len;
+        int nphis = 0;
+
+        while (nphis < (int)block->insts.len && block->insts.data[nphis].op == IR_PHI) {
+            nphis++;
+        }
+
+        int *dsts = malloc(sizeof(int) * (nphis + 1));
+        int *srcs = malloc(sizeof(int) * (nphis + 1));
+
+        for (size_t j = 0; nphis > 0 && j < block->preds.len; j++) {
+            IrBlock *pred = block_at(ir, block->preds.data[j]);
+
+            // Split critical edge (copies in a branching block would run on both paths)
+            if (terminator(pred)->op == IR_BR) {
+                IrBlock *mid = new_block(ir);
+                IrInst *term = terminator(pred);
+                int t = term->targets[0] == i ? 0 : 1;
+
+                term->targets[t] = mid->id;
+                irinstvec_push(&mid->insts, (IrInst){.op = IR_JMP, .targets = {i}});
+                pred = mid;
+            }
+
+            for (int k = 0; k < nphis; k++) {
+                IrInst *phi = &block->insts.data[k];
+                dsts[k] = phi->dst;
+                srcs[k] = ir->args.data[phi->args + j];
+            }
+
+            add_parallel_copies(ir, pred, dsts, srcs, nphis);
+        }
+
+        for (int k = 0; k < nphis; k++) {
+            block->insts.data[k].op = IR_NOP;
+        }
+
+        for (int mid = first_mid; mid < (int)ir->blocks.len; mid++) {
+            intvec_push(&order, mid);
+        }
+        intvec_push(&order, i);
+
+        free(dsts);
+        free(srcs);
+    }
+
+    compact(ir);
+    reorder_blocks(ir, &order);
+    compute_preds(ir);
+    ir->ssa = 0;
+
+    intvec_destroy(&order);
+}
+
+/* Dump */
+
+static char *ir_op_names[] = {
+    [IR_CONST] = "const",
+    [IR_COPY] = "copy",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_DIV] = "div",
+    [IR_EQ] = "eq",
+    [IR_NE] = "ne",
+    [IR_LT] = "lt",
+    [IR_LE] = "le",
+    [IR_LOAD] = "load",
+    [IR_STORE] = "store",
+    [IR_PHI] = "phi",
+    [IR_BR] = "br",
+    [IR_JMP] = "jmp",
+    [IR_RET] = "ret",
+};
+
+// Print IR as text:
+//
+//   bb2: ; preds bb0 bb1
+//       v7 = phi [v3, bb0] [v5, bb1]
+//       v8 = add v7, v1
+//       br v8, bb3, bb4
+void ir_dump(Ir *ir, FILE *out) {
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrBlock *block = block_at(ir, i);
+
+        fprintf(out, "bb%d:", block->id);
+
+        if (block->preds.len > 0) {
+            fprintf(out, " ; preds");
+
+            for (size_t j = 0; j < block->preds.len; j++) {
+                fprintf(out, " bb%d", block->preds.data[j]);
+            }
+        }
+
+        fprintf(out, "\n");
+
+        for (size_t j = 0; j < block->insts.len; j++) {
+            IrInst *inst = &block->insts.data[j];
+
+            fprintf(out, "    ");
+
+            if (inst->dst != 0) {
+                fprintf(out, "v%d = ", inst->dst);
+            }
+
+            fprintf(out, "%s", ir_op_names[inst->op]);
+
+            switch (inst->op) {
+            case IR_CONST:
+                fprintf(out, " %ld", inst->imm);
+                break;
+            case IR_LOAD:
+                fprintf(out, " %s", inst->var);
+                break;
+            case IR_STORE:
+                fprintf(out, " %s, v%d", inst->var, inst->a);
+                break;
+            case IR_PHI:
+                for (size_t k = 0; k < block->preds.len; k++) {
+                    fprintf(out, " [v%d, bb%d]", ir->args.data[inst->args + k], block->preds.data[k]);
+                }
+                break;
+            case IR_BR:
+                fprintf(out, " v%d, bb%d, bb%d", inst->a, inst->targets[0], inst->targets[1]);
+                break;
+            case IR_JMP:
+                fprintf(out, " bb%d", inst->targets[0]);
+                break;
+            case IR_COPY:
+            case IR_RET:
+                fprintf(out, " v%d", inst->a);
+                break;
+            default:
+                fprintf(out, " v%d, v%d", inst->a, inst->b);
+            }
+
+            fprintf(out, "\n");
+        }
+    }
+}
+
+void ir_free(Ir *ir) {
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        free_block(block_at(ir, i));
+    }
+
+    vec_destroy(&ir->blocks);
+    intvec_destroy(&ir->args);
+    free(ir->locs);
+    free(ir);
+}
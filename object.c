@@ -0,0 +1,615 @@
+/*
+ * Object file writer (-c)
+ *
+ * Instructions made by codegen are encoded into x86-64 machine code and
+ * written as ELF64 relocatable object, without running assembler.
+ *
+ * Encodings are the same as GNU as chooses for the assembly text, so that
+ * both ways give the same code:
+ *
+ * - immediate is 8-bit if it fits, 32-bit otherwise (64-bit only for `mov`)
+ * - `[rbp]` & `[r13]` get 8-bit displacement 0, `[rsp]` & `[r12]` need SIB
+ * - `add`, `sub` & `cmp` of `rax` and 32-bit immediate use the short opcode
+ * - jumps are 8-bit relative if the label is close enough, 32-bit otherwise
+ *   (jumps start short and are made long until all of them reach)
+ *
+ * Labels are local (`.L`) and the program calls nothing, so every jump is
+ * resolved here and the object needs no relocation. Only `_main` is exported.
+ */
+
+#include <elf.h>
+
+#include "0cc.h"
+
+// Encoded instruction
+typedef struct {
+    uint8_t bytes[16];
+    int len;
+} Code;
+
+// Offsets of labels by name and number
+typedef struct {
+    char *names[8];
+    LongVec offsets[8]; // -1 if not defined
+    int len;
+} LabelTable;
+
+// Hardware numbers of registers
+static int reg_codes[] = {
+    [REG_RAX] = 0,
+    [REG_RDI] = 7,
+    [REG_RDX] = 2,
+    [REG_RBP] = 5,
+    [REG_RSP] = 4,
+    [REG_AL] = 0,
+    [REG_RBX] = 3,
+    [REG_RCX] = 1,
+    [REG_RSI] = 6,
+    [REG_R8] = 8,
+    [REG_R9] = 9,
+    [REG_R10] = 10,
+    [REG_R11] = 11,
+    [REG_R12] = 12,
+    [REG_R13] = 13,
+    [REG_R14] = 14,
+    [REG_R15] = 15,
+};
+
+/* Encoder */
+
+static noreturn void cant_encode() {
+    error("Can't encode instruction\n", NULL);
+}
+
+static void byte(Code *c, int b) {
+    c->bytes[c->len++] = b;
+}
+
+static void imm32(Code *c, long value) {
+    for (int i = 0; i < 4; i++) {
+        byte(c, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static void imm64(Code *c, long value) {
+    for (int i = 0; i < 8; i++) {
+        byte(c, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static int is_imm8(long value) {
+    return value >= -128 && value <= 127;
+}
+
+static int is_imm32(long value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static int code_of(Operand *x) {
+    return reg_codes[x->reg];
+}
+
+// REX prefix (omitted if nothing is set). `r` is ModR/M reg field, `rm` is register or memory.
+static void rex(Code *c, int w, int r, Operand *rm) {
+    int b = 0x40 | w << 3 | (r >> 3) << 2 | (code_of(rm) >> 3);
+
+    if (rm->kind == OPND_MEM && rm->scale != 0) {
+        b |= (reg_codes[rm->index] >> 3) << 1;
+    }
+
+    if (b != 0x40) {
+        byte(c, b);
+    }
+}
+
+// ModR/M (& SIB & displacement) of `rm` with reg field `r`
+static void modrm(Code *c, int r, Operand *rm) {
+    if (rm->kind == OPND_REG) {
+        byte(c, 0xc0 | (r & 7) << 3 | (code_of(rm) & 7));
+        return;
+    }
+
+    if (rm->kind != OPND_MEM || !is_imm32(rm->value)) {
+        cant_encode();
+    }
+
+    int base = code_of(rm) & 7;
+    int sib = rm->scale != 0 || base == 4;
+    int mod;
+
+    // `[rbp]` & `[r13]` (mod 0) mean RIP-relative & absolute address, so they take displacement 0
+    if (rm->value == 0 && base != 5) {
+        mod = 0;
+    } else if (is_imm8(rm->value)) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+
+    byte(c, mod << 6 | (r & 7) << 3 | (sib ? 4 : base));
+
+    if (sib) {
+        int index = 4; // no index
+        int scale = 0;
+
+        if (rm->scale != 0) {
+            index = reg_codes[rm->index] & 7;
+            scale = __builtin_ctz(rm->scale);
+        }
+
+        byte(c, scale << 6 | index << 3 | base);
+    }
+
+    if (mod == 1) {
+        byte(c, rm->value & 0xff);
+    } else if (mod == 2) {
+        imm32(c, rm->value);
+    }
+}
+
+// `opcode r, rm` (64-bit operand size if `w`), opcodes are 1 or 2 bytes (0x0f escape)
+static void op_rm(Code *c, int w, int opcode, int r, Operand *rm) {
+    rex(c, w, r, rm);
+
+    if (opcode > 0xff) {
+        byte(c, opcode >> 8);
+    }
+
+    byte(c, opcode & 0xff);
+    modrm(c, r, rm);
+}
+
+// `add`, `sub` & `cmp` (`digit` is the opcode extension of their immediate forms)
+static void alu(Code *c, int digit, Operand *dst, Operand *src) {
+    if (src->kind == OPND_IMM) {
+        if (is_imm8(src->value)) {
+            op_rm(c, 1, 0x83, digit, dst);
+            byte(c, src->value & 0xff);
+        } else if (!is_imm32(src->value)) {
+            cant_encode();
+        } else if (dst->kind == OPND_REG && dst->reg == REG_RAX) {
+            byte(c, 0x48);
+            byte(c, digit << 3 | 5);
+            imm32(c, src->value);
+        } else {
+            op_rm(c, 1, 0x81, digit, dst);
+            imm32(c, src->value);
+        }
+    } else if (src->kind == OPND_MEM) {
+        op_rm(c, 1, digit << 3 | 3, code_of(dst), src);
+    } else if (src->kind == OPND_REG) {
+        op_rm(c, 1, digit << 3 | 1, code_of(src), dst);
+    } else {
+        cant_encode();
+    }
+}
+
+// `shl`, `shr` & `sar` by immediate
+static void shift(Code *c, int digit, Operand *dst, Operand *src) {
+    if (src->kind != OPND_IMM) {
+        cant_encode();
+    }
+
+    if (src->value == 1) {
+        op_rm(c, 1, 0xd1, digit, dst);
+    } else {
+        op_rm(c, 1, 0xc1, digit, dst);
+        byte(c, src->value & 0xff);
+    }
+}
+
+static void push(Code *c, Operand *x) {
+    if (x->kind == OPND_REG) {
+        rex(c, 0, 0, x);
+        byte(c, 0x50 | (code_of(x) & 7));
+    } else if (x->kind == OPND_MEM) {
+        op_rm(c, 0, 0xff, 6, x);
+    } else if (x->kind == OPND_IMM && is_imm8(x->value)) {
+        byte(c, 0x6a);
+        byte(c, x->value & 0xff);
+    } else if (x->kind == OPND_IMM && is_imm32(x->value)) {
+        byte(c, 0x68);
+        imm32(c, x->value);
+    } else {
+        cant_encode();
+    }
+}
+
+static void pop(Code *c, Operand *x) {
+    if (x->kind == OPND_REG) {
+        rex(c, 0, 0, x);
+        byte(c, 0x58 | (code_of(x) & 7));
+    } else if (x->kind == OPND_MEM) {
+        op_rm(c, 0, 0x8f, 0, x);
+    } else {
+        cant_encode();
+    }
+}
+
+static void mov(Code *c, Operand *dst, Operand *src) {
+    if (src->kind == OPND_IMM) {
+        if (is_imm32(src->value)) {
+            op_rm(c, 1, 0xc7, 0, dst);
+            imm32(c, src->value);
+        } else if (dst->kind == OPND_REG) {
+            // movabs
+            rex(c, 1, 0, dst);
+            byte(c, 0xb8 | (code_of(dst) & 7));
+            imm64(c, src->value);
+        } else {
+            cant_encode();
+        }
+    } else if (src->kind == OPND_MEM) {
+        op_rm(c, 1, 0x8b, code_of(dst), src);
+    } else if (src->kind == OPND_REG) {
+        op_rm(c, 1, 0x89, code_of(src), dst);
+    } else {
+        cant_encode();
+    }
+}
+
+static void imul(Code *c, Operand *dst, Operand *src) {
+    if (src->kind == OPND_NONE) {
+        op_rm(c, 1, 0xf7, 5, dst);
+    } else if (src->kind == OPND_IMM && is_imm8(src->value)) {
+        op_rm(c, 1, 0x6b, code_of(dst), dst);
+        byte(c, src->value & 0xff);
+    } else if (src->kind == OPND_IMM && is_imm32(src->value)) {
+        op_rm(c, 1, 0x69, code_of(dst), dst);
+        imm32(c, src->value);
+    } else if (src->kind == OPND_REG || src->kind == OPND_MEM) {
+        op_rm(c, 1, 0x0faf, code_of(dst), src);
+    } else {
+        cant_encode();
+    }
+}
+
+// Encode instruction other than label & jump
+static void encode(Code *c, Inst *inst) {
+    Operand *dst = &inst->dst;
+    Operand *src = &inst->src;
+
+    c->len = 0;
+
+    switch (inst->op) {
+    case INST_PUSH:
+        push(c, dst);
+        break;
+    case INST_POP:
+        pop(c, dst);
+        break;
+    case INST_MOV:
+        mov(c, dst, src);
+        break;
+    case INST_MOVZX:
+        op_rm(c, 1, 0x0fb6, code_of(dst), src);
+        break;
+    case INST_LEA:
+        op_rm(c, 1, 0x8d, code_of(dst), src);
+        break;
+    case INST_ADD:
+        alu(c, 0, dst, src);
+        break;
+    case INST_SUB:
+        alu(c, 5, dst, src);
+        break;
+    case INST_CMP:
+        alu(c, 7, dst, src);
+        break;
+    case INST_MUL:
+        op_rm(c, 1, 0xf7, 4, dst);
+        break;
+    case INST_DIV:
+        op_rm(c, 1, 0xf7, 6, dst);
+        break;
+    case INST_IMUL:
+        imul(c, dst, src);
+        break;
+    case INST_CQO:
+        byte(c, 0x48);
+        byte(c, 0x99);
+        break;
+    case INST_IDIV:
+        op_rm(c, 1, 0xf7, 7, dst);
+        break;
+    case INST_NEG:
+        op_rm(c, 1, 0xf7, 3, dst);
+        break;
+    case INST_SHL:
+        shift(c, 4, dst, src);
+        break;
+    case INST_SHR:
+        shift(c, 5, dst, src);
+        break;
+    case INST_SAR:
+        shift(c, 7, dst, src);
+        break;
+    case INST_SETE:
+        op_rm(c, 0, 0x0f94, 0, dst);
+        break;
+    case INST_SETNE:
+        op_rm(c, 0, 0x0f95, 0, dst);
+        break;
+    case INST_SETL:
+        op_rm(c, 0, 0x0f9c, 0, dst);
+        break;
+    case INST_SETLE:
+        op_rm(c, 0, 0x0f9e, 0, dst);
+        break;
+    case INST_CMOVE:
+        op_rm(c, 1, 0x0f44, code_of(dst), src);
+        break;
+    case INST_CMOVNE:
+        op_rm(c, 1, 0x0f45, code_of(dst), src);
+        break;
+    case INST_CMOVL:
+        op_rm(c, 1, 0x0f4c, code_of(dst), src);
+        break;
+    case INST_CMOVLE:
+        op_rm(c, 1, 0x0f4e, code_of(dst), src);
+        break;
+    case INST_RET:
+        byte(c, 0xc3);
+        break;
+    default:
+        cant_encode();
+    }
+}
+
+/* Jumps */
+
+// Condition code of jump (low 4 bits of `jcc` opcodes), -1 for `jmp`
+static int jump_condition(int op) {
+    switch (op) {
+    case INST_JE:
+        return 0x4;
+    case INST_JNE:
+        return 0x5;
+    case INST_JG:
+        return 0xf;
+    case INST_JGE:
+        return 0xd;
+    case INST_JMP:
+        return -1;
+    default:
+        return -2;
+    }
+}
+
+static int is_jump(Inst *inst) {
+    return jump_condition(inst->op) != -2;
+}
+
+static int long_jump_size(Inst *inst) {
+    return inst->op == INST_JMP ? 5 : 6;
+}
+
+// Encode jump of `size` bytes to `target` from `offset`
+static void encode_jump(Code *c, Inst *inst, int size, long offset, long target) {
+    int cond = jump_condition(inst->op);
+    long rel = target - (offset + size);
+
+    c->len = 0;
+
+    if (size == 2) {
+        byte(c, cond < 0 ? 0xeb : 0x70 | cond);
+        byte(c, rel & 0xff);
+    } else {
+        if (cond < 0) {
+            byte(c, 0xe9);
+        } else {
+            byte(c, 0x0f);
+            byte(c, 0x80 | cond);
+        }
+        imm32(c, rel);
+    }
+}
+
+/* Labels */
+
+static LongVec *label_offsets(LabelTable *t, char *name) {
+    for (int i = 0; i < t->len; i++) {
+        if (strcmp(t->names[i], name) == 0) {
+            return &t->offsets[i];
+        }
+    }
+
+    if (t->len == sizeof(t->names) / sizeof(t->names[0])) {
+        error("Too many kinds of labels: %s\n", name);
+    }
+
+    t->names[t->len] = name;
+    longvec_init(&t->offsets[t->len]);
+
+    return &t->offsets[t->len++];
+}
+
+static void define_label(LabelTable *t, Operand *label, long offset) {
+    LongVec *offsets = label_offsets(t, label->name);
+
+    while (offsets->len <= (size_t)label->value) {
+        longvec_push(offsets, -1);
+    }
+
+    offsets->data[label->value] = offset;
+}
+
+static long find_label(LabelTable *t, Operand *label) {
+    LongVec *offsets = label_offsets(t, label->name);
+
+    if ((size_t)label->value >= offsets->len || offsets->data[label->value] < 0) {
+        error("Undefined label: .L%s\n", label->name);
+    }
+
+    return offsets->data[label->value];
+}
+
+/* Object file */
+
+// Encode `code` into `text` (label offsets are fixed by growing short jumps until all reach)
+static void assemble(InstVec *code, Emitter *text) {
+    size_t n = code->len;
+    uint8_t *sizes = malloc(n);
+    long *offsets = malloc(sizeof(long) * (n + 1));
+    LabelTable labels = {0};
+    Code c;
+
+    for (size_t i = 0; i < n; i++) {
+        Inst *inst = &code->data[i];
+
+        if (inst->op == INST_LABEL) {
+            sizes[i] = 0;
+        } else if (is_jump(inst)) {
+            sizes[i] = 2;
+        } else {
+            encode(&c, inst);
+            sizes[i] = c.len;
+        }
+    }
+
+    for (int changed = 1; changed;) {
+        changed = 0;
+        offsets[0] = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            if (code->data[i].op == INST_LABEL) {
+                define_label(&labels, &code->data[i].dst, offsets[i]);
+            }
+            offsets[i + 1] = offsets[i] + sizes[i];
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            Inst *inst = &code->data[i];
+
+            if (is_jump(inst) && sizes[i] == 2 && !is_imm8(find_label(&labels, &inst->dst) - (offsets[i] + 2))) {
+                sizes[i] = long_jump_size(inst);
+                changed = 1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        Inst *inst = &code->data[i];
+
+        if (inst->op == INST_LABEL) {
+            continue;
+        }
+
+        if (is_jump(inst)) {
+            encode_jump(&c, inst, sizes[i], offsets[i], find_label(&labels, &inst->dst));
+        } else {
+            encode(&c, inst);
+        }
+
+        emit_bytes(text, c.bytes, c.len);
+    }
+
+    for (int i = 0; i < labels.len; i++) {
+        longvec_destroy(&labels.offsets[i]);
+    }
+    free(sizes);
+    free(offsets);
+}
+
+// Section indices
+enum {
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_NOTE, // .note.GNU-stack (stack is not executable)
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_SHSTRTAB,
+    NUM_SECTIONS,
+};
+
+static void pad(Emitter *out, size_t align) {
+    static char zeros[16];
+
+    emit_bytes(out, zeros, (align - out->len % align) % align);
+}
+
+// Write ELF64 relocatable object of `code` (which defines `_main` at its top) to `out`
+void emit_object(Emitter *out, InstVec *code) {
+    Emitter *text = new_buffer_emitter();
+    assemble(code, text);
+
+    static char strtab[] = "\0_main";
+    static char shstrtab[] = "\0.text\0.note.GNU-stack\0.symtab\0.strtab\0.shstrtab";
+    Elf64_Sym syms[] = {
+        {0},
+        {.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION), .st_shndx = SEC_TEXT},
+        {.st_name = 1, .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE), .st_shndx = SEC_TEXT},
+    };
+
+    // Object is written to buffer first, since sections are placed after header
+    Emitter *obj = new_buffer_emitter();
+    Elf64_Shdr sections[NUM_SECTIONS] = {0};
+
+    Elf64_Ehdr header = {
+        .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV},
+        .e_type = ET_REL,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = NUM_SECTIONS,
+        .e_shstrndx = SEC_SHSTRTAB,
+    };
+    emit_bytes(obj, &header, sizeof(header));
+
+    sections[SEC_TEXT] = (Elf64_Shdr){
+        .sh_name = 1,
+        .sh_type = SHT_PROGBITS,
+        .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+        .sh_offset = obj->len,
+        .sh_size = text->len,
+        .sh_addralign = 1,
+    };
+    emit_bytes(obj, text->buf, text->len);
+
+    sections[SEC_NOTE] = (Elf64_Shdr){
+        .sh_name = 7,
+        .sh_type = SHT_PROGBITS,
+        .sh_offset = obj->len,
+        .sh_addralign = 1,
+    };
+
+    pad(obj, 8);
+    sections[SEC_SYMTAB] = (Elf64_Shdr){
+        .sh_name = 23,
+        .sh_type = SHT_SYMTAB,
+        .sh_offset = obj->len,
+        .sh_size = sizeof(syms),
+        .sh_link = SEC_STRTAB,
+        .sh_info = 2, // index of the first global symbol
+        .sh_addralign = 8,
+        .sh_entsize = sizeof(Elf64_Sym),
+    };
+    emit_bytes(obj, syms, sizeof(syms));
+
+    sections[SEC_STRTAB] = (Elf64_Shdr){
+        .sh_name = 31,
+        .sh_type = SHT_STRTAB,
+        .sh_offset = obj->len,
+        .sh_size = sizeof(strtab),
+        .sh_addralign = 1,
+    };
+    emit_bytes(obj, strtab, sizeof(strtab));
+
+    sections[SEC_SHSTRTAB] = (Elf64_Shdr){
+        .sh_name = 39,
+        .sh_type = SHT_STRTAB,
+        .sh_offset = obj->len,
+        .sh_size = sizeof(shstrtab),
+        .sh_addralign = 1,
+    };
+    emit_bytes(obj, shstrtab, sizeof(shstrtab));
+
+    pad(obj, 8);
+    ((Elf64_Ehdr *)obj->buf)->e_shoff = obj->len;
+    emit_bytes(obj, sections, sizeof(sections));
+
+    emit_append(out, obj);
+    emit_close(obj);
+    emit_close(text);
+}
@@ -0,0 +1,960 @@
+/*
+ * AST Optimizer
+ *
+ * Passes run between parsing and code generation, and rewrite `cc->ast`.
+ *
+ * 1. fold: evaluate constant subtrees & simplify algebraic identities
+ * 2. cse: compute each common subexpression once, and reuse its value
+ * 3. dce: remove unreachable code, dead stores and statements without effect
+ *
+ * Folded values must be the same as what generated code computes at runtime:
+ * values are 64-bit in registers, `/` is signed division (`idiv`), and
+ * an immediate must fit in 32 bits. Anything else is left to runtime.
+ */
+
+#include "0cc.h"
+
+/* Utils */
+
+static Node *node_at(Compiler *cc, NodeId id) {
+    return &cc->ast->nodes.data[id];
+}
+
+static int is_num(Compiler *cc, NodeId id, long value) {
+    Node *node = node_at(cc, id);
+
+    return node->type == NODE_NUM && node->value == value;
+}
+
+static int is_binary(int type) {
+    switch (type) {
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case NODE_EQ:
+    case NODE_NE:
+    case NODE_LT:
+    case NODE_LE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Whether evaluating node has no side effect (so it may be removed).
+// Division by zero is undefined, so it needn't be kept.
+// (Expressions may be very long, so trees are walked on explicit stacks in this file.)
+static int is_pure(Compiler *cc, NodeId id) {
+    NodeIdVec stack;
+    int pure = 1;
+
+    nodeidvec_init(&stack);
+    nodeidvec_push(&stack, id);
+
+    while (pure && stack.len > 0) {
+        Node *node = node_at(cc, stack.data[--stack.len]);
+
+        if (is_binary(node->type)) {
+            nodeidvec_push(&stack, node->lhs);
+            nodeidvec_push(&stack, node->rhs);
+        } else if (node->type != NODE_NUM && node->type != NODE_IDENT) {
+            pure = 0;
+        }
+    }
+
+    nodeidvec_destroy(&stack);
+
+    return pure;
+}
+
+// Whether two pure expressions always have the same value
+static int same_expr(Compiler *cc, NodeId a, NodeId b) {
+    NodeIdVec stack; // pairs of nodes to compare
+    int same = 1;
+
+    nodeidvec_init(&stack);
+    nodeidvec_push(&stack, a);
+    nodeidvec_push(&stack, b);
+
+    while (same && stack.len > 0) {
+        Node *y = node_at(cc, stack.data[--stack.len]);
+        Node *x = node_at(cc, stack.data[--stack.len]);
+
+        if (x->type != y->type) {
+            same = 0;
+        } else if (x->type == NODE_NUM) {
+            same = x->value == y->value;
+        } else if (x->type == NODE_IDENT) {
+            same = x->name == y->name; // interned
+        } else {
+            nodeidvec_push(&stack, x->lhs);
+            nodeidvec_push(&stack, y->lhs);
+            nodeidvec_push(&stack, x->rhs);
+            nodeidvec_push(&stack, y->rhs);
+        }
+    }
+
+    nodeidvec_destroy(&stack);
+
+    return same;
+}
+
+/* Constant folding */
+
+// Evaluate `lhs op rhs` like generated code. Return 0 if it can't be folded.
+static int eval_binary(int op, long lhs, long rhs, long *result) {
+    switch (op) {
+    case '+':
+        *result = lhs + rhs;
+        break;
+    case '-':
+        *result = lhs - rhs;
+        break;
+    case '*':
+        *result = (long)((unsigned long)lhs * (unsigned long)rhs);
+        break;
+    case '/':
+        // Division by zero & overflow trap at runtime (not in compiler)
+        if (rhs == 0 || (lhs == LONG_MIN && rhs == -1)) {
+            return 0;
+        }
+        *result = lhs / rhs;
+        break;
+    case NODE_EQ:
+        *result = lhs == rhs;
+        break;
+    case NODE_NE:
+        *result = lhs != rhs;
+        break;
+    case NODE_LT:
+        *result = lhs < rhs;
+        break;
+    case NODE_LE:
+        *result = lhs <= rhs;
+        break;
+    default:
+        return 0;
+    }
+
+    // Result must be an immediate
+    return INT32_MIN <= *result && *result <= INT32_MAX;
+}
+
+// Replace node with number (in place, so parent needn't be updated)
+static NodeId make_num(Compiler *cc, NodeId id, long value) {
+    *node_at(cc, id) = (Node){.type = NODE_NUM, .value = value};
+
+    return id;
+}
+
+// Fold binary node `id` whose operands are folded to `lhs` & `rhs` (`*pure` tells whether
+// they have no side effect, and is set for the result). Return node which replaces `id`.
+static NodeId fold_binary(Compiler *cc, NodeId id, NodeId lhs, NodeId rhs, int lhs_pure, int rhs_pure, int *pure) {
+    // Nodes are rewritten in place (no node is added), so `node` is still valid
+    Node *node = node_at(cc, id);
+    int op = node->type;
+
+    node->lhs = lhs;
+    node->rhs = rhs;
+    *pure = lhs_pure && rhs_pure;
+
+    Node *l = node_at(cc, lhs);
+    Node *r = node_at(cc, rhs);
+    long value;
+
+    if (l->type == NODE_NUM && r->type == NODE_NUM) {
+        return eval_binary(op, l->value, r->value, &value) ? make_num(cc, id, value) : id;
+    }
+
+    // Identities (`x` may have side effects unless it's removed)
+    switch (op) {
+    case '+':
+        if (is_num(cc, rhs, 0)) { // x + 0
+            *pure = lhs_pure;
+            return lhs;
+        }
+        if (is_num(cc, lhs, 0)) { // 0 + x
+            *pure = rhs_pure;
+            return rhs;
+        }
+        break;
+    case '-':
+        if (is_num(cc, rhs, 0)) { // x - 0
+            *pure = lhs_pure;
+            return lhs;
+        }
+        if (lhs_pure && same_expr(cc, lhs, rhs)) { // x - x
+            *pure = 1;
+            return make_num(cc, id, 0);
+        }
+        break;
+    case '*':
+        if (is_num(cc, rhs, 1)) { // x * 1
+            *pure = lhs_pure;
+            return lhs;
+        }
+        if (is_num(cc, lhs, 1)) { // 1 * x
+            *pure = rhs_pure;
+            return rhs;
+        }
+        if ((is_num(cc, rhs, 0) && lhs_pure) || (is_num(cc, lhs, 0) && rhs_pure)) { // x * 0
+            *pure = 1;
+            return make_num(cc, id, 0);
+        }
+        break;
+    case '/':
+        if (is_num(cc, rhs, 1)) { // x / 1
+            *pure = lhs_pure;
+            return lhs;
+        }
+        break;
+    }
+
+    return id;
+}
+
+// Fold operands, then node itself (purity of subtrees is carried up with them).
+// Return node which replaces `id`.
+static NodeId fold_expr(Compiler *cc, NodeId id) {
+    VisitVec stack;
+    NodeIdVec results; // folded operands
+    IntVec pures; // whether each of `results` is pure
+
+    visitvec_init(&stack);
+    nodeidvec_init(&results);
+    intvec_init(&pures);
+    visitvec_push(&stack, (Visit){id, 0});
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        Node *node = node_at(cc, v.id);
+
+        if (v.state == 0) {
+            if (node->type == '=' || is_binary(node->type)) {
+                visitvec_push(&stack, (Visit){v.id, 1});
+                visitvec_push(&stack, (Visit){node->rhs, 0});
+                if (node->type != '=') {
+                    visitvec_push(&stack, (Visit){node->lhs, 0});
+                }
+            } else {
+                nodeidvec_push(&results, v.id);
+                intvec_push(&pures, node->type == NODE_NUM || node->type == NODE_IDENT);
+            }
+            continue;
+        }
+
+        NodeId rhs = results.data[--results.len];
+        int rhs_pure = pures.data[--pures.len];
+
+        if (node->type == '=') {
+            node->rhs = rhs;
+            nodeidvec_push(&results, v.id);
+            intvec_push(&pures, 0);
+            continue;
+        }
+
+        NodeId lhs = results.data[--results.len];
+        int lhs_pure = pures.data[--pures.len];
+        int pure;
+
+        nodeidvec_push(&results, fold_binary(cc, v.id, lhs, rhs, lhs_pure, rhs_pure, &pure));
+        intvec_push(&pures, pure);
+    }
+
+    NodeId result = results.data[0];
+
+    visitvec_destroy(&stack);
+    nodeidvec_destroy(&results);
+    intvec_destroy(&pures);
+
+    return result;
+}
+
+static NodeId fold_stmt(Compiler *cc, NodeId id) {
+    Node *node = node_at(cc, id);
+    Ast *ast = cc->ast;
+
+    switch (node->type) {
+    case NODE_RETURN:
+        node->lhs = fold_expr(cc, node->lhs);
+        return id;
+    case NODE_IF:
+        node->lhs = fold_expr(cc, node->lhs);
+        ast->extra.data[node->rhs] = fold_stmt(cc, ast->extra.data[node->rhs]);
+        if (ast->extra.data[node->rhs + 1] != 0) {
+            ast->extra.data[node->rhs + 1] = fold_stmt(cc, ast->extra.data[node->rhs + 1]);
+        }
+        return id;
+    case NODE_BLOCK:
+        for (uint32_t i = 0; i < node->list.len; i++) {
+            NodeId *stmt = &ast->extra.data[node->list.first + i];
+            *stmt = fold_stmt(cc, *stmt);
+        }
+        return id;
+    default:
+        return fold_expr(cc, id);
+    }
+}
+
+/*
+ * Common subexpression elimination
+ *
+ * Each pure expression gets a value number, and the same value number means
+ * the same value: numbers are hash-consed from (operator, numbers of operands),
+ * and a variable gets a new number whenever it's assigned.
+ *
+ * Nodes are visited in the order generated code evaluates them. If a node has
+ * the number of an expression computed before in the same straight-line region,
+ * the earlier one is rewritten to `tmp = expr` and this one to `tmp`
+ * (temporaries are variables whose names can't appear in source).
+ */
+
+// Hash-consing table entry (value number of (op, lhs, rhs))
+typedef struct {
+    int op; // 0 means empty
+    long lhs;
+    long rhs;
+    int vn;
+} VnEntry;
+
+// Expression available for reuse
+typedef struct {
+    int region; // valid only in this region
+    NodeId node; // first node which computes the value
+    char *temp; // temporary which has the value (NULL until reused)
+} Available;
+
+typedef struct {
+    Compiler *cc;
+    VnEntry *table;
+    size_t capacity; // size of table (power of 2)
+    int vn_count; // number of value numbers given
+    Available *available; // indexed by value number
+    int available_capacity;
+    int region; // current straight-line region
+    int *vns; // value number of node (0 if not numbered yet, VN_IMPURE if it has side effect)
+    uint32_t len; // size of `vns` (nodes added during the pass aren't numbered)
+    Map *versions; // variable -> version of its current value
+    long version_count;
+} Cse;
+
+static unsigned long hash_vn_key(int op, long lhs, long rhs) {
+    unsigned long h = op * 0x9E3779B97F4A7C15UL;
+    h = (h ^ (unsigned long)lhs) * 0xC2B2AE3D27D4EB4FUL;
+    h = (h ^ (unsigned long)rhs) * 0x165667B19E3779F9UL;
+
+    return h ^ (h >> 29);
+}
+
+static void vn_grow(Cse *cse) {
+    VnEntry *old = cse->table;
+    size_t old_capacity = cse->capacity;
+
+    cse->capacity *= 2;
+    cse->table = calloc(cse->capacity, sizeof(VnEntry));
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].op == 0) {
+            continue;
+        }
+
+        size_t mask = cse->capacity - 1;
+        size_t j = hash_vn_key(old[i].op, old[i].lhs, old[i].rhs) & mask;
+
+        while (cse->table[j].op != 0) {
+            j = (j + 1) & mask;
+        }
+        cse->table[j] = old[i];
+    }
+
+    free(old);
+}
+
+// Return value number of (op, lhs, rhs), giving new one if it's not seen yet
+static int value_number(Cse *cse, int op, long lhs, long rhs) {
+    size_t mask = cse->capacity - 1;
+    size_t i = hash_vn_key(op, lhs, rhs) & mask;
+
+    for (; cse->table[i].op != 0; i = (i + 1) & mask) {
+        VnEntry *e = &cse->table[i];
+
+        if (e->op == op && e->lhs == lhs && e->rhs == rhs) {
+            return e->vn;
+        }
+    }
+
+    int vn = ++cse->vn_count;
+    cse->table[i] = (VnEntry){op, lhs, rhs, vn};
+
+    if (vn == cse->available_capacity) {
+        cse->available_capacity *= 2;
+        cse->available = realloc(cse->available, sizeof(Available) * cse->available_capacity);
+    }
+    cse->available[vn] = (Available){0};
+
+    // Keep load factor under 1/2
+    if ((size_t)cse->vn_count * 2 > cse->capacity) {
+        vn_grow(cse);
+    }
+
+    return vn;
+}
+
+static int is_commutative(int op) {
+    return op == '+' || op == '*' || op == NODE_EQ || op == NODE_NE;
+}
+
+// Value number of expression which has side effect
+#define VN_IMPURE -1
+
+static void set_vn(Cse *cse, NodeId id, int vn) {
+    if (id < cse->len) {
+        cse->vns[id] = vn;
+    }
+}
+
+// Return value number of expression (with current values of variables), VN_IMPURE if it's not pure.
+// Operands after an impure one are not numbered (their variables may be assigned before they are evaluated).
+static int number_expr(Cse *cse, NodeId id) {
+    VisitVec stack;
+    IntVec results; // value numbers of operands
+
+    visitvec_init(&stack);
+    intvec_init(&results);
+    visitvec_push(&stack, (Visit){id, 0});
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        Node *node = node_at(cse->cc, v.id);
+        int op = node->type;
+        int vn;
+
+        if (v.state == 0 && v.id < cse->len && cse->vns[v.id] != 0) {
+            intvec_push(&results, cse->vns[v.id]);
+            continue;
+        }
+
+        if (v.state == 0 && is_binary(op)) {
+            visitvec_push(&stack, (Visit){v.id, 1});
+            visitvec_push(&stack, (Visit){node->lhs, 0});
+            continue;
+        }
+
+        if (v.state == 1) {
+            // Right operand is numbered only if left one is pure
+            if (results.data[results.len - 1] == VN_IMPURE) {
+                set_vn(cse, v.id, VN_IMPURE);
+            } else {
+                visitvec_push(&stack, (Visit){v.id, 2});
+                visitvec_push(&stack, (Visit){node->rhs, 0});
+            }
+            continue;
+        }
+
+        if (v.state == 2) {
+            long b = results.data[--results.len];
+            long a = results.data[--results.len];
+
+            if (b == VN_IMPURE) {
+                vn = VN_IMPURE;
+            } else {
+                if (is_commutative(op) && a > b) {
+                    long t = a;
+                    a = b;
+                    b = t;
+                }
+                vn = value_number(cse, op, a, b);
+            }
+        } else if (op == NODE_NUM) {
+            vn = value_number(cse, NODE_NUM, node->value, 0);
+        } else if (op == NODE_IDENT) {
+            vn = value_number(cse, NODE_IDENT, (long)node->name, map_get(cse->versions, node->name));
+        } else {
+            vn = VN_IMPURE;
+        }
+
+        set_vn(cse, v.id, vn);
+        intvec_push(&results, vn);
+    }
+
+    int vn = results.data[0];
+
+    visitvec_destroy(&stack);
+    intvec_destroy(&results);
+
+    return vn;
+}
+
+// Start new straight-line region (values computed before are no longer available)
+static void cse_new_region(Cse *cse) {
+    cse->region++;
+}
+
+// Reuse value of `avail->node` at node `id`
+static void cse_reuse(Cse *cse, Available *avail, NodeId id) {
+    Compiler *cc = cse->cc;
+
+    if (avail->temp == NULL) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), ".cse%d", ++cc->temp_count);
+
+        avail->temp = intern(cc->symbols, buf, len);
+        declare_var(cc, avail->temp);
+
+        // `expr` -> `temp = expr` (in place, so parent needn't be updated)
+        NodeId expr = ast_add(cc->ast, *node_at(cc, avail->node));
+        NodeId temp = ast_add(cc->ast, (Node){.type = NODE_IDENT, .name = avail->temp});
+        *node_at(cc, avail->node) = (Node){.type = '=', .lhs = temp, .rhs = expr};
+    }
+
+    *node_at(cc, id) = (Node){.type = NODE_IDENT, .name = avail->temp};
+}
+
+// Visit expression in the order generated code evaluates it
+static void cse_expr(Cse *cse, NodeId id) {
+    Compiler *cc = cse->cc;
+    VisitVec stack;
+
+    visitvec_init(&stack);
+    visitvec_push(&stack, (Visit){id, 0});
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        int op = node_at(cc, v.id)->type;
+
+        if (v.state == 1) {
+            // Assigned variable has new value
+            map_push(cse->versions, node_at(cc, node_at(cc, v.id)->lhs)->name, ++cse->version_count);
+            continue;
+        }
+
+        if (op == NODE_NUM || op == NODE_IDENT) {
+            continue;
+        }
+
+        if (op == '=') {
+            visitvec_push(&stack, (Visit){v.id, 1});
+            visitvec_push(&stack, (Visit){node_at(cc, v.id)->rhs, 0});
+            continue;
+        }
+
+        // Purity is known from the value number (computed once per node)
+        int vn = number_expr(cse, v.id);
+
+        if (vn != VN_IMPURE) {
+            Available *avail = &cse->available[vn];
+
+            if (avail->region == cse->region && avail->node != 0) {
+                cse_reuse(cse, avail, v.id);
+                continue;
+            }
+
+            *avail = (Available){cse->region, v.id, NULL};
+        }
+
+        // Operands (node may be moved by `cse_reuse()`, so don't keep pointer)
+        visitvec_push(&stack, (Visit){node_at(cc, v.id)->rhs, 0});
+        visitvec_push(&stack, (Visit){node_at(cc, v.id)->lhs, 0});
+    }
+
+    visitvec_destroy(&stack);
+}
+
+static void cse_stmt(Cse *cse, NodeId id) {
+    Compiler *cc = cse->cc;
+    Node *node = node_at(cc, id);
+
+    switch (node->type) {
+    case NODE_RETURN:
+        cse_expr(cse, node->lhs);
+        return;
+    case NODE_IF: {
+        uint32_t bodies = node->rhs;
+        cse_expr(cse, node->lhs);
+
+        for (int i = 0; i < 2; i++) {
+            NodeId body = cc->ast->extra.data[bodies + i];
+
+            if (body != 0) {
+                cse_new_region(cse);
+                cse_stmt(cse, body);
+            }
+        }
+
+        cse_new_region(cse);
+        return;
+    }
+    case NODE_BLOCK: {
+        uint32_t first = node->list.first;
+        uint32_t len = node->list.len;
+
+        for (uint32_t i = 0; i < len; i++) {
+            cse_stmt(cse, cc->ast->extra.data[first + i]);
+        }
+        return;
+    }
+    default:
+        cse_expr(cse, id);
+    }
+}
+
+static void cse(Compiler *cc, NodeId id) {
+    Cse cse = {
+        .cc = cc,
+        .capacity = 64,
+        .region = 1,
+        .len = cc->ast->nodes.len,
+        .versions = new_map(),
+    };
+    cse.table = calloc(cse.capacity, sizeof(VnEntry));
+    cse.available_capacity = 64;
+    cse.available = malloc(sizeof(Available) * cse.available_capacity);
+    cse.vns = calloc(cse.len, sizeof(int));
+
+    cse_stmt(&cse, id);
+
+    free(cse.table);
+    free(cse.available);
+    free(cse.vns);
+    map_free(cse.versions);
+}
+
+/*
+ * Dead code elimination
+ *
+ * Program exits with the value of `rax`, and each statement leaves its value
+ * in `rax` (`if` leaves its condition when no arm sets it). So the value of
+ * a statement is "needed" if it may be the last one executed before the end
+ * of program, and only statements whose values aren't needed are removed:
+ *
+ * - statements after `return` (or `if` ~ `else` which returns in both arms)
+ * - arms of `if` which are never taken (condition is folded to a constant)
+ * - pure expression statements, and empty blocks
+ * - assignments to variables which are never read (`x = e` -> `e`)
+ *
+ * Removing a statement may leave more variables unread, so the pass is
+ * repeated until the set of read variables doesn't shrink. Variables which
+ * are no longer used are removed from `vars` (so the frame shrinks).
+ *
+ * Reads of later statements are unknown in streaming mode, so assignments
+ * are kept and every top-level statement is needed there.
+ */
+
+typedef struct {
+    Compiler *cc;
+    Map *reads; // variables read anywhere (value is 1)
+    int whole_program; // whether `reads` covers the whole program
+    NodeId empty; // empty block (shared by arms of `if` which became empty)
+} Dce;
+
+static void count_expr_reads(Dce *dce, NodeId id) {
+    NodeIdVec stack;
+
+    nodeidvec_init(&stack);
+    nodeidvec_push(&stack, id);
+
+    while (stack.len > 0) {
+        Node *node = node_at(dce->cc, stack.data[--stack.len]);
+
+        switch (node->type) {
+        case NODE_NUM:
+            break;
+        case NODE_IDENT:
+            if (map_get(dce->reads, node->name) == 0) {
+                map_push(dce->reads, node->name, 1);
+            }
+            break;
+        case '=':
+            nodeidvec_push(&stack, node->rhs);
+            break;
+        default:
+            nodeidvec_push(&stack, node->lhs);
+            nodeidvec_push(&stack, node->rhs);
+        }
+    }
+
+    nodeidvec_destroy(&stack);
+}
+
+static void count_reads(Dce *dce, NodeId id) {
+    Compiler *cc = dce->cc;
+    Node *node = node_at(cc, id);
+
+    switch (node->type) {
+    case NODE_RETURN:
+        count_expr_reads(dce, node->lhs);
+        return;
+    case NODE_IF:
+        count_expr_reads(dce, node->lhs);
+        for (int i = 0; i < 2; i++) {
+            NodeId body = cc->ast->extra.data[node->rhs + i];
+
+            if (body != 0) {
+                count_reads(dce, body);
+            }
+        }
+        return;
+    case NODE_BLOCK:
+        for (uint32_t i = 0; i < node->list.len; i++) {
+            count_reads(dce, cc->ast->extra.data[node->list.first + i]);
+        }
+        return;
+    default:
+        count_expr_reads(dce, id);
+    }
+}
+
+static int is_read(Dce *dce, char *name) {
+    return !dce->whole_program || map_get(dce->reads, name) != 0;
+}
+
+// Whether statement never completes normally (code after it is unreachable)
+static int always_returns(Compiler *cc, NodeId id) {
+    Node *node = node_at(cc, id);
+
+    switch (node->type) {
+    case NODE_RETURN:
+        return 1;
+    case NODE_IF: {
+        NodeId if_body = cc->ast->extra.data[node->rhs];
+        NodeId else_body = cc->ast->extra.data[node->rhs + 1];
+
+        return else_body != 0 && always_returns(cc, if_body) && always_returns(cc, else_body);
+    }
+    case NODE_BLOCK:
+        // Statements after `return` are already removed
+        return node->list.len > 0 && always_returns(cc, cc->ast->extra.data[node->list.first + node->list.len - 1]);
+    default:
+        return 0;
+    }
+}
+
+// Remove dead stores in expression. Return node which replaces `id`.
+static NodeId dce_expr(Dce *dce, NodeId id) {
+    VisitVec stack;
+    NodeIdVec results; // operands which are left
+
+    visitvec_init(&stack);
+    nodeidvec_init(&results);
+    visitvec_push(&stack, (Visit){id, 0});
+
+    while (stack.len > 0) {
+        Visit v = stack.data[--stack.len];
+        Node *node = node_at(dce->cc, v.id);
+
+        if (v.state == 0) {
+            if (node->type == NODE_NUM || node->type == NODE_IDENT) {
+                nodeidvec_push(&results, v.id);
+                continue;
+            }
+
+            visitvec_push(&stack, (Visit){v.id, 1});
+            visitvec_push(&stack, (Visit){node->rhs, 0});
+            if (node->type != '=') {
+                visitvec_push(&stack, (Visit){node->lhs, 0});
+            }
+            continue;
+        }
+
+        NodeId rhs = results.data[--results.len];
+
+        if (node->type == '=') {
+            if (!is_read(dce, node_at(dce->cc, node->lhs)->name)) {
+                nodeidvec_push(&results, rhs);
+                continue;
+            }
+            node->rhs = rhs;
+        } else {
+            node->lhs = results.data[--results.len];
+            node->rhs = rhs;
+        }
+        nodeidvec_push(&results, v.id);
+    }
+
+    NodeId result = results.data[0];
+
+    visitvec_destroy(&stack);
+    nodeidvec_destroy(&results);
+
+    return result;
+}
+
+// Expression statement `expr;` (NULL statement if it can be removed)
+static NodeId expr_stmt(Dce *dce, NodeId expr, int need) {
+    return need || !is_pure(dce->cc, expr) ? expr : 0;
+}
+
+static NodeId dce_stmt(Dce *, NodeId, int);
+
+// Remove dead statements of block (in place). Return the number of statements left.
+static uint32_t dce_block(Dce *dce, NodeId id, int need) {
+    Compiler *cc = dce->cc;
+    uint32_t first = node_at(cc, id)->list.first;
+    uint32_t len = node_at(cc, id)->list.len;
+    NodeId *stmts = cc->ast->extra.data + first;
+
+    // Only the last statement which is left may give the value of block
+    for (uint32_t i = len; i-- > 0;) {
+        stmts[i] = dce_stmt(dce, stmts[i], need); // only nodes are added, so `stmts` stays valid
+
+        if (stmts[i] != 0) {
+            need = 0;
+        }
+    }
+
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (stmts[i] == 0) {
+            continue;
+        }
+
+        stmts[kept++] = stmts[i];
+
+        if (always_returns(cc, stmts[i])) {
+            break;
+        }
+    }
+
+    node_at(cc, id)->list.len = kept;
+
+    return kept;
+}
+
+// Remove dead code of statement. Return statement which replaces `id` (0 if nothing is left).
+// `need` tells whether the value of statement is needed.
+static NodeId dce_stmt(Dce *dce, NodeId id, int need) {
+    Compiler *cc = dce->cc;
+    Node *node = node_at(cc, id);
+
+    switch (node->type) {
+    case NODE_RETURN:
+        node->lhs = dce_expr(dce, node->lhs);
+        return id;
+    case NODE_IF: {
+        uint32_t bodies = node->rhs;
+        NodeId cond = dce_expr(dce, node->lhs);
+        NodeId if_body = dce_stmt(dce, cc->ast->extra.data[bodies], need);
+        NodeId else_body = cc->ast->extra.data[bodies + 1];
+
+        if (else_body != 0) {
+            else_body = dce_stmt(dce, else_body, need);
+        }
+
+        // Empty arm leaves condition in `rax`, so it's the same as `cond;`
+        if (node_at(cc, cond)->type == NODE_NUM) {
+            NodeId taken = node_at(cc, cond)->value != 0 ? if_body : else_body;
+
+            return taken != 0 ? taken : expr_stmt(dce, cond, need);
+        }
+
+        if (if_body == 0 && else_body == 0) {
+            return expr_stmt(dce, cond, need);
+        }
+
+        if (if_body == 0) {
+            if (dce->empty == 0) {
+                dce->empty = ast_add(cc->ast, (Node){.type = NODE_BLOCK});
+            }
+            if_body = dce->empty;
+        }
+
+        node = node_at(cc, id);
+        node->lhs = cond;
+        cc->ast->extra.data[bodies] = if_body;
+        cc->ast->extra.data[bodies + 1] = else_body;
+        return id;
+    }
+    case NODE_BLOCK: {
+        uint32_t len = dce_block(dce, id, need);
+
+        if (len <= 1) {
+            return len == 0 ? 0 : cc->ast->extra.data[node_at(cc, id)->list.first];
+        }
+        return id;
+    }
+    default:
+        return expr_stmt(dce, dce_expr(dce, id), need);
+    }
+}
+
+// Remove variables which no longer appear in program from `vars` (offsets are given again)
+static void shrink_vars(Compiler *cc, Map *used) {
+    StrVec names;
+    strvec_init(&names);
+
+    for (size_t i = 0; i < cc->vars->keys.len; i++) {
+        strvec_push(&names, cc->vars->keys.data[i]);
+    }
+
+    map_clear(cc->vars);
+
+    for (size_t i = 0; i < names.len; i++) {
+        if (map_get(used, names.data[i]) != 0) {
+            declare_var(cc, names.data[i]);
+        }
+    }
+
+    strvec_destroy(&names);
+}
+
+// Remove dead code of whole program (root block)
+static void dce_program(Compiler *cc) {
+    Dce dce = {cc, new_map(), 1, 0};
+    size_t reads;
+
+    count_reads(&dce, cc->root);
+
+    do {
+        reads = dce.reads->keys.len;
+        dce_block(&dce, cc->root, 1);
+
+        map_clear(dce.reads);
+        count_reads(&dce, cc->root);
+    } while (dce.reads->keys.len < reads);
+
+    // Every assignment left is to a variable which is read
+    shrink_vars(cc, dce.reads);
+
+    map_free(dce.reads);
+}
+
+/* Optimizer */
+
+static NodeId fold_and_cse(Compiler *cc, NodeId id) {
+    if (!cc->opts->no_fold) {
+        id = fold_stmt(cc, id);
+    }
+
+    if (!cc->opts->no_cse) {
+        cse(cc, id);
+    }
+
+    return id;
+}
+
+// Optimize one top-level statement (used by streaming mode). Return statement which replaces `id`.
+NodeId optimize_stmt(Compiler *cc, NodeId id) {
+    id = fold_and_cse(cc, id);
+
+    if (!cc->opts->no_dce) {
+        Dce dce = {cc, NULL, 0, 0};
+        id = dce_stmt(&dce, id, 1);
+
+        if (id == 0) {
+            id = ast_add(cc->ast, (Node){.type = NODE_BLOCK});
+        }
+    }
+
+    return id;
+}
+
+// Optimize whole program
+void optimize(Compiler *cc) {
+    cc->root = fold_and_cse(cc, cc->root);
+
+    if (!cc->opts->no_dce) {
+        dce_program(cc);
+    }
+}
@@ -18,30 +18,18 @@
  * stmt: `if` `(` assign `)` stmt
  * stmt: `if` `(` assign `)` stmt `else` stmt
  *
- * assign: equality
- * assign: equality `=` assign
+ * assign: unary (binop unary)*
  *
- * equality: relational
- * equality: equality `==` relational
- * equality: equality `!=` relational
- *
- * relational: expr
- * relational: relational `<=` expr
- * relational: relational `<` expr
- * relational: relational `>=` expr
- * relational: relational `>` expr
- *
- * expr: mul
- * expr: expr `+` mul
- * expr: expr `-` mul
- *
- * mul: unary
- * mul: mul `*` unary
- * mul: mul `/` unary
+ * binop (from loosest):
+ *   `=` (right-associative)
+ *   `==` `!=`
+ *   `<` `<=` `>` `>=`
+ *   `+` `-`
+ *   `*` `/`
  *
  * unary: term
- * unary: `+` term
- * unary: `-` term
+ * unary: `+` unary
+ * unary: `-` unary
  *
  * term: num
  * term: ident
@@ -49,6 +37,12 @@
  *
  */
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "0cc.h"
 
 /* Token */
@@ -70,26 +64,6 @@ enum
     TK_ELSE,      // Keyword `else` token
 };
 
-// Token
-typedef struct
-{
-    int type;    // type of token
-    int value;   // value of TK_NUM type token
-    char *name;  // value of TK_IDENT type token
-    char *input; // string of token to display error messages
-} Token;
-
-// Token initializer
-Token *new_token(int type, int value, char *name, char *input)
-{
-    Token *token = malloc(sizeof(Token));
-    token->type = type;
-    token->value = value;
-    token->name = name;
-    token->input = input;
-    return token;
-}
-
 /* Utils */
 
 // Error notifier
@@ -99,457 +73,709 @@ noreturn void error(char *message, char *input)
     exit(1);
 }
 
-// check the char can be a part of Identifier
-int is_alnum(char c)
+// Error notifier with position in source (line and column are resolved from offset)
+noreturn void error_at(Compiler *cc, int offset, char *message)
 {
-    return ('a' <= c && c <= 'z') |
-           ('A' <= c && c <= 'Z') |
-           ('0' <= c && c <= '9') |
-           ('0' == '_');
-}
+    char *start = cc->source->data;
+    char *p = start + offset;
+    char *end = start + cc->source->len;
 
-// get current token by position
-Token *current_token(int pos)
-{
-    return (Token *)tokens->data[pos];
+    int line = 1;
+    char *line_start = start;
+
+    for (char *q = start; q < p; q++)
+    {
+        if (*q == '\n')
+        {
+            line++;
+            line_start = q + 1;
+        }
+    }
+
+    char *line_end = p;
+    while (line_end < end && *line_end != '\n')
+    {
+        line_end++;
+    }
+
+    int column = p - line_start;
+
+    fprintf(cc->diag, "%s:%d:%d: %s\n", cc->source->name, line, column + 1, message);
+    fprintf(cc->diag, "%.*s\n", (int)(line_end - line_start), line_start);
+    fprintf(cc->diag, "%*s^\n", column, "");
+
+    // Give up compiling this source (and return to `compile()`)
+    longjmp(cc->bail, 1);
 }
 
-/* Variables */
+Token *lex_token(Compiler *);
+
+// get current token by position (tokens are lexed on demand)
+// Returned pointer is valid until next call (lexing may move tokens)
+Token *current_token(Compiler *cc, int pos)
+{
+    while ((size_t)(pos - cc->token_base) >= cc->tokens.len)
+    {
+        lex_token(cc);
+    }
 
-int pos = 0;
+    return &cc->tokens.data[pos - cc->token_base];
+}
 
 /* Prototypes */
 
-Node *stmt();
-Node *assign();
-Node *equality();
-Node *relational();
-Node *expr();
-Node *mul();
-Node *unary();
-Node *term();
-Node *new_node(int, Node *, Node *);
-Node *new_node_num(int);
-Node *new_node_ident(char *);
-Node *new_node_if(Node *, Node *, Node *);
-void dump_tokens();
+NodeId stmt(Compiler *);
+NodeId assign(Compiler *);
+NodeId new_node(Compiler *, int, NodeId, NodeId);
+NodeId new_node_num(Compiler *, int);
+NodeId new_node_ident(Compiler *, char *);
+NodeId new_node_if(Compiler *, NodeId, NodeId, NodeId);
+NodeId new_node_block(Compiler *, NodeId *, uint32_t);
+void dump_tokens(Compiler *);
 
 /* Tokenizer (Raw source code parser) */
 
-void tokenize(char *p)
+/*
+ * The tokenizer is table-driven:
+ *
+ * 1. `char_class` classifies each byte with one load
+ * 2. runs of spaces, identifier chars and digits are scanned 32 (AVX2)
+ *    or 16 (SSE2) bytes at a time (with scalar fallback for the tail)
+ * 3. keywords are found by perfect hash after identifier is scanned
+ */
+
+// Character classes
+enum
+{
+    CC_SPACE = 1,
+    CC_DIGIT = 2,
+    CC_LETTER = 4, // `a`-`z`, `A`-`Z` and `_`
+    CC_PUNCT = 8,
+    CC_IDENT = CC_DIGIT | CC_LETTER,
+};
+
+#define S CC_SPACE
+#define D CC_DIGIT
+#define L CC_LETTER
+#define P CC_PUNCT
+
+static const unsigned char char_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, S, S, S, S, 0, 0, // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+    S, P, 0, 0, 0, 0, 0, 0, P, P, P, P, 0, P, 0, P, // 0x20
+    D, D, D, D, D, D, D, D, D, D, 0, P, P, P, P, 0, // 0x30
+    0, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L, // 0x40
+    L, L, L, L, L, L, L, L, L, L, L, 0, 0, 0, 0, L, // 0x50
+    0, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L, // 0x60
+    L, L, L, L, L, L, L, L, L, L, L, P, 0, P, 0, 0, // 0x70
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x80
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x90
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xa0
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xb0
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xc0
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xd0
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xe0
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xf0
+};
+
+#undef S
+#undef D
+#undef L
+#undef P
+
+static inline int char_is(char c, int cls)
+{
+    return char_class[(unsigned char)c] & cls;
+}
+
+// Keyword table indexed by perfect hash `keyword_hash()`
+typedef struct
+{
+    char *name;
+    int len;
+    int type;
+} Keyword;
+
+#define KEYWORD_HASH_SIZE 8
+
+static const Keyword keywords[KEYWORD_HASH_SIZE] = {
+    [1] = {"else", 4, TK_ELSE},     // (4 ^ 'e') & 7 == 1
+    [3] = {"if", 2, TK_IF},         // (2 ^ 'i') & 7 == 3
+    [4] = {"return", 6, TK_RETURN}, // (6 ^ 'r') & 7 == 4
+};
+
+// Collision-free for every keyword in `keywords` (checked by `-test`)
+static inline int keyword_hash(char *p, int len)
 {
-    while (*p)
+    return (len ^ (unsigned char)p[0]) & (KEYWORD_HASH_SIZE - 1);
+}
+
+// Return token type of keyword, or TK_IDENT if [p, p + len) is not keyword
+int keyword_type(char *p, int len)
+{
+    const Keyword *kw = &keywords[keyword_hash(p, len)];
+
+    if (kw->len == len && memcmp(kw->name, p, len) == 0)
     {
-        // Trim spaces
-        if (isspace(*p))
-        {
-            p++;
-            continue;
-        }
+        return kw->type;
+    }
 
-        if (strncmp(p, "==", 2) == 0)
-        {
-            Token *tk = new_token(TK_EQ, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p += 2;
-            continue;
-        }
+    return TK_IDENT;
+}
 
-        if (strncmp(p, "!=", 2) == 0)
-        {
-            Token *tk = new_token(TK_NE, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p += 2;
-            continue;
-        }
+// Vector operations are macros (not functions), so that they are inlined without optimization
+#if defined(__AVX2__)
+
+#define SIMD_WIDTH 32
+typedef __m256i simd_t;
+
+#define simd_load(p) _mm256_loadu_si256((__m256i *)(p))
+#define simd_set1(c) _mm256_set1_epi8(c)
+#define simd_eq(x, y) _mm256_cmpeq_epi8(x, y)
+#define simd_or(x, y) _mm256_or_si256(x, y)
+#define simd_sub(x, y) _mm256_sub_epi8(x, y)
+#define simd_min(x, y) _mm256_min_epu8(x, y)
+#define simd_mask(x) ((unsigned int)_mm256_movemask_epi8(x))
+
+#elif defined(__SSE2__)
+
+#define SIMD_WIDTH 16
+typedef __m128i simd_t;
+
+#define simd_load(p) _mm_loadu_si128((__m128i *)(p))
+#define simd_set1(c) _mm_set1_epi8(c)
+#define simd_eq(x, y) _mm_cmpeq_epi8(x, y)
+#define simd_or(x, y) _mm_or_si128(x, y)
+#define simd_sub(x, y) _mm_sub_epi8(x, y)
+#define simd_min(x, y) _mm_min_epu8(x, y)
+#define simd_mask(x) ((unsigned int)_mm_movemask_epi8(x))
+
+#endif
+
+#ifdef SIMD_WIDTH
+
+#define SIMD_ALL_MASK ((unsigned int)((1UL << SIMD_WIDTH) - 1))
+
+// lo <= x <= lo + n (as unsigned bytes)
+#define simd_in_range(x, lo, n) simd_eq(simd_min(simd_sub(x, simd_set1(lo)), simd_set1(n)), simd_sub(x, simd_set1(lo)))
+
+// ' ', or '\t' '\n' '\v' '\f' '\r'
+#define simd_is_space(x) simd_or(simd_eq(x, simd_set1(' ')), simd_in_range(x, '\t', 4))
+
+#define simd_is_digit(x) simd_in_range(x, '0', 9)
+
+// (c | 0x20) maps `A`-`Z` to `a`-`z` (and nothing else to them)
+#define simd_is_ident(x) \
+    simd_or(simd_or(simd_in_range(simd_or(x, simd_set1(0x20)), 'a', 25), simd_is_digit(x)), simd_eq(x, simd_set1('_')))
+
+// Define scanner which skips bytes of class `cls` (`simd_is` is its vector version)
+#define DEFINE_SCAN(name, cls, simd_is)                                     \
+    static char *name(char *p, char *end, int simd)                        \
+    {                                                                      \
+        /* most runs are short, so look at the first byte before vector */ \
+        if (simd && p < end && char_is(*p, cls))                           \
+        {                                                                  \
+            while (end - p >= SIMD_WIDTH)                                  \
+            {                                                              \
+                unsigned int mask = ~simd_mask(simd_is(simd_load(p))) & SIMD_ALL_MASK; \
+                if (mask != 0)                                             \
+                {                                                          \
+                    return p + __builtin_ctz(mask);                        \
+                }                                                          \
+                p += SIMD_WIDTH;                                           \
+            }                                                              \
+        }                                                                  \
+        while (p < end && char_is(*p, cls))                                \
+        {                                                                  \
+            p++;                                                           \
+        }                                                                  \
+        return p;                                                          \
+    }
 
-        if (strncmp(p, "<=", 2) == 0)
-        {
-            Token *tk = new_token(TK_LE, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p += 2;
-            continue;
-        }
+#else
 
-        if (strncmp(p, ">=", 2) == 0)
-        {
-            Token *tk = new_token(TK_GE, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p += 2;
-            continue;
-        }
+#define DEFINE_SCAN(name, cls, simd_is)                \
+    static char *name(char *p, char *end, int simd)   \
+    {                                                 \
+        while (p < end && char_is(*p, cls))           \
+        {                                             \
+            p++;                                      \
+        }                                             \
+        return p;                                     \
+    }
 
-        if (*p == '<')
-        {
-            Token *tk = new_token(TK_LT, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p++;
-            continue;
-        }
+#endif
 
-        if (*p == '>')
-        {
-            Token *tk = new_token(TK_GT, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p++;
-            continue;
-        }
+DEFINE_SCAN(scan_spaces, CC_SPACE, simd_is_space)
+DEFINE_SCAN(scan_digits, CC_DIGIT, simd_is_digit)
+DEFINE_SCAN(scan_ident, CC_IDENT, simd_is_ident)
 
-        // Tokenize operators
-        if (*p == '+' || *p == '-' || *p == '*' || *p == '/' || *p == '(' || *p == ')' || *p == ';' || *p == '=' || *p == '{' || *p == '}')
-        {
-            Token *tk = new_token(*p, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p++;
-            continue;
-        }
+void tokenize_start(Compiler *cc, Source *src)
+{
+    cc->lex_start = src->data;
+    cc->lex_p = cc->lex_start;
+    cc->lex_end = cc->lex_start + src->len;
+}
 
-        // Tokenize digits
-        if (isdigit(*p))
-        {
-            char *input = p;
-            Token *tk = new_token(TK_NUM, strtol(p, &p, 10), NULL, input);
-            vec_push(tokens, (void *)tk);
-            continue;
-        }
+// Tokenize whole source
+void tokenize(Compiler *cc, Source *src)
+{
+    tokenize_start(cc, src);
 
-        // `return`
-        if (strncmp(p, "return", 6) == 0 && !is_alnum(p[6]))
-        {
-            Token *tk = new_token(TK_RETURN, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p += 6;
-            continue;
-        }
+    while (lex_token(cc)->type != TK_EOF)
+        ;
+}
+
+// Lex next token, push it to `tokens` and return it
+Token *lex_token(Compiler *cc)
+{
+    char *start = cc->lex_start;
+    char *end = cc->lex_end;
+    char *p = cc->lex_p;
+    int simd = !cc->opts->scalar_lexer;
+    Token tk;
+
+    // Trim spaces (most tokens are separated by one space, so check it before scanning)
+    if (p < end && char_is(*p, CC_SPACE))
+    {
+        p = scan_spaces(p + 1, end, simd);
+    }
 
-        // `if`
-        if (strncmp(p, "if", 2) == 0 && !is_alnum(p[2]))
+    if (p == end)
+    {
+        tk = (Token){TK_EOF, 0, NULL, p - start, 0};
+    }
+    else if (char_is(*p, CC_DIGIT))
+    {
+        // Tokenize digits
+        // (source is not '\0' terminated, so we can't use strtol here)
+        char *q = scan_digits(p + 1, end, simd);
+        // (saturated at LONG_MAX like `strtol`, and truncated to int as before)
+        long value = 0;
+        for (char *d = p; d < q; d++)
         {
-            Token *tk = new_token(TK_IF, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p += 2;
-            continue;
+            int digit = *d - '0';
+            value = value > (LONG_MAX - digit) / 10 ? LONG_MAX : value * 10 + digit;
         }
+        tk = (Token){TK_NUM, (int)value, NULL, p - start, q - p};
+        p = q;
+    }
+    else if (char_is(*p, CC_LETTER))
+    {
+        // Tokenize keywords & identifiers
+        // (identifier refers to the source buffer, and only its first occurrence is copied by `intern`)
+        char *q = scan_ident(p + 1, end, simd);
+        int type = keyword_type(p, q - p);
+        char *ident = type == TK_IDENT ? intern(cc->symbols, p, q - p) : NULL;
+        tk = (Token){type, 0, ident, p - start, q - p};
+        p = q;
+    }
+    else if (char_is(*p, CC_PUNCT))
+    {
+        // Tokenize operators (`==`, `!=`, `<=` and `>=` have 2 chars)
+        int type = *p;
+        int len = 1;
 
-        // `else`
-        if (strncmp(p, "else", 4) == 0 && !is_alnum(p[4]))
+        if (p + 1 < end && p[1] == '=')
         {
-            Token *tk = new_token(TK_ELSE, 0, NULL, p);
-            vec_push(tokens, (void *)tk);
-            p += 4;
-            continue;
+            switch (*p)
+            {
+            case '=': type = TK_EQ; len = 2; break;
+            case '!': type = TK_NE; len = 2; break;
+            case '<': type = TK_LE; len = 2; break;
+            case '>': type = TK_GE; len = 2; break;
+            }
         }
 
-        // Tokenize Identifiers
-        if ('a' <= *p && *p <= 'z')
+        if (len == 1)
         {
-            int i = 0;
-            char *pp = p;
-            while (is_alnum(*pp))
+            switch (*p)
             {
-                i++;
-                pp++;
+            case '!': error_at(cc, p - start, "Can't tokenize");
+            case '<': type = TK_LT; break;
+            case '>': type = TK_GT; break;
             }
-            char *ident = strndup(p, i);
-
-            Token *tk = new_token(TK_IDENT, 0, ident, p);
-            vec_push(tokens, (void *)tk);
-            p += i;
-            continue;
         }
 
-        error("Can't tokenize: %s\n", p);
+        tk = (Token){type, 0, NULL, p - start, len};
+        p += len;
+    }
+    else
+    {
+        error_at(cc, p - start, "Can't tokenize");
     }
 
-    vec_push(tokens, (void *)new_token(TK_EOF, 0, NULL, p));
+    tokenvec_push(&cc->tokens, tk);
+    cc->lex_p = p;
+    return &cc->tokens.data[cc->tokens.len - 1];
 }
 
 /* Node initializers */
 
-Node *new_node(int op, Node *lhs, Node *rhs)
+// Nodes are appended to `cc->ast` and referred to by index
+
+NodeId new_node(Compiler *cc, int op, NodeId lhs, NodeId rhs)
 {
-    Node *node = malloc(sizeof(Node));
-    node->type = op;
-    node->lhs = lhs;
-    node->rhs = rhs;
-    return node;
+    return ast_add(cc->ast, (Node){.type = op, .lhs = lhs, .rhs = rhs});
 }
 
-Node *new_node_num(int value)
+NodeId new_node_num(Compiler *cc, int value)
 {
-    Node *node = malloc(sizeof(Node));
-    node->type = NODE_NUM;
-    node->value = value;
-    return node;
+    return ast_add(cc->ast, (Node){.type = NODE_NUM, .value = value});
 }
 
-Node *new_node_ident(char *name)
+NodeId new_node_ident(Compiler *cc, char *name)
 {
-    Node *node = malloc(sizeof(Node));
-    node->type = NODE_IDENT;
-    node->name = name;
-    return node;
+    return ast_add(cc->ast, (Node){.type = NODE_IDENT, .name = name});
 }
 
-Node *new_node_if(Node *cond, Node *if_body, Node *else_body)
+NodeId new_node_if(Compiler *cc, NodeId cond, NodeId if_body, NodeId else_body)
 {
-    Node *node = malloc(sizeof(Node));
-    node->type = NODE_IF;
-    node->lhs = cond;
+    NodeId bodies[2] = {if_body, else_body};
+    uint32_t first = ast_add_extra(cc->ast, bodies, 2);
 
-    node->rhs = malloc(sizeof(Node));
-    node->rhs->type = NODE_IF_BODY;
-    node->rhs->lhs = if_body;
-    node->rhs->rhs = else_body;
+    return ast_add(cc->ast, (Node){.type = NODE_IF, .label = ++cc->condition_count, .lhs = cond, .rhs = first});
+}
 
-    return node;
+// Make block of `stmts` (statements are copied to `extra`)
+NodeId new_node_block(Compiler *cc, NodeId *stmts, uint32_t len)
+{
+    uint32_t first = ast_add_extra(cc->ast, stmts, len);
+
+    return ast_add(cc->ast, (Node){.type = NODE_BLOCK, .list = {first, len}});
 }
 
 /* Token parser */
 
-void program()
+// Statements are parsed and walked by later passes recursively (unlike expressions),
+// so their nesting is bounded to keep C stack usage small
+#define MAX_STMT_DEPTH 10000
+
+// Parse statements until `end` token into block
+static NodeId block_body(Compiler *cc, int end)
 {
-    while (current_token(pos)->type != TK_EOF)
+    NodeIdVec *stmts = &cc->stmts;
+    size_t base = stmts->len;
+
+    while (current_token(cc, cc->pos)->type != end)
     {
-        vec_push(nodes, (void *)stmt());
+        NodeId id = stmt(cc);
+        nodeidvec_push(stmts, id);
     }
 
-    vec_push(nodes, NULL);
+    NodeId block = new_node_block(cc, stmts->data + base, stmts->len - base);
+    stmts->len = base;
+
+    return block;
 }
 
-Node *stmt()
+void program(Compiler *cc)
 {
-    Node *node;
+    cc->root = block_body(cc, TK_EOF);
+}
+
+// Release tokens & nodes of parsed statements, but keep look-ahead tokens
+static void release_statement(Compiler *cc)
+{
+    TokenVec *tokens = &cc->tokens;
+    size_t done = cc->pos - cc->token_base;
+
+    // parser reads ahead at most one token
+    memmove(tokens->data, tokens->data + done, sizeof(Token) * (tokens->len - done));
+    tokens->len -= done;
+    cc->token_base = cc->pos;
 
-    if (current_token(pos)->type == '{')
+    ast_clear(cc->ast);
+}
+
+// Streaming mode: lex, parse and generate one top-level statement at a time,
+// so that memory usage does not grow with input size
+void program_stream(Compiler *cc)
+{
+    while (current_token(cc, cc->pos)->type != TK_EOF)
     {
-        // block is given
-        pos++;
+        codegen_stmt(cc, optimize_stmt(cc, stmt(cc)));
 
-        node = malloc(sizeof(Node));
-        node->type = NODE_BLOCK;
-        Vector *items = new_vector();
+        release_statement(cc);
+    }
+}
 
-        while (current_token(pos)->type != '}')
-        {
-            vec_push(items, (void *)stmt());
-        }
+NodeId stmt(Compiler *cc)
+{
+    NodeId node;
 
-        node->stmts = items;
-        // After getting out of while loop, next token is definitely '}'
+    if (++cc->stmt_depth > MAX_STMT_DEPTH)
+    {
+        error_at(cc, current_token(cc, cc->pos)->offset, "Statements are nested too deeply");
+    }
+
+    if (current_token(cc, cc->pos)->type == '{')
+    {
+        // block is given
+        cc->pos++;
+
+        node = block_body(cc, '}');
+        // After parsing block body, next token is definitely '}'
         // and we should just go to next pos
-        pos++;
+        cc->pos++;
     }
-    else if (current_token(pos)->type == TK_RETURN)
+    else if (current_token(cc, cc->pos)->type == TK_RETURN)
     {
-        pos++;
+        cc->pos++;
 
-        node = malloc(sizeof(Node));
-        node->type = NODE_RETURN;
-        node->lhs = assign();
+        node = new_node(cc, NODE_RETURN, assign(cc), 0);
 
-        if (current_token(pos)->type != ';')
+        if (current_token(cc, cc->pos)->type != ';')
         {
-            error("Unexpected token, expect ';' but given token is: %s\n", current_token(pos)->input);
+            error_at(cc, current_token(cc, cc->pos)->offset, "Unexpected token, expect ';'");
         }
-        pos++;
+        cc->pos++;
     }
-    else if (current_token(pos)->type == TK_IF)
+    else if (current_token(cc, cc->pos)->type == TK_IF)
     {
-        pos++;
+        cc->pos++;
 
-        if (current_token(pos)->type != '(')
+        if (current_token(cc, cc->pos)->type != '(')
         {
-            error("Unexpected token, expect '(' but given token is: %s\n", current_token(pos)->input);
+            error_at(cc, current_token(cc, cc->pos)->offset, "Unexpected token, expect '('");
         }
-        pos++;
+        cc->pos++;
 
-        Node *cond = assign();
+        NodeId cond = assign(cc);
 
-        if (current_token(pos)->type != ')')
+        if (current_token(cc, cc->pos)->type != ')')
         {
-            error("Unexpected token, expect ')' but given token is: %s\n", current_token(pos)->input);
+            error_at(cc, current_token(cc, cc->pos)->offset, "Unexpected token, expect ')'");
         }
-        pos++;
+        cc->pos++;
 
-        Node *if_body = stmt();
-        Node *else_body = NULL;
+        NodeId if_body = stmt(cc);
+        NodeId else_body = 0;
 
         // Read ahead current position to set else body
-        if (tokens->len >= pos && current_token(pos)->type == TK_ELSE)
+        if (current_token(cc, cc->pos)->type == TK_ELSE)
         {
-            pos++;
+            cc->pos++;
 
-            else_body = stmt();
+            else_body = stmt(cc);
         }
 
-        node = new_node_if(cond, if_body, else_body);
+        node = new_node_if(cc, cond, if_body, else_body);
     }
     else
     {
         // normal statement is given
-        node = assign();
+        node = assign(cc);
 
-        if (current_token(pos)->type != ';')
+        if (current_token(cc, cc->pos)->type != ';')
         {
-            error("Unexpected token, expect ';' but given token is: %s\n", current_token(pos)->input);
+            error_at(cc, current_token(cc, cc->pos)->offset, "Unexpected token, expect ';'");
         }
-        pos++;
+        cc->pos++;
     }
 
+    cc->stmt_depth--;
+
     return node;
 }
 
-Node *assign()
+/*
+ * Expression parser (precedence climbing)
+ *
+ * Operators and operands are kept on explicit stacks (`cc->operators` and
+ * `cc->operands`) instead of the C call stack, so parsing takes linear time
+ * and constant stack depth however long or deeply parenthesized an
+ * expression is. An operator on the stack is reduced when an operator of
+ * lower precedence (or the same precedence, if left-associative) comes.
+ */
+
+// Operator
+typedef struct
 {
-    Node *lhs = equality();
+    int prec;        // precedence (higher binds tighter, 0 is not operator)
+    int node_type;   // type of node made by this operator
+    int right_assoc; // right-associative (`=`)
+    int swap;        // make node with swapped operands (`a > b` is `b < a`)
+    int unary;       // unary prefix operator
+} Operator;
+
+// Binary operators indexed by token type
+static const Operator binary_ops[] = {
+    ['='] = {1, '=', 1},
+    [TK_EQ] = {2, NODE_EQ},
+    [TK_NE] = {2, NODE_NE},
+    [TK_LT] = {3, NODE_LT},
+    [TK_LE] = {3, NODE_LE},
+    [TK_GT] = {3, NODE_LT, 0, 1},
+    [TK_GE] = {3, NODE_LE, 0, 1},
+    ['+'] = {4, '+'},
+    ['-'] = {4, '-'},
+    ['*'] = {5, '*'},
+    ['/'] = {5, '/'},
+};
 
-    if (current_token(pos)->type == '=')
-    {
-        pos++;
-        return new_node('=', lhs, assign());
-    }
+#define NUM_BINARY_OPS (int)(sizeof(binary_ops) / sizeof(binary_ops[0]))
 
-    return lhs;
-}
+// Unary minus is `0 - x`
+static const Operator neg_op = {6, '-', 0, 0, 1};
 
-Node *equality()
-{
-    Node *lhs = relational();
+// Left parenthesis (never reduced by operators)
+static const Operator paren_op = {0};
 
-    if (current_token(pos)->type == TK_EQ)
-    {
-        pos++;
-        return new_node(NODE_EQ, lhs, equality());
-    }
-    if (current_token(pos)->type == TK_NE)
+// Return binary operator of token type, or NULL
+static const Operator *binary_op(int type)
+{
+    if (type < NUM_BINARY_OPS && binary_ops[type].prec > 0)
     {
-        pos++;
-        return new_node(NODE_NE, lhs, equality());
+        return &binary_ops[type];
     }
-
-    return lhs;
+    return NULL;
 }
 
-Node *relational()
+static NodeId pop_operand(Compiler *cc)
 {
-    Node *lhs = expr();
-
-    if (current_token(pos)->type == TK_LE)
-    {
-        pos++;
-        return new_node(NODE_LE, lhs, relational());
-    }
-    if (current_token(pos)->type == TK_LT)
-    {
-        pos++;
-        return new_node(NODE_LT, lhs, relational());
-    }
-    if (current_token(pos)->type == TK_GE)
-    {
-        pos++;
-        return new_node(NODE_LE, relational(), lhs); // Reverse left and right hand sides
-    }
-    if (current_token(pos)->type == TK_GT)
-    {
-        pos++;
-        return new_node(NODE_LT, relational(), lhs); // Reverse left and right hand sides
-    }
-
-    return lhs;
+    return cc->operands.data[--cc->operands.len];
 }
 
-Node *expr()
+// Pop operator on the top of stack and push node made from it
+static void reduce(Compiler *cc)
 {
-    Node *lhs = mul();
+    const Operator *op = cc->operators.data[--cc->operators.len];
+    NodeId rhs = pop_operand(cc);
+    NodeId node;
 
-    if (current_token(pos)->type == '+')
+    if (op->unary)
     {
-        pos++;
-        return new_node('+', lhs, expr());
+        node = new_node(cc, op->node_type, new_node_num(cc, 0), rhs);
     }
-    if (current_token(pos)->type == '-')
+    else
     {
-        pos++;
-        return new_node('-', lhs, expr());
+        NodeId lhs = pop_operand(cc);
+        node = op->swap ? new_node(cc, op->node_type, rhs, lhs) : new_node(cc, op->node_type, lhs, rhs);
     }
 
-    return lhs;
+    nodeidvec_push(&cc->operands, node);
 }
 
-Node *mul()
+// Reduce operators which bind tighter than `op` (all operators above `(` if `op` is NULL)
+static void reduce_until(Compiler *cc, const Operator *op)
 {
-    Node *lhs = unary();
+    Vector *operators = &cc->operators;
 
-    if (current_token(pos)->type == '*')
-    {
-        pos++;
-        return new_node('*', lhs, mul());
-    }
-    if (current_token(pos)->type == '/')
+    while (operators->len > 0)
     {
-        pos++;
-        return new_node('/', lhs, mul());
-    }
+        const Operator *top = operators->data[operators->len - 1];
+
+        if (top == &paren_op)
+        {
+            return;
+        }
+        if (op != NULL && (top->prec < op->prec || (top->prec == op->prec && op->right_assoc)))
+        {
+            return;
+        }
 
-    return lhs;
+        reduce(cc);
+    }
 }
 
-Node *unary()
+// Register ident to `vars` Map, if it does not exist in `vars` yet
+void declare_var(Compiler *cc, char *name)
 {
-    if (current_token(pos)->type == '+')
-    {
-        pos++;
-        return term();
-    }
-    if (current_token(pos)->type == '-')
+    if (map_get(cc->vars, name) == 0)
     {
-        pos++;
-        return new_node('-', new_node_num(0), term());
+        long offset = (cc->vars->keys.len + 1) * 8;
+        map_push(cc->vars, name, offset);
     }
-
-    return term();
 }
 
-Node *term()
+NodeId assign(Compiler *cc)
 {
-    if (current_token(pos)->type == TK_NUM)
-    {
-        return new_node_num(current_token(pos++)->value);
-    }
-    if (current_token(pos)->type == TK_IDENT)
+    // Expressions don't nest statements, so stacks are always empty here
+    cc->operands.len = 0;
+    cc->operators.len = 0;
+
+    int parens = 0; // number of `(` on operator stack
+    Token *tk;
+
+    for (;;)
     {
-        // Set ident to `vars` Map, if it does not exist in `vars` yet
-        if ((long)map_get(vars, current_token(pos)->name) == 0)
+        // Operand is expected: prefix operators, `(`, number or ident
+        tk = current_token(cc, cc->pos);
+
+        if (tk->type == '+')
         {
-            long offset = (vars->keys->len + 1) * 8;
-            map_push(vars, current_token(pos)->name, (void *)offset);
+            cc->pos++;
+            continue;
+        }
+        if (tk->type == '-' || tk->type == '(')
+        {
+            vec_push(&cc->operators, (void *)(tk->type == '-' ? &neg_op : &paren_op));
+            parens += tk->type == '(';
+            cc->pos++;
+            continue;
         }
 
-        return new_node_ident(current_token(pos++)->name);
-    }
-    if (current_token(pos)->type == '(')
-    {
-        pos++;
-        Node *node = assign();
+        if (tk->type == TK_NUM)
+        {
+            nodeidvec_push(&cc->operands, new_node_num(cc, tk->value));
+        }
+        else if (tk->type == TK_IDENT)
+        {
+            declare_var(cc, tk->name);
+            nodeidvec_push(&cc->operands, new_node_ident(cc, tk->name));
+        }
+        else
+        {
+            error_at(cc, tk->offset, "Unexpected token, expect '(' or number or ident");
+        }
+        cc->pos++;
+
+        // Operator is expected: `)` or binary operator (otherwise expression ends)
+        tk = current_token(cc, cc->pos);
 
-        if (current_token(pos)->type != ')')
+        while (tk->type == ')' && parens > 0)
         {
-            error("Unexpected token, expect ')' but given token is: %s\n", current_token(pos)->input);
+            reduce_until(cc, NULL);
+            cc->operators.len--; // `(`
+            parens--;
+            tk = current_token(cc, ++cc->pos);
         }
 
-        pos++;
-        return node;
+        const Operator *op = binary_op(tk->type);
+
+        if (op == NULL)
+        {
+            break;
+        }
+
+        reduce_until(cc, op);
+
+        if (op->node_type == '=' && cc->ast->nodes.data[cc->operands.data[cc->operands.len - 1]].type != NODE_IDENT)
+        {
+            error_at(cc, tk->offset, "Left value of assignment is not variable");
+        }
+
+        vec_push(&cc->operators, (void *)op);
+        cc->pos++;
+    }
+
+    if (parens > 0)
+    {
+        error_at(cc, tk->offset, "Unexpected token, expect ')'");
     }
-    error("Unexpected token, expect '(' or number or ident but given token is: %s\n", current_token(pos)->input);
+
+    reduce_until(cc, NULL);
+
+    return pop_operand(cc);
 }
 
 // Debug
-void dump_tokens()
+void dump_tokens(Compiler *cc)
 {
-    for (int i = 0; i < tokens->len; i++)
+    for (size_t i = 0; i < cc->tokens.len; i++)
     {
-        Token *cur = (Token *)tokens->data[i];
-        printf("# type: %d, value: %d, name: %s, input: %s\n", cur->type, cur->value, cur->name, cur->input);
+        Token *cur = &cc->tokens.data[i];
+        printf("# type: %d, value: %d, name: %s, input: %.*s\n", cur->type, cur->value, cur->name, cur->len, cc->source->data + cur->offset);
     }
 }
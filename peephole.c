@@ -0,0 +1,626 @@
+/*
+ * Peephole optimizer
+ *
+ * Rewrites instruction records of stack-machine code before they are
+ * printed. Each rule looks at an instruction and a small window after it:
+ *
+ * 1. `push x` ... `pop r` -> `mov r, x` (nothing if `x` is `r`)
+ *    if code between them doesn't use the stack or change `x`
+ * 2. `mov r, rbp` `sub r, N` -> `lea r, [rbp-N]`
+ * 3. `lea r, [rbp-N]` ... `[r]` -> `[rbp-N]`
+ * 4. `lea r, [rbp-N]` `push r` ... `pop d` -> `lea d, [rbp-N]` at `pop`
+ *    (variable address is computed again instead of saved on the stack)
+ * 5. `mov r, imm` ... `op x, r` -> `op x, imm`
+ * 6. `mov r, x` `mov d, r` -> `mov d, x`
+ * 7. `mov [m], r` `mov d, [m]` -> `mov [m], r` `mov d, r`
+ * 8. `mov r, x` (or `lea`, `add`, `sub`) -> (nothing) if `r` is dead
+ *
+ * A register is "dead" if it's written before it's read. Labels and jumps
+ * end the window: codegen passes values between statements only in `rax`,
+ * so `rax` is assumed to be live there and other registers dead. Registers
+ * in `live_out` are live at the end of the instructions. Only writes to
+ * `scratch` registers, which never hold values across labels and jumps,
+ * are removed or forwarded.
+ *
+ * Rules are applied from the last instruction to the first, so inner
+ * `push` ~ `pop` pairs are rewritten before the outer ones, and passes are
+ * repeated until nothing is rewritten.
+ */
+
+#include "0cc.h"
+
+// Maximum number of instructions a rule looks ahead
+#define PEEPHOLE_WINDOW 16
+
+// Maximum number of instructions between `push` and `pop` of rematerialized address
+#define PEEPHOLE_REMAT_WINDOW 256
+
+#define REG_BIT(reg) (1 << ((reg) == REG_AL ? REG_RAX : (reg)))
+
+static char *rule_names[] = {
+    [PEEP_PUSH_POP] = "push/pop removed",
+    [PEEP_PUSH_POP_MOV] = "push/pop to mov",
+    [PEEP_PUSH_POP_IMM] = "push imm/pop to mov",
+    [PEEP_FRAME_LEA] = "frame address to lea",
+    [PEEP_FRAME_ADDR] = "frame address to [rbp-N]",
+    [PEEP_FRAME_REMAT] = "frame address remat",
+    [PEEP_IMM_OPERAND] = "immediate operand",
+    [PEEP_MOV_FORWARD] = "mov forwarded",
+    [PEEP_STORE_LOAD] = "load after store removed",
+    [PEEP_DEAD_CODE] = "dead instruction removed",
+};
+
+/* Instruction effects */
+
+// Whether control may enter or leave here (end of window)
+static int is_barrier(Inst *inst) {
+    switch (inst->op) {
+    case INST_LABEL:
+    case INST_JE:
+    case INST_JNE:
+    case INST_JG:
+    case INST_JGE:
+    case INST_JMP:
+    case INST_RET:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Registers read by reading operand (base of memory operand)
+static int operand_reads(Operand *opnd) {
+    int index = opnd->kind == OPND_MEM && opnd->scale != 0 ? REG_BIT(opnd->index) : 0;
+
+    return opnd->kind == OPND_REG || opnd->kind == OPND_MEM ? REG_BIT(opnd->reg) | index : 0;
+}
+
+// Registers written by writing operand
+static int operand_writes(Operand *opnd) {
+    return opnd->kind == OPND_REG ? REG_BIT(opnd->reg) : 0;
+}
+
+// Masks of registers which instruction reads and writes (stack operations use `rsp`)
+static void effects(Inst *inst, int *reads, int *writes) {
+    int stack = REG_BIT(REG_RSP);
+    int dst_base = inst->dst.kind == OPND_MEM ? REG_BIT(inst->dst.reg) : 0;
+
+    switch (inst->op) {
+    case INST_PUSH:
+        *reads = operand_reads(&inst->dst) | stack;
+        *writes = stack;
+        break;
+    case INST_POP:
+        *reads = dst_base | stack;
+        *writes = operand_writes(&inst->dst) | stack;
+        break;
+    case INST_MOV:
+    case INST_MOVZX:
+    case INST_LEA:
+        *reads = operand_reads(&inst->src) | dst_base;
+        *writes = operand_writes(&inst->dst);
+        break;
+    case INST_ADD:
+    case INST_SUB:
+        *reads = operand_reads(&inst->dst) | operand_reads(&inst->src);
+        *writes = operand_writes(&inst->dst);
+        break;
+    case INST_CMP:
+        *reads = operand_reads(&inst->dst) | operand_reads(&inst->src);
+        *writes = 0;
+        break;
+    case INST_CMOVE:
+    case INST_CMOVNE:
+    case INST_CMOVL:
+    case INST_CMOVLE:
+        // Destination is kept if condition is false
+        *reads = operand_reads(&inst->dst) | operand_reads(&inst->src);
+        *writes = operand_writes(&inst->dst);
+        break;
+    case INST_MUL:
+        *reads = REG_BIT(REG_RAX) | operand_reads(&inst->dst);
+        *writes = REG_BIT(REG_RAX) | REG_BIT(REG_RDX);
+        break;
+    case INST_DIV:
+    case INST_IDIV:
+        *reads = REG_BIT(REG_RAX) | REG_BIT(REG_RDX) | operand_reads(&inst->dst);
+        *writes = REG_BIT(REG_RAX) | REG_BIT(REG_RDX);
+        break;
+    case INST_IMUL:
+        if (inst->src.kind == OPND_NONE) {
+            *reads = REG_BIT(REG_RAX) | operand_reads(&inst->dst);
+            *writes = REG_BIT(REG_RAX) | REG_BIT(REG_RDX);
+        } else {
+            *reads = operand_reads(&inst->dst) | operand_reads(&inst->src);
+            *writes = operand_writes(&inst->dst);
+        }
+        break;
+    case INST_CQO:
+        *reads = REG_BIT(REG_RAX);
+        *writes = REG_BIT(REG_RDX);
+        break;
+    case INST_NEG:
+    case INST_SHL:
+    case INST_SHR:
+    case INST_SAR:
+        *reads = operand_reads(&inst->dst);
+        *writes = operand_writes(&inst->dst);
+        break;
+    case INST_SETE:
+    case INST_SETNE:
+    case INST_SETL:
+    case INST_SETLE:
+        // Writes only `al` (the rest of `rax` is kept)
+        *reads = operand_reads(&inst->dst);
+        *writes = operand_writes(&inst->dst);
+        break;
+    default:
+        *reads = 0;
+        *writes = 0;
+    }
+}
+
+static int is_reg(Operand *opnd, int reg) {
+    return opnd->kind == OPND_REG && opnd->reg == reg;
+}
+
+/* Window */
+
+typedef struct {
+    Inst *code;
+    size_t len;
+    int live_out;
+    int scratch; // registers which hold temporary values (others must not be removed)
+    long *counts;
+} Peephole;
+
+// Index of next instruction which is not removed (`len` if none)
+static size_t next_inst(Peephole *p, size_t i) {
+    for (i++; i < p->len && p->code[i].op == INST_NOP; i++) {
+    }
+
+    return i;
+}
+
+// Whether `reg` is written before it's read from `code[i]`
+static int is_dead(Peephole *p, size_t i, int reg) {
+    int bit = REG_BIT(reg);
+
+    if (i < p->len && p->code[i].op == INST_NOP) {
+        i = next_inst(p, i);
+    }
+
+    for (int n = 0; i < p->len && n < PEEPHOLE_WINDOW; i = next_inst(p, i), n++) {
+        Inst *inst = &p->code[i];
+        int reads, writes;
+
+        if (is_barrier(inst)) {
+            return !(bit & REG_BIT(REG_RAX));
+        }
+
+        effects(inst, &reads, &writes);
+
+        if (reads & bit) {
+            return 0;
+        }
+        if (writes & bit) {
+            return 1;
+        }
+    }
+
+    return i == p->len && !(p->live_out & bit);
+}
+
+static void rewrite(Peephole *p, int rule) {
+    p->counts[rule]++;
+}
+
+/* Rules */
+
+// `push x` ... `pop r` -> `mov r, x`
+static int push_pop(Peephole *p, size_t i) {
+    Inst *push = &p->code[i];
+    Operand x = push->dst;
+
+    if (x.kind != OPND_REG && x.kind != OPND_IMM) {
+        return 0;
+    }
+
+    size_t j = next_inst(p, i);
+
+    for (int n = 0; j < p->len && n < PEEPHOLE_WINDOW; j = next_inst(p, j), n++) {
+        Inst *inst = &p->code[j];
+        int reads, writes;
+
+        if (is_barrier(inst)) {
+            return 0;
+        }
+
+        if (inst->op == INST_POP && inst->dst.kind == OPND_REG) {
+            break;
+        }
+
+        effects(inst, &reads, &writes);
+
+        if ((reads | writes) & REG_BIT(REG_RSP) || writes & operand_reads(&x)) {
+            return 0;
+        }
+    }
+
+    if (j >= p->len || p->code[j].op != INST_POP) {
+        return 0;
+    }
+
+    Inst *pop = &p->code[j];
+    push->op = INST_NOP;
+
+    if (is_reg(&x, pop->dst.reg)) {
+        pop->op = INST_NOP;
+        rewrite(p, PEEP_PUSH_POP);
+    } else {
+        *pop = (Inst){INST_MOV, pop->dst, x};
+        rewrite(p, x.kind == OPND_IMM ? PEEP_PUSH_POP_IMM : PEEP_PUSH_POP_MOV);
+    }
+
+    return 1;
+}
+
+// `mov r, rbp` `sub r, N` -> `lea r, [rbp-N]`
+static int frame_lea(Peephole *p, size_t i) {
+    Inst *mov = &p->code[i];
+
+    if (mov->op != INST_MOV || mov->dst.kind != OPND_REG || !is_reg(&mov->src, REG_RBP)) {
+        return 0;
+    }
+
+    size_t k = next_inst(p, i);
+
+    if (k >= p->len) {
+        return 0;
+    }
+
+    Inst *sub = &p->code[k];
+
+    if (sub->op != INST_SUB || !is_reg(&sub->dst, mov->dst.reg) || sub->src.kind != OPND_IMM) {
+        return 0;
+    }
+
+    *sub = (Inst){INST_LEA, mov->dst, {.kind = OPND_MEM, .reg = REG_RBP, .value = -sub->src.value}};
+    mov->op = INST_NOP;
+    rewrite(p, PEEP_FRAME_LEA);
+
+    return 1;
+}
+
+// `lea r, [rbp-N]` ... `[r]` -> `[rbp-N]`
+static int frame_addr(Peephole *p, size_t i) {
+    Inst *lea = &p->code[i];
+    int r = lea->dst.reg;
+
+    if (lea->src.reg != REG_RBP) {
+        return 0;
+    }
+
+    size_t j = next_inst(p, i);
+
+    for (int n = 0; j < p->len && n < PEEPHOLE_WINDOW; j = next_inst(p, j), n++) {
+        Inst *inst = &p->code[j];
+        int reads, writes;
+
+        if (is_barrier(inst)) {
+            return 0;
+        }
+
+        effects(inst, &reads, &writes);
+
+        if (reads & REG_BIT(r)) {
+            break;
+        }
+        if (writes & REG_BIT(r)) {
+            return 0;
+        }
+    }
+
+    if (j >= p->len) {
+        return 0;
+    }
+
+    // Address must be used only as base of memory operand of `mov`
+    Inst *use = &p->code[j];
+    Operand *addr;
+
+    if (use->op != INST_MOV) {
+        return 0;
+    }
+
+    if (use->src.kind == OPND_MEM && use->src.reg == r && use->dst.kind == OPND_REG) {
+        addr = &use->src;
+    } else if (use->dst.kind == OPND_MEM && use->dst.reg == r && !is_reg(&use->src, r)) {
+        addr = &use->dst;
+    } else {
+        return 0;
+    }
+
+    if (!is_reg(&use->dst, r) && !is_dead(p, next_inst(p, j), r)) {
+        return 0;
+    }
+
+    *addr = (Operand){.kind = OPND_MEM, .reg = REG_RBP, .value = addr->value + lea->src.value};
+    lea->op = INST_NOP;
+    rewrite(p, PEEP_FRAME_ADDR);
+
+    return 1;
+}
+
+// `lea r, [rbp-N]` `push r` ... `pop d` -> `lea r, [rbp-N]` ... `lea d, [rbp-N]`
+// (code between them may push and pop as long as it's balanced)
+static int frame_remat(Peephole *p, size_t i) {
+    Inst *lea = &p->code[i];
+
+    if (lea->src.reg != REG_RBP) {
+        return 0;
+    }
+
+    size_t j = next_inst(p, i);
+
+    if (j >= p->len || p->code[j].op != INST_PUSH || !is_reg(&p->code[j].dst, lea->dst.reg)) {
+        return 0;
+    }
+
+    int depth = 0;
+    size_t k = next_inst(p, j);
+
+    for (int n = 0; k < p->len && n < PEEPHOLE_REMAT_WINDOW; k = next_inst(p, k), n++) {
+        Inst *inst = &p->code[k];
+        int reads, writes;
+
+        if (is_barrier(inst)) {
+            return 0;
+        }
+
+        if (inst->op == INST_PUSH) {
+            depth++;
+            continue;
+        }
+
+        if (inst->op == INST_POP) {
+            if (depth-- == 0) {
+                break;
+            }
+            continue;
+        }
+
+        effects(inst, &reads, &writes);
+
+        if (writes & REG_BIT(REG_RSP)) {
+            return 0;
+        }
+    }
+
+    if (k >= p->len || p->code[k].op != INST_POP || p->code[k].dst.kind != OPND_REG) {
+        return 0;
+    }
+
+    p->code[j].op = INST_NOP;
+    p->code[k] = (Inst){INST_LEA, p->code[k].dst, lea->src};
+    rewrite(p, PEEP_FRAME_REMAT);
+
+    return 1;
+}
+
+// Whether `inst` can take immediate instead of register `r` in `src`
+static int takes_imm(Inst *inst, int r) {
+    if (!is_reg(&inst->src, r)) {
+        return 0;
+    }
+
+    switch (inst->op) {
+    case INST_MOV:
+        return !is_reg(&inst->dst, r) && !(inst->dst.kind == OPND_MEM && inst->dst.reg == r);
+    case INST_ADD:
+    case INST_SUB:
+    case INST_CMP:
+        return inst->dst.kind == OPND_REG && inst->dst.reg != r;
+    default:
+        return 0;
+    }
+}
+
+// `mov r, imm` ... `op x, r` -> `op x, imm` (for each use of `r` until it's written)
+static int imm_operand(Peephole *p, size_t i) {
+    Inst *mov = &p->code[i];
+
+    if (mov->op != INST_MOV || mov->dst.kind != OPND_REG || mov->src.kind != OPND_IMM) {
+        return 0;
+    }
+
+    int r = mov->dst.reg;
+    int changed = 0;
+    size_t j = next_inst(p, i);
+
+    for (int n = 0; j < p->len && n < PEEPHOLE_WINDOW; j = next_inst(p, j), n++) {
+        Inst *inst = &p->code[j];
+        int reads, writes;
+
+        if (is_barrier(inst)) {
+            break;
+        }
+
+        effects(inst, &reads, &writes);
+
+        if (reads & REG_BIT(r)) {
+            if (!takes_imm(inst, r)) {
+                break;
+            }
+
+            inst->src = mov->src;
+            rewrite(p, PEEP_IMM_OPERAND);
+            changed = 1;
+
+            effects(inst, &reads, &writes);
+        }
+
+        if (writes & REG_BIT(r)) {
+            break;
+        }
+    }
+
+    return changed;
+}
+
+// `mov r, x` `mov d, r` -> `mov d, x` (if `r` is dead after them, `d` may be memory)
+static int mov_forward(Peephole *p, size_t i) {
+    Inst *first = &p->code[i];
+
+    if (first->op != INST_MOV || first->dst.kind != OPND_REG || !(p->scratch & REG_BIT(first->dst.reg))) {
+        return 0;
+    }
+
+    size_t j = next_inst(p, i);
+
+    if (j >= p->len) {
+        return 0;
+    }
+
+    Inst *second = &p->code[j];
+    int r = first->dst.reg;
+
+    if (second->op != INST_MOV || !is_reg(&second->src, r)) {
+        return 0;
+    }
+
+    // Store takes register or immediate (not memory), and its address must not be `r`
+    if (second->dst.kind == OPND_MEM && (first->src.kind == OPND_MEM || second->dst.reg == r)) {
+        return 0;
+    }
+
+    if (!is_reg(&second->dst, r) && !is_dead(p, next_inst(p, j), r)) {
+        return 0;
+    }
+
+    second->src = first->src;
+    first->op = INST_NOP;
+    rewrite(p, PEEP_MOV_FORWARD);
+
+    return 1;
+}
+
+// `mov [m], r` `mov d, [m]` -> `mov [m], r` `mov d, r` (nothing if `d` is `r`)
+static int store_load(Peephole *p, size_t i) {
+    Inst *store = &p->code[i];
+
+    if (store->op != INST_MOV || store->dst.kind != OPND_MEM || store->src.kind != OPND_REG) {
+        return 0;
+    }
+
+    size_t j = next_inst(p, i);
+
+    if (j >= p->len) {
+        return 0;
+    }
+
+    Inst *load = &p->code[j];
+    Operand *m = &store->dst;
+
+    if (load->op != INST_MOV || load->dst.kind != OPND_REG || load->src.kind != OPND_MEM ||
+        load->src.reg != m->reg || load->src.value != m->value) {
+        return 0;
+    }
+
+    if (is_reg(&load->dst, store->src.reg)) {
+        load->op = INST_NOP;
+    } else {
+        load->src = store->src;
+    }
+    rewrite(p, PEEP_STORE_LOAD);
+
+    return 1;
+}
+
+// `mov r, x` -> (nothing) if `r` is dead
+// (`add` and `sub` too: codegen never reads flags except of `cmp`)
+static int dead_code(Peephole *p, size_t i) {
+    Inst *inst = &p->code[i];
+    int r = inst->dst.reg;
+
+    if (inst->dst.kind != OPND_REG || !(p->scratch & REG_BIT(r))) {
+        return 0;
+    }
+
+    if (!is_reg(&inst->src, r) || inst->op != INST_MOV) {
+        if (!is_dead(p, next_inst(p, i), r)) {
+            return 0;
+        }
+    }
+
+    inst->op = INST_NOP;
+    rewrite(p, PEEP_DEAD_CODE);
+
+    return 1;
+}
+
+// Remove `INST_NOP`s
+static void compact(InstVec *code) {
+    size_t len = 0;
+
+    for (size_t i = 0; i < code->len; i++) {
+        if (code->data[i].op != INST_NOP) {
+            code->data[len++] = code->data[i];
+        }
+    }
+
+    code->len = len;
+}
+
+/* Peephole optimizer */
+
+// Rewrite `code` in place. `live_out` is the mask of registers read after it,
+// `scratch` is the mask of registers which may be removed, and `counts` is
+// incremented for each rewrite by rule.
+void peephole(InstVec *code, int live_out, int scratch, long *counts) {
+    int changed;
+
+    do {
+        Peephole p = {code->data, code->len, live_out, scratch, counts};
+        changed = 0;
+
+        for (size_t i = p.len; i-- > 0;) {
+            switch (p.code[i].op) {
+            case INST_PUSH:
+                changed |= push_pop(&p, i);
+                break;
+            case INST_MOV:
+                if (frame_lea(&p, i) || imm_operand(&p, i) || mov_forward(&p, i) || store_load(&p, i) ||
+                    dead_code(&p, i)) {
+                    changed = 1;
+                }
+                break;
+            case INST_LEA:
+                if (frame_addr(&p, i) || frame_remat(&p, i) || dead_code(&p, i)) {
+                    changed = 1;
+                }
+                break;
+            case INST_MOVZX:
+            case INST_ADD:
+            case INST_SUB:
+                changed |= dead_code(&p, i);
+                break;
+            }
+        }
+
+        compact(code);
+    } while (changed);
+}
+
+void peephole_dump_stats(long *counts, FILE *out) {
+    long total = 0;
+
+    fprintf(out, "peephole stats:\n");
+
+    for (int i = 0; i < PEEP_NUM_RULES; i++) {
+        fprintf(out, "  %-26s %8ld\n", rule_names[i], counts[i]);
+        total += counts[i];
+    }
+
+    fprintf(out, "  %-26s %8ld\n", "total", total);
+}
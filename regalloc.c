@@ -0,0 +1,276 @@
+/*
+ * Register allocator (linear scan)
+ *
+ * Virtual registers of IR (out of SSA) are mapped to general purpose
+ * registers, and the rest is spilled to stack slots.
+ *
+ * Blocks are laid out in reverse postorder and the program has no loops,
+ * so every path goes forward in the layout. Thus a virtual register is live
+ * only between its first definition and its last use (in the order of
+ * instructions), and the interval is used as its live range.
+ *
+ * Intervals are visited in order of start. When no register is free, the
+ * interval which ends last is spilled (Poletto & Sarkar). Then spilled
+ * intervals are given stack slots in the same way, with unlimited slots,
+ * so that intervals which don't overlap share a slot.
+ *
+ * Variables of the AST code generator share stack slots in the same way.
+ * Their intervals are counted in statements (in order of source, arms of
+ * `if` one after another), so a variable which is used only within a block
+ * or an arm of `if` gives its slot to variables after it.
+ */
+
+#include "0cc.h"
+
+// Registers given to virtual registers (caller-saved ones first,
+// since callee-saved ones must be saved by prologue)
+static int alloc_regs[] = {
+    REG_RCX, REG_RSI, REG_R8, REG_R9, REG_R10, REG_R11, REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+
+#define NUM_ALLOC_REGS (int)(sizeof(alloc_regs) / sizeof(alloc_regs[0]))
+
+// Live intervals of virtual registers
+typedef struct {
+    int *start; // number of the first instruction which defines virtual register
+    int *end; // number of the last instruction which reads or writes it
+    IntVec order; // virtual registers in order of start
+} Intervals;
+
+static void compute_intervals(Ir *ir, Intervals *iv) {
+    int pos = 0;
+
+    iv->start = calloc(ir->reg_count + 1, sizeof(int));
+    iv->end = calloc(ir->reg_count + 1, sizeof(int));
+    intvec_init(&iv->order);
+
+    for (size_t i = 0; i < ir->blocks.len; i++) {
+        IrBlock *block = ir->blocks.data[i];
+
+        for (size_t j = 0; j < block->insts.len; j++) {
+            IrInst *inst = &block->insts.data[j];
+            pos++;
+
+            if (inst->a != 0) {
+                iv->end[inst->a] = pos;
+            }
+            if (inst->b != 0) {
+                iv->end[inst->b] = pos;
+            }
+            if (inst->dst != 0) {
+                if (iv->start[inst->dst] == 0) {
+                    iv->start[inst->dst] = pos;
+                    intvec_push(&iv->order, inst->dst);
+                }
+                iv->end[inst->dst] = pos;
+            }
+        }
+    }
+}
+
+// Insert `r` to `active` which is sorted by end
+static void activate(IntVec *active, int *end, int r) {
+    size_t i = active->len;
+
+    intvec_push(active, r);
+
+    for (; i > 0 && end[active->data[i - 1]] > end[r]; i--) {
+        active->data[i] = active->data[i - 1];
+    }
+
+    active->data[i] = r;
+}
+
+// Give each of `regs` (in order of start) one of `limit` resources (unlimited if < 0),
+// and store it to `assigned` (-1 if spilled). Return the number of resources used.
+//
+// An interval which starts where another one ends doesn't take over its resource,
+// so the destination of an instruction is never at the same place as its operands.
+static int linear_scan(Intervals *iv, IntVec *regs, int limit, int *assigned) {
+    IntVec active; // virtual registers which have resources, sorted by end
+    IntVec free_list;
+    int count = 0;
+
+    intvec_init(&active);
+    intvec_init(&free_list);
+
+    for (size_t i = 0; i < regs->len; i++) {
+        int r = regs->data[i];
+        size_t expired = 0;
+
+        while (expired < active.len && iv->end[active.data[expired]] < iv->start[r]) {
+            intvec_push(&free_list, assigned[active.data[expired++]]);
+        }
+
+        memmove(active.data, active.data + expired, sizeof(int) * (active.len - expired));
+        active.len -= expired;
+
+        int res;
+
+        if (free_list.len > 0) {
+            // The lowest one (caller-saved registers are preferred)
+            size_t min = 0;
+
+            for (size_t k = 1; k < free_list.len; k++) {
+                if (free_list.data[k] < free_list.data[min]) {
+                    min = k;
+                }
+            }
+
+            res = free_list.data[min];
+            free_list.data[min] = free_list.data[--free_list.len];
+        } else if (limit < 0 || count < limit) {
+            res = count++;
+        } else if (active.len > 0 && iv->end[active.data[active.len - 1]] > iv->end[r]) {
+            // Spill the interval which ends last instead
+            int last = active.data[--active.len];
+
+            res = assigned[last];
+            assigned[last] = -1;
+        } else {
+            assigned[r] = -1;
+            continue;
+        }
+
+        assigned[r] = res;
+        activate(&active, iv->end, r);
+    }
+
+    intvec_destroy(&active);
+    intvec_destroy(&free_list);
+
+    return count;
+}
+
+// Set `ir->locs`. If `use_regs` is 0, every virtual register is spilled.
+void allocate_registers(Ir *ir, int use_regs) {
+    Intervals iv;
+    int *assigned = malloc(sizeof(int) * (ir->reg_count + 1));
+    IntVec spilled;
+
+    compute_intervals(ir, &iv);
+    intvec_init(&spilled);
+
+    linear_scan(&iv, &iv.order, use_regs ? NUM_ALLOC_REGS : 0, assigned);
+
+    ir->locs = calloc(ir->reg_count + 1, sizeof(IrLoc));
+    ir->used_regs = 0;
+
+    for (size_t i = 0; i < iv.order.len; i++) {
+        int r = iv.order.data[i];
+
+        if (assigned[r] < 0) {
+            ir->locs[r].reg = -1;
+            intvec_push(&spilled, r);
+        } else {
+            ir->locs[r].reg = alloc_regs[assigned[r]];
+            ir->used_regs |= 1 << ir->locs[r].reg;
+        }
+    }
+
+    ir->slot_count = linear_scan(&iv, &spilled, -1, assigned);
+
+    for (size_t i = 0; i < spilled.len; i++) {
+        ir->locs[spilled.data[i]].slot = assigned[spilled.data[i]] + 1;
+    }
+
+    intvec_destroy(&spilled);
+    intvec_destroy(&iv.order);
+    free(iv.start);
+    free(iv.end);
+    free(assigned);
+}
+
+/* Stack slots of variables */
+
+// Statement numbers where variable (by index in `vars`) is first & last used
+static void touch_vars(Compiler *cc, Intervals *iv, NodeId id, int pos) {
+    NodeIdVec stack;
+
+    nodeidvec_init(&stack);
+    nodeidvec_push(&stack, id);
+
+    while (stack.len > 0) {
+        Node *node = &cc->ast->nodes.data[stack.data[--stack.len]];
+
+        switch (node->type) {
+        case NODE_NUM:
+            break;
+        case NODE_IDENT: {
+            // Offset given by parser is `(index + 1) * 8`
+            int var = map_get(cc->vars, node->name) / 8;
+
+            if (iv->start[var] == 0) {
+                iv->start[var] = pos;
+                intvec_push(&iv->order, var);
+            }
+            iv->end[var] = pos;
+            break;
+        }
+        default:
+            // Left operand is touched first
+            nodeidvec_push(&stack, node->rhs);
+            nodeidvec_push(&stack, node->lhs);
+        }
+    }
+
+    nodeidvec_destroy(&stack);
+}
+
+static void scan_stmt(Compiler *cc, Intervals *iv, NodeId id, int *pos) {
+    Node *node = &cc->ast->nodes.data[id];
+
+    switch (node->type) {
+    case NODE_BLOCK:
+        for (uint32_t i = 0; i < node->list.len; i++) {
+            scan_stmt(cc, iv, cc->ast->extra.data[node->list.first + i], pos);
+        }
+        return;
+    case NODE_IF:
+        touch_vars(cc, iv, node->lhs, ++*pos);
+
+        for (int i = 0; i < 2; i++) {
+            NodeId body = cc->ast->extra.data[node->rhs + i];
+
+            if (body != 0) {
+                scan_stmt(cc, iv, body, pos);
+            }
+        }
+        return;
+    case NODE_RETURN:
+        touch_vars(cc, iv, node->lhs, ++*pos);
+        return;
+    default:
+        touch_vars(cc, iv, id, ++*pos);
+    }
+}
+
+// Give variables stack slots (offsets in `vars`) and set `cc->frame_size`.
+// If `share` is 0, offsets given by parser are kept.
+void allocate_slots(Compiler *cc, int share) {
+    int nvars = cc->vars->keys.len;
+    int count = nvars;
+
+    if (share) {
+        Intervals iv = {calloc(nvars + 1, sizeof(int)), calloc(nvars + 1, sizeof(int))};
+        int *assigned = malloc(sizeof(int) * (nvars + 1));
+        int pos = 0;
+
+        intvec_init(&iv.order);
+        scan_stmt(cc, &iv, cc->root, &pos);
+
+        count = linear_scan(&iv, &iv.order, -1, assigned);
+
+        for (size_t i = 0; i < iv.order.len; i++) {
+            int var = iv.order.data[i];
+            cc->vars->vals.data[var - 1] = (assigned[var] + 1) * 8L;
+        }
+
+        intvec_destroy(&iv.order);
+        free(iv.start);
+        free(iv.end);
+        free(assigned);
+    }
+
+    cc->frame_size = align_frame(count * 8L);
+}
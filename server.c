@@ -0,0 +1,353 @@
+/*
+ * Compile server
+ *
+ * `0cc -server` listens on a Unix domain socket and compiles sources sent
+ * by `0cc -client`. Each worker thread keeps its compiler context and only
+ * resets it between requests, so a request pays neither process startup
+ * nor setting up vectors, maps and arenas.
+ *
+ * Message format (each integer is uint32_t in host byte order, and each
+ * string is sent as its length followed by its bytes):
+ *
+ *   request:  argc, argv[0] ... argv[argc - 1], source name, source
+ *   response: status, assembly, diagnostics
+ */
+
+// for open_memstream(3)
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "0cc.h"
+
+// Reject requests bigger than this
+#define MAX_MESSAGE_FIELD (1024 * 1024 * 1024)
+
+// Socket path of running server (removed on exit)
+static char *server_path;
+
+/* Message functions */
+
+static int write_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+
+        p += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t got = read(fd, p, len);
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+
+        p += got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+static int send_u32(int fd, uint32_t value) {
+    return write_all(fd, &value, sizeof(value));
+}
+
+static int recv_u32(int fd, uint32_t *value) {
+    return read_all(fd, value, sizeof(*value));
+}
+
+static int send_field(int fd, char *data, size_t len) {
+    if (send_u32(fd, len) < 0) {
+        return -1;
+    }
+
+    return write_all(fd, data, len);
+}
+
+// Receive string field ('\0' is appended). Return NULL on error.
+static char *recv_field(int fd, uint32_t *len) {
+    if (recv_u32(fd, len) < 0 || *len > MAX_MESSAGE_FIELD) {
+        return NULL;
+    }
+
+    char *data = malloc(*len + 1);
+
+    if (read_all(fd, data, *len) < 0) {
+        free(data);
+        return NULL;
+    }
+
+    data[*len] = '\0';
+    return data;
+}
+
+/* Server */
+
+char *default_socket_path() {
+    static char path[108];
+
+    char *tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL || *tmpdir == '\0') {
+        tmpdir = "/tmp";
+    }
+
+    snprintf(path, sizeof(path), "%s/0cc-%d.sock", tmpdir, (int)getuid());
+
+    return path;
+}
+
+static int socket_address(char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+// Connect to server. Return -1 if no server is running.
+static int connect_server(char *path) {
+    struct sockaddr_un addr;
+
+    if (socket_address(path, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Compile one request with (reused) compiler context
+static void handle_request(Compiler *cc, int fd) {
+    uint32_t argc;
+
+    if (recv_u32(fd, &argc) < 0 || argc > 256) {
+        return;
+    }
+
+    char **argv = calloc(argc + 1, sizeof(char *));
+    uint32_t len;
+    char *name = NULL;
+    char *data = NULL;
+    int ok = 1;
+
+    for (uint32_t i = 0; i < argc && ok; i++) {
+        ok = (argv[i] = recv_field(fd, &len)) != NULL;
+    }
+
+    ok = ok && (name = recv_field(fd, &len)) != NULL;
+    ok = ok && (data = recv_field(fd, &len)) != NULL;
+
+    Options opts = {0};
+
+    for (int i = 0; i < (int)argc && ok; i++) {
+        ok = parse_option(&opts, argc, argv, &i) == 1;
+    }
+
+    if (ok) {
+        // Requests are already served concurrently
+        opts.jobs = 1;
+
+        Source src = {name, data, len, 0};
+        Emitter *out = new_buffer_emitter();
+        char *diag_buf = NULL;
+        size_t diag_len = 0;
+        FILE *diag = open_memstream(&diag_buf, &diag_len);
+
+        reset_compiler(cc, &opts, &src, out, diag);
+        int status = run_compiler(cc);
+
+        fclose(diag);
+
+        if (send_u32(fd, status) == 0 && send_field(fd, out->buf, out->len) == 0) {
+            send_field(fd, diag_buf, diag_len);
+        }
+
+        free(diag_buf);
+        emit_close(out);
+    }
+
+    for (uint32_t i = 0; i < argc; i++) {
+        free(argv[i]);
+    }
+    free(argv);
+    free(name);
+    free(data);
+}
+
+static void *server_worker(void *arg) {
+    int listen_fd = *(int *)arg;
+    Compiler *cc = new_compiler(NULL, NULL, NULL, NULL);
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        handle_request(cc, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static void stop_server(int sig) {
+    unlink(server_path);
+    _exit(0);
+}
+
+// Serve compile requests on `path` with `workers` threads (never returns unless failed)
+int run_server(char *path, int workers) {
+    struct sockaddr_un addr;
+
+    if (socket_address(path, &addr) < 0) {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return 1;
+    }
+
+    // Remove stale socket, but don't steal it from running server
+    int running = connect_server(path);
+    if (running >= 0) {
+        close(running);
+        fprintf(stderr, "Server is already running: %s\n", path);
+        return 1;
+    }
+    unlink(path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0) {
+        fprintf(stderr, "Can't listen on socket: %s\n", path);
+        return 1;
+    }
+
+    server_path = path;
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    pthread_t thread;
+
+    for (int i = 1; i < workers; i++) {
+        pthread_create(&thread, NULL, server_worker, &listen_fd);
+    }
+
+    server_worker(&listen_fd);
+
+    return 0;
+}
+
+/* Client */
+
+// Forward compile request to server, and write its result like in-process compilation.
+// Return -1 (without doing anything) if no server is running.
+int run_client(char *path, StrVec *args, char *input, char *output) {
+    Source *src = is_source_path(input) ? new_source_file(input) : new_source_string("<command line>", input);
+
+    if (src == NULL) {
+        fprintf(stderr, "Can't read input file: %s\n", input);
+        return 1;
+    }
+
+    int fd = connect_server(path);
+
+    if (fd < 0) {
+        close_source(src);
+        return -1;
+    }
+
+    int ok = send_u32(fd, args->len) == 0;
+
+    for (size_t i = 0; i < args->len && ok; i++) {
+        char *arg = args->data[i];
+        ok = send_field(fd, arg, strlen(arg)) == 0;
+    }
+
+    ok = ok && send_field(fd, src->name, strlen(src->name)) == 0;
+    ok = ok && send_field(fd, src->data, src->len) == 0;
+
+    close_source(src);
+
+    uint32_t status;
+    uint32_t asm_len;
+    uint32_t diag_len;
+    char *assembly = NULL;
+    char *diag = NULL;
+
+    ok = ok && recv_u32(fd, &status) == 0;
+    ok = ok && (assembly = recv_field(fd, &asm_len)) != NULL;
+    ok = ok && (diag = recv_field(fd, &diag_len)) != NULL;
+
+    close(fd);
+
+    if (!ok) {
+        fprintf(stderr, "Lost connection to server: %s\n", path);
+        free(assembly);
+        free(diag);
+        return 1;
+    }
+
+    fwrite(diag, 1, diag_len, stderr);
+
+    Emitter *out = output ? new_file_emitter(output) : new_emitter(1);
+
+    if (out == NULL) {
+        fprintf(stderr, "Can't open output file: %s\n", output);
+        status = 1;
+    } else {
+        Emitter received = {assembly, asm_len, asm_len, -1};
+        emit_append(out, &received);
+        emit_close(out);
+    }
+
+    free(assembly);
+    free(diag);
+
+    return status;
+}
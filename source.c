@@ -0,0 +1,81 @@
+/*
+ * Source input
+ *
+ * Source files are memory-mapped read-only, so loading costs nearly
+ * nothing even for huge inputs. The mapped buffer is NOT terminated by
+ * '\0', so readers must use `len`.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "0cc.h"
+
+// Source given as string (e.g. command line argument)
+Source *new_source_string(char *name, char *str) {
+    Source *src = malloc(sizeof(Source));
+
+    src->name = name;
+    src->data = str;
+    src->len = strlen(str);
+    src->mapped = 0;
+
+    return src;
+}
+
+// Source given as file (mapped to memory), NULL if it can't be read
+Source *new_source_file(char *path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    Source *src = malloc(sizeof(Source));
+
+    src->name = path;
+    src->len = st.st_size;
+    src->mapped = 0;
+    src->data = "";
+
+    // mmap(2) rejects zero length
+    if (src->len > 0) {
+        src->data = mmap(NULL, src->len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (src->data == MAP_FAILED) {
+            close(fd);
+            free(src);
+            return NULL;
+        }
+
+        src->mapped = 1;
+    }
+
+    close(fd);
+
+    return src;
+}
+
+void close_source(Source *src) {
+    if (src->mapped) {
+        munmap(src->data, src->len);
+    }
+
+    free(src);
+}
+
+// Check whether command line argument names source file
+int is_source_path(char *arg) {
+    size_t len = strlen(arg);
+
+    return len > 2 && strcmp(arg + len - 2, ".c") == 0;
+}
@@ -4,20 +4,24 @@ try() {
   input="$1"
   expected="$2"
 
-  ./0cc "$input" > tmp.s
-  gcc-15 tmp.s -o tmp
-  ./tmp
-  actual="$?"
+  for mode in "" "-stream" "-O0" "-fir" "-O0 -fir"; do
+    ./0cc $mode "$input" > tmp.s
+    gcc-15 tmp.s -o tmp
+    ./tmp
+    actual="$?"
 
-  if [ "$actual" != "$expected" ]; then
-    echo -e "[line $BASH_LINENO] expected: $expected\tinput: '$input'"
-    echo "but got:  $actual"
-    exit 1
-  fi
+    if [ "$actual" != "$expected" ]; then
+      echo -e "[line $BASH_LINENO] expected: $expected\tinput: '$input'\t$mode"
+      echo "but got:  $actual"
+      exit 1
+    fi
+  done
 }
 
 try '0;' 0
 try '42;' 42
+try '4294967338;' 42
+try '99999999999999999999;' 255
 
 try '5-5+10-10;' 0
 try '20+31-9;' 42
@@ -33,6 +37,138 @@ try '(2 + 3 * 4 - 1) * (2 + 4 - 1);' 65
 try '(2 + 3 * 4 - 12 + 5 - 7) * (2 + 4 - 1) * (100 + 23 - 23 + 73 - 42 + 2379 + 10 * 20 - 1) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7) * (2 + 3 * 4 - 12 + 5 - 7);' 0
 try '-3 + 5 * 2;' 7
 try '-3 * +5 + 20;' 5
+try '- -4;' 4
+
+# Constant folding keeps runtime semantics
+try 'a = 1; if (0) a = 1 / 0; return a;' 1
+try '2147483647 + 1 - 2147483647;' 1
+try '100000 * 100000 / 1000000000;' 10
+try '3 - 5 + 4;' 2
+try '(2 < 3) + (3 <= 3) + (4 > 5) + (1 == 1) + (1 != 1);' 3
+try 'a = 7; a + 0 - 0;' 7
+try 'a = 7; 1 * a * 1 / 1;' 7
+try 'a = 7; a * 0 + a - a;' 0
+try 'b = 1; (b = 5) * 0; b;' 5
+try 'b = 1; (b = b + 2) - (b = b + 2); b;' 5
+
+# Constant expressions are folded
+./0cc '(2 + 3 * 4 - 1) * (2 + 4 - 1);' > tmp.s
+if ! grep -q ', 65$' tmp.s || grep -q 'mul' tmp.s; then
+  echo "constant folding: expression is not folded"
+  exit 1
+fi
+
+# Common subexpressions are reused until their variables are assigned
+try 'a = 3; b = 4; c = (a * b + 1) * (a * b + 1) + (b * a); return c;' 181
+try 'a = 3; b = a * 2 + 1; a = a * 2 + 1; c = a * 2 + 1; return b + c;' 22
+try 'a = 2; b = (a = a + 1) + (a + 1) + (a + 1); return b;' 11
+try 'a = 2; x = a * a; if (x == 4) a = 5; return a * a + x;' 29
+try 'a = 2; if (a * a == 4) { b = a * a; a = 3; c = a * a; } return b + c;' 13
+
+./0cc 'a = 3; b = 4; (a * b + 1) * (b * a + 1);' > tmp.s
+if [ "$(grep -c 'mul' tmp.s)" != 2 ]; then
+  echo "cse: common subexpression is not reused"
+  exit 1
+fi
+
+# Dead code, dead stores and statements without effect are removed
+try 'return 3; a = 1 / 0; return a;' 3
+try 'if (1) return 4; return 1 / 0;' 4
+try 'a = 5; if (1) a = 2; else return 9; return a;' 2
+try 'if (0) return 1; else { b = 4; } b;' 4
+try 'x = 3; if (x) {}' 3
+try 'x = 3; if (x) { y = 2; }' 2
+try 'x = 0; 5; if (x) { 6; }' 0
+try '5; {}' 5
+try 'a = 1; b = 2; c = a + 3; d = c; return a;' 1
+try 'a = 2; if (a == 2) return a; else return 0; a = 1 / 0;' 2
+
+./0cc -fno-share-slots 'a = 2; b = a * 3; c = b; x = 1; 4; if (0) x = 5; return x;' > tmp.s
+if ! grep -q 'sub rsp, 16$' tmp.s || grep -q 'rbp-16' tmp.s || grep -q 'mul' tmp.s || grep -q 'push 4$' tmp.s || grep -q 'je' tmp.s; then
+  echo "dce: dead code is not removed"
+  exit 1
+fi
+
+# Peephole optimizer removes push/pop pairs and uses memory & immediate operands
+./0cc -fno-sethi-ullman -peephole-stats 'a = 5; b = a + 2; return b;' > tmp.s 2> tmp-stats.log
+if grep -q 'push [^r]\|pop [^r]' tmp.s || ! grep -q 'mov QWORD PTR \[rbp-8\], 5$' tmp.s || ! grep -q 'add rax, 2$' tmp.s; then
+  echo "peephole: stack machine code is not rewritten"
+  exit 1
+fi
+if ! grep -q 'frame address to \[rbp-N\] *[1-9]' tmp-stats.log; then
+  echo "peephole: rewrites are not reported"
+  cat tmp-stats.log
+  exit 1
+fi
+
+# Expressions are evaluated into registers in Sethi-Ullman order (and on the stack when they run out)
+./0cc 'a = 1; b = 2; c = (a + b) * (a - (b - (a + 3))); c;' > tmp.s
+if grep -q 'push [^r]\|pop [^r]\|push r[^b]\|pop r[^b]' tmp.s; then
+  echo "sethi-ullman: values go through the stack"
+  exit 1
+fi
+try 'a = 9; b = 2; c = 8; (a - b) - (c - (b - (a - 1)));' 249
+try 'a = 9; b = 2; (a / b) - ((a - 1) / (b * 2) / (a - 7));' 3
+try 'a = 9; b = 2; (a < b) + ((a - 7) <= (b * (a - 8))) * 10 + (b != (a - (b * 3 + 1))) * 100;' 10
+deep='a = 1; b = 2; c = 3; d = 1; e = 2; f = 3; g = 1; h = 2; i = 3; j = 1; k = 2; l = 3; m = 1; n = 2; o = 3; p = 1; q = 2; r = 3; s = 1; t = 2; u = 3; v = 1; w = 2; x = 3; y = 1; z = 2; ((((((a + b) * (c - d)) + ((e * f) - (g + h))) * (((i - j) + (k * l)) - ((m + n) * (o - p)))) + ((((q * r) - (s + t)) * ((u - v) + (w * x))) - (((y + z) * (a - b)) + ((c * d) - (e + f))))) * (((((g - h) + (i * j)) - ((k + l) * (m - n))) + (((o * p) - (q + r)) * ((s - t) + (u * v)))) - ((((w + x) * (y - z)) + ((a * b) - (c + d))) * (((e - f) + (g * h)) - ((i + j) * (k - l))))));'
+try "$deep" 250
+./0cc -fno-cse -fno-isel "$deep" > tmp.s
+if ! grep -q 'push r11' tmp.s; then
+  echo "sethi-ullman: registers are not saved when they run out"
+  exit 1
+fi
+
+# Instruction selector uses variables & numbers as memory & immediate operands
+./0cc 'a = 5; b = 7; c = (a + 2) * (b - a) + (10 < a); c;' > tmp.s
+if ! grep -q 'mov QWORD PTR \[rbp-8\], 5$' tmp.s || ! grep -q 'add r.., 2$' tmp.s || ! grep -q 'sub r.., \[rbp-8\]$' tmp.s ||
+  ! grep -q 'cmp r.., \[rbp-8\]$' tmp.s; then
+  echo "isel: operands are not used in place"
+  exit 1
+fi
+try 'a = 5; b = a + (a = 3); b;' 8
+try 'a = 5; b = (a = 3) + a; b;' 6
+try 'a = 5; b = 2 * (a = 3) + a * a; b;' 15
+try 'a = 4; 10 - a * 2 + (3 == a - 1) * 5;' 7
+try 'a = 3; 2 / a + 9 / a + (a != 3) + (1 < a) * 10;' 13
+
+# Division is signed (rounded toward zero), and constant operands are strength-reduced
+try '0 - 7 / 2;' 253
+try 'a = 0 - 7; a / 2;' 253
+try 'a = 0 - 100; b = 7; a / b;' 242
+try 'a = 0 - 100; a / 7 + a / 16 + a / 3;' 203
+try 'a = 100; a / (0 - 7) + a / 1000 + a / 1;' 86
+try 'a = 7; a * 3 + a * 5 + a * 9 + a * 12;' 203
+try 'a = 7; a * 16 + a * 10 + a * 7 - a * 20;' 91
+try 'a = 7; a * (0 - 3) + a * (0 - 4) + 100;' 51
+./0cc 'a = 100; b = a / 7 + a / 8; c = a * 8 + a * 10; b + c;' > tmp.s
+if grep -q 'div' tmp.s || ! grep -q 'shl r.., 3$' tmp.s || ! grep -q 'lea r.., \[r..+r..\*4\]$' tmp.s; then
+  echo "strength reduction: multiplication & division by constant are not lowered"
+  exit 1
+fi
+
+# Variables assigned in both arms of `if` are merged by phi
+./0cc -O0 -dump-ir 'a = 1; if (a) b = 2; else b = 3; b;' > tmp.s 2> tmp-ir.log
+if ! grep -q '= phi \[v[0-9]*, bb[0-9]*\] \[v[0-9]*, bb[0-9]*\]$' tmp-ir.log || grep -q 'load\|store' tmp-ir.log; then
+  echo "ir: variables are not promoted to SSA registers"
+  cat tmp-ir.log
+  exit 1
+fi
+
+# Register allocator keeps values in registers (and spills them when more than 11 are live)
+./0cc -fir 'a = 3; b = a * a; if (b < 10) c = a + b; else c = a - b; c;' > tmp.s
+if grep -q 'push [^r]\|pop [^r]\|\[rbp' tmp.s; then
+  echo "regalloc: values are kept in memory"
+  exit 1
+fi
+try 'a=1; b=2; c=3; d=4; e=5; f=6; g=7; h=8; i=9; j=10; k=11; l=12; m=13; n=14; a*b+c*d+e*f+g*h+i*j+k*l+m*n - (n+m+l+k+j+i+h+g+f+e+d+c+b+a)*3;' 189
+
+# Binary operators are left-associative (`=` is right-associative)
+try '10 - 3 - 2;' 5
+try '100 / 10 / 5;' 2
+try '1 == 2 == 0;' 1
+try '3 > 2 > 1;' 0
+try '1 < 2 <= 1;' 1
+try 'a = b = 3; a + b;' 6
 
 try '1 == 2;' 0
 try '1 == 1;' 1
@@ -112,4 +248,252 @@ try '{ a = 1; return a; }' 1
 try 'a = 1; { a = a + 1; } return a;' 2
 try 'x = 1; if (x == 3) { x = x + 1; } else if (x == 4) { x = x + 2; } else { x = x + 3; } return x;' 4
 
+# Variables which are not used at the same time share stack slots (frame is 16-byte aligned)
+try 'a = 1; { b = a + 1; a = b; } { c = a * 2; a = c; } { d = a + 3; a = d; } a;' 7
+try 'a = 1; if (a) { b = 5; a = a + b; } else { c = 7; a = a + c; } d = a * 3; d + a;' 24
+try 'a = 2; b = a + 1; c = b * 3; if (c > 5) { d = c - a; e = d + b; } else e = 0; f = e * 2; f + a;' 22
+./0cc 'a = 1; { b = a + 1; a = b; } { c = a * 2; a = c; } { d = a + 3; a = d; } e = a; e;' > tmp.s
+if ! grep -q 'sub rsp, 16$' tmp.s || grep -q 'rbp-24' tmp.s; then
+  echo "slots: variables don't share stack slots"
+  exit 1
+fi
+
+# Comparison in condition sets flags for jump, and `if` ~ `else` assigning a variable becomes `cmov`
+try 'a = 5; b = 7; if (a < b) c = a; else c = b; if (b <= a) d = 1; else d = 2; c * 10 + d;' 52
+try 'a = 5; b = 7; if (a == 5) c = 3; else { c = a; } if (a != 5) d = b; else d = 9; c * 10 + d;' 39
+try 'a = 5; b = 7; if (a > b) a = b; else a = 1; a;' 1
+try 'a = 5; if ((a = a + 1) <= 6) b = a; else b = 0; b;' 6
+try 'a = 5; if (a < 3) b = 1;' 0
+try 'a = 5; if (a >= 3) b = 1;' 1
+try 'a = 5; if (a) b = a; else b = 9;' 5
+try 'a = 1; b = 2; if (a < b) {}' 1
+try 'a = 1; b = 2; if (a < b) {} else a = 3;' 1
+try 'b = 31; if ((b <= 0) > (0 - 1536)) {} else 24;' 1
+for mode in "-fno-dce" "-fno-dce -stream" "-fno-dce -fir"; do
+  for pair in "a = 1; b = 2; if (a < b) {}:1" "a = 3; b = 2; if (a < b) {}:0" "a = 1; b = 2; if (a < b) { {} }:1" \
+              "a = 1; b = 2; if (a < b) {} else a = 3;:1" "a = 3; b = 2; if (a < b) a = 3; else {}:0"; do
+    ./0cc $mode "${pair%:*}" > tmp.s
+    gcc-15 tmp.s -o tmp
+    ./tmp
+    if [ "$?" != "${pair#*:}" ]; then
+      echo "if: empty body doesn't leave condition in rax: '${pair%:*}' $mode"
+      exit 1
+    fi
+  done
+done
+./0cc 'a = 5; b = 7; if (a < b) c = 1; a = 9; if (a == b) c = 2; else c = b; c;' > tmp.s
+if grep -q 'set\|movzx\|je' tmp.s || ! grep -q 'jge' tmp.s || ! grep -q 'cmove r.., r..$' tmp.s; then
+  echo "if: condition is not fused with jump, or not converted to cmov"
+  exit 1
+fi
+./0cc -fir 'a = 5; b = 7; if (a < b) c = a + 1; else c = b + 2; c;' > tmp.s
+if grep -q 'set\|movzx\|je' tmp.s || ! grep -q 'jge' tmp.s; then
+  echo "ir: condition is not fused with jump"
+  exit 1
+fi
+
+# Output file
+./0cc -o tmp-out.s 'a = 3; return a * 4;'
+gcc-15 tmp-out.s -o tmp
+./tmp
+if [ "$?" != 12 ]; then
+  echo "-o: expected: 12"
+  exit 1
+fi
+
+# Long and deeply nested expressions don't overflow parser's stack
+{
+  printf 'return 0'
+  for i in $(seq 1 20000); do printf ' + 1 - 1'; done
+  printf ' + 7 + '
+  for i in $(seq 1 5000); do printf '('; done
+  printf '3'
+  for i in $(seq 1 5000); do printf ')'; done
+  printf ';\n'
+} > tmp-in.c
+./0cc tmp-in.c > tmp.s
+gcc-15 tmp.s -o tmp
+./tmp
+if [ "$?" != 10 ]; then
+  echo "long expression: expected: 10"
+  exit 1
+fi
+
+# ... nor stack of later passes (variables aren't folded, so every pass walks the whole tree)
+{
+  printf 'a = 1;\nreturn a'
+  printf ' + a%.0s' $(seq 1 100000)
+  printf ';\n'
+} > tmp-in.c
+for mode in "" "-stream" "-O0" "-fir" "-O0 -fir" "-fno-dce"; do
+  ./0cc $mode tmp-in.c > tmp.s
+  gcc-15 tmp.s -o tmp
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" != 161 ]; then
+    echo "long expression of variables: expected: 161 $mode"
+    echo "but got:  $actual"
+    exit 1
+  fi
+done
+
+# Deeply nested statements are compiled up to the limit, and rejected beyond it
+nested_ifs() {
+  printf 'a = 1;\n'
+  printf 'if (a) %.0s' $(seq 1 $1)
+  printf 'a = 2;\n'
+}
+nested_ifs 9999 > tmp-in.c
+for mode in "" "-stream" "-O0" "-fir" "-O0 -fir" "-fno-dce"; do
+  ./0cc $mode tmp-in.c > tmp.s
+  gcc-15 tmp.s -o tmp
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" != 2 ]; then
+    echo "deeply nested if: expected: 2 $mode"
+    echo "but got:  $actual"
+    exit 1
+  fi
+done
+nested_ifs 10000 > tmp-in.c
+./0cc tmp-in.c > tmp.s 2> tmp.err
+if [ "$?" != 1 ] || ! grep -q 'nested too deeply' tmp.err; then
+  echo "deeply nested if: expected: nesting error"
+  cat tmp.err
+  exit 1
+fi
+
+# Source file input
+printf 'a = 2;\nb = a * 20 + 2;\nreturn b;\n' > tmp-in.c
+./0cc tmp-in.c > tmp.s
+gcc-15 tmp.s -o tmp
+./tmp
+if [ "$?" != 42 ]; then
+  echo "file input: expected: 42"
+  exit 1
+fi
+
+# Many source files are compiled concurrently to `*.s`
+printf 'return 3;' > tmp-a.c
+printf 'a = 4; return a;' > tmp-b.c
+./0cc -j 2 tmp-a.c tmp-b.c
+for pair in a:3 b:4; do
+  gcc-15 "tmp-${pair%:*}.s" -o tmp
+  ./tmp
+  if [ "$?" != "${pair#*:}" ]; then
+    echo "multiple files: expected: ${pair#*:} for tmp-${pair%:*}.c"
+    exit 1
+  fi
+done
+
+# Output doesn't depend on number of codegen threads
+for i in $(seq 1 3000); do
+  echo "v$((i % 7)) = v$((i % 5)) + $i; if (v$((i % 3)) < $i) v1 = v1 - 1; else v2 = 2;"
+done > tmp-big.c
+./0cc -j 1 tmp-big.c > tmp-1.s
+./0cc -j 4 tmp-big.c > tmp-4.s
+if ! cmp -s tmp-1.s tmp-4.s; then
+  echo "parallel codegen: output differs between -j 1 and -j 4"
+  exit 1
+fi
+
+# Compile server
+./0cc -client -socket ./tmp-0cc.sock 'return 5;' > tmp.s
+gcc-15 tmp.s -o tmp
+./tmp
+if [ "$?" != 5 ]; then
+  echo "client without server: expected: 5"
+  exit 1
+fi
+
+./0cc -server -socket ./tmp-0cc.sock &
+server_pid=$!
+for i in $(seq 1 50); do
+  [ -S ./tmp-0cc.sock ] && break
+  sleep 0.1
+done
+./0cc -client -socket ./tmp-0cc.sock tmp-big.c > tmp-client.s
+client_status=$?
+./0cc -client -socket ./tmp-0cc.sock 'a = ;' 2> tmp-client.err
+error_status=$?
+kill $server_pid
+wait $server_pid 2>/dev/null
+if [ "$client_status" != 0 ] || ! cmp -s tmp-1.s tmp-client.s; then
+  echo "server: output differs from in-process compilation"
+  exit 1
+fi
+if [ "$error_status" != 1 ] || ! grep -q "<command line>:1:5" tmp-client.err; then
+  echo "server: diagnostics are not forwarded"
+  exit 1
+fi
+
+# Compilation cache
+rm -rf tmp-cache
+./0cc -cache-dir tmp-cache -cache-stats tmp-big.c > tmp-miss.s 2> tmp-cache.log
+./0cc -cache-dir tmp-cache -cache-stats tmp-big.c > tmp-hit.s 2>> tmp-cache.log
+if ! cmp -s tmp-1.s tmp-miss.s || ! cmp -s tmp-1.s tmp-hit.s; then
+  echo "cache: output differs from uncached compilation"
+  exit 1
+fi
+if [ "$(cat tmp-cache.log)" != "$(printf 'cache stats: 0 hits, 1 misses, 0 evictions\ncache stats: 1 hits, 0 misses, 0 evictions')" ]; then
+  echo "cache: unexpected stats"
+  cat tmp-cache.log
+  exit 1
+fi
+./0cc -cache-dir tmp-cache -cache-size 1 -cache-stats 'return 1;' > /dev/null 2> tmp-cache.log
+if [ "$(ls tmp-cache | wc -l)" != 0 ] || ! grep -q "2 evictions" tmp-cache.log; then
+  echo "cache: entries are not evicted"
+  exit 1
+fi
+rm -rf tmp-cache
+
+# Identifiers with `_`, and keywords as prefix of identifiers
+try '_a = 3; a_1 = 4; return _a + a_1;' 7
+try 'ifs = 2; elses = 3; returned = ifs + elses; returned;' 5
+try 'if (1) if_ = 9; else else_ = 1; if_;' 9
+
+# Scalar lexer generates the same code as SIMD lexer
+./0cc -fno-simd-lexer tmp-big.c > tmp-out.s
+if ! cmp -s tmp-1.s tmp-out.s; then
+  echo "-fno-simd-lexer: output differs"
+  exit 1
+fi
+
+# Object file (-c) has the same code as assembled output (a long `if` body needs 32-bit jumps)
+{
+  echo "a = 3; b = 0; if (a < 5) {"
+  for i in $(seq 1 40); do echo "b = b + a * $i;"; done
+  echo "} else b = 1; b / 7 - b / 7 / 256 * 256;"
+} > tmp-obj.c
+for src in tmp-big.c tmp-obj.c; do
+  for mode in "" "-O0" "-fir" "-O0 -fir"; do
+    ./0cc $mode -c -o tmp-obj.o $src
+    ./0cc $mode $src > tmp-obj.s
+    as tmp-obj.s -o tmp-ref.o
+    if ! diff <(objdump -d -M intel tmp-obj.o | tail -n +3) <(objdump -d -M intel tmp-ref.o | tail -n +3) > /dev/null; then
+      echo "-c: code differs from assembler $mode ($src)"
+      exit 1
+    fi
+  done
+done
+gcc-15 tmp-obj.o -o tmp -Wl,--defsym=main=_main -z noexecstack -no-pie
+./tmp
+if [ "$?" != 95 ]; then
+  echo "-c: expected: 95"
+  exit 1
+fi
+if ! objdump -d tmp-obj.o | grep -qE '0f 8d .*jge' || ! objdump -d tmp-obj.o | grep -qE 'eb .*jmp'; then
+  echo "-c: jumps are not relaxed"
+  exit 1
+fi
+
+# Error position is resolved from source offset
+printf 'a = 1;\nb = (a + 2;\n' > tmp-in.c
+if [ "$(./0cc tmp-in.c 2>&1 | head -1)" != "tmp-in.c:2:11: Unexpected token, expect ')'" ]; then
+  echo "error position: unexpected message"
+  exit 1
+fi
+
 echo OK